@@ -0,0 +1,183 @@
+/**
+   @file battery.c
+
+   Publisher side filter for battery level updates.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/battery.h"
+#include "dsme_internal.h"
+
+#include <stdlib.h>
+
+/* ------------------------------------------------------------------------- *
+ * Filter
+ * ------------------------------------------------------------------------- */
+
+struct dsme_battery_filter_t
+{
+    dsme_battery_filter_config_t config;
+
+    /** Last level passed on, and when */
+    dsme_battery_level_t         published;
+    int64_t                      published_ns;
+
+    /** Latest level held back by the minimum interval */
+    bool                         pending;
+};
+
+/** Check for changes that are passed on regardless of the interval */
+static bool
+battery_filter_forced(const dsme_battery_filter_t *filter,
+                      dsme_battery_level_t level)
+{
+    dsme_battery_level_t prev = filter->published;
+    int                  low  = filter->config.low_level;
+
+    if( prev == DSME_BATTERY_LEVEL_UNKNOWN ||
+        level == DSME_BATTERY_LEVEL_UNKNOWN )
+        return true;
+
+    /* Reaching or leaving either end of the range */
+    if( level == DSME_BATTERY_LEVEL_MINIMUM ||
+        level == DSME_BATTERY_LEVEL_MAXIMUM ||
+        prev  == DSME_BATTERY_LEVEL_MINIMUM ||
+        prev  == DSME_BATTERY_LEVEL_MAXIMUM )
+        return true;
+
+    if( low >= 0 && (prev > low) != (level > low) )
+        return true;
+
+    return false;
+}
+
+dsme_battery_filter_t *
+dsme_battery_filter_new(const dsme_battery_filter_config_t *config)
+{
+    dsme_battery_filter_t *filter = calloc(1, sizeof *filter);
+
+    if( !filter )
+        return 0;
+
+    if( config )
+        filter->config = *config;
+    else
+        filter->config.low_level = -1;
+    filter->published = DSME_BATTERY_LEVEL_UNKNOWN;
+    return filter;
+}
+
+void
+dsme_battery_filter_free(dsme_battery_filter_t *filter)
+{
+    free(filter);
+}
+
+/** Check whether a level should be passed on, without taking it */
+static bool
+battery_filter_check(dsme_battery_filter_t *filter,
+                     dsme_battery_level_t level,
+                     int64_t now_ns)
+{
+    const dsme_battery_filter_config_t *cfg = &filter->config;
+    unsigned                            change;
+
+    if( level == filter->published ) {
+        filter->pending = false;
+        return false;
+    }
+
+    if( !battery_filter_forced(filter, level) ) {
+        change = abs((int)level - (int)filter->published);
+        if( change < cfg->hysteresis ) {
+            filter->pending = false;
+            return false;
+        }
+        if( now_ns - filter->published_ns <
+            cfg->min_interval_ms * INT64_C(1000000) ) {
+            filter->pending = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/** Take a level as the last one passed on */
+static void
+battery_filter_commit(dsme_battery_filter_t *filter,
+                      dsme_battery_level_t level,
+                      int64_t now_ns)
+{
+    filter->published    = level;
+    filter->published_ns = now_ns;
+    filter->pending      = false;
+}
+
+bool
+dsme_battery_filter_update(dsme_battery_filter_t *filter,
+                           dsme_battery_level_t level,
+                           int64_t now_ns)
+{
+    if( !battery_filter_check(filter, level, now_ns) )
+        return false;
+
+    battery_filter_commit(filter, level, now_ns);
+    return true;
+}
+
+int64_t
+dsme_battery_filter_due_ns(const dsme_battery_filter_t *filter)
+{
+    if( !filter->pending )
+        return 0;
+
+    return filter->published_ns +
+           filter->config.min_interval_ms * INT64_C(1000000);
+}
+
+dsme_battery_level_t
+dsme_battery_filter_level(const dsme_battery_filter_t *filter)
+{
+    return filter->published;
+}
+
+int
+dsme_battery_filter_send(dsmesock_connection_t *conn,
+                         dsme_battery_filter_t *filter,
+                         dsme_battery_level_t level)
+{
+    DSM_MSGTYPE_SET_BATTERY_LEVEL msg =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_LEVEL);
+    int64_t                       now_ns = dsme_monotonic_ns();
+
+    if( !battery_filter_check(filter, level, now_ns) )
+        return 0;
+
+    /* A level that did not go out is still to be passed on */
+    msg.level = level;
+    if( dsmesock_send(conn, &msg) == -1 )
+        return -1;
+
+    battery_filter_commit(filter, level, now_ns);
+    return 1;
+}
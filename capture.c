@@ -0,0 +1,270 @@
+/**
+   @file capture.c
+
+   Recording of dsme socket traffic into a memory mapped capture file.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/capture.h"
+#include "dsme_internal.h"
+
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+/* ------------------------------------------------------------------------- *
+ * State data
+ * ------------------------------------------------------------------------- */
+
+/** Capture file is grown and mapped in steps of this size */
+#define CAPTURE_CHUNK_SIZE (1024 * 1024)
+
+bool dsmesock_capture_active = false;
+
+/** Capture file; protected by capture lock */
+static int            capture_fd     = -1;
+static unsigned char *capture_map    = 0;
+static size_t         capture_mapped = 0;
+static size_t         capture_used   = 0;
+
+G_LOCK_DEFINE_STATIC(capture);
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+/** Close capture file; must be called with capture lock held */
+static void
+capture_close_locked(void)
+{
+    __atomic_store_n(&dsmesock_capture_active, false, __ATOMIC_RELAXED);
+
+    if( capture_map )
+        munmap(capture_map, capture_mapped);
+
+    if( capture_fd != -1 ) {
+        if( ftruncate(capture_fd, capture_used) == -1 ) {
+            /* unused space is zero filled; readers stop at it */
+        }
+        close(capture_fd);
+    }
+
+    capture_fd     = -1;
+    capture_map    = 0;
+    capture_mapped = 0;
+    capture_used   = 0;
+}
+
+/** Make sure the mapping has room for more data
+ *
+ * The file is grown with blocks actually allocated, so that running
+ * out of disk space fails here instead of raising SIGBUS on a store
+ * to the mapping.
+ */
+static bool
+capture_reserve(size_t size)
+{
+    size_t         want = capture_mapped;
+    unsigned char *map;
+
+    if( capture_used + size <= capture_mapped )
+        return true;
+
+    while( want < capture_used + size )
+        want += CAPTURE_CHUNK_SIZE;
+
+    if( posix_fallocate(capture_fd, capture_mapped,
+                        want - capture_mapped) != 0 )
+        return false;
+
+    if( capture_map )
+        map = mremap(capture_map, capture_mapped, want, MREMAP_MAYMOVE);
+    else
+        map = mmap(0, want, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   capture_fd, 0);
+
+    if( map == MAP_FAILED )
+        return false;
+
+    capture_map    = map;
+    capture_mapped = want;
+    return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Internal API
+ * ------------------------------------------------------------------------- */
+
+void
+dsmesock_capture_frame(uint32_t connection, dsmesock_capture_dir_t dir,
+                       const struct iovec *iov, int count)
+{
+    DSM_MSGTYPE_CAPTURE_FRAME *rec;
+    int64_t                    now  = dsme_monotonic_ns();
+    size_t                     size = sizeof *rec;
+    size_t                     pos;
+
+    for( int i = 0; i < count; ++i )
+        size += iov[i].iov_len;
+    size = (size + 7) & ~(size_t)7;
+
+    G_LOCK(capture);
+
+    if( !capture_map )
+        goto EXIT;
+
+    if( !capture_reserve(size) ) {
+        /* Out of disk space or address space; stop rather than
+         * leave a gap in the capture */
+        capture_close_locked();
+        goto EXIT;
+    }
+
+    rec = (DSM_MSGTYPE_CAPTURE_FRAME *)(capture_map + capture_used);
+    rec->size_        = sizeof *rec;
+    rec->type_        = DSME_MSG_ID_(DSM_MSGTYPE_CAPTURE_FRAME);
+    rec->connection   = connection;
+    rec->timestamp_ns = now;
+    rec->direction    = dir;
+    rec->reserved     = 0;
+
+    pos = capture_used + sizeof *rec;
+    for( int i = 0; i < count; ++i ) {
+        memcpy(capture_map + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    memset(capture_map + pos, 0, capture_used + size - pos);
+
+    /* Line size is written last, so that a reader of a file left
+     * behind by a crashed process does not see partial records */
+    __atomic_store_n(&rec->line_size_, size, __ATOMIC_RELEASE);
+    capture_used += size;
+
+EXIT:
+    G_UNLOCK(capture);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Public API
+ * ------------------------------------------------------------------------- */
+
+bool
+dsmesock_capture_start(const char *path)
+{
+    bool ack = false;
+
+    G_LOCK(capture);
+
+    capture_close_locked();
+
+    capture_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if( capture_fd == -1 )
+        goto EXIT;
+
+    if( !capture_reserve(CAPTURE_CHUNK_SIZE) ) {
+        capture_close_locked();
+        goto EXIT;
+    }
+
+    __atomic_store_n(&dsmesock_capture_active, true, __ATOMIC_RELAXED);
+    ack = true;
+
+EXIT:
+    G_UNLOCK(capture);
+    return ack;
+}
+
+void
+dsmesock_capture_stop(void)
+{
+    G_LOCK(capture);
+    capture_close_locked();
+    G_UNLOCK(capture);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Fork handling
+ *
+ * The capture file belongs to the process that started capturing;
+ * a forked child would otherwise write over the same shared mapping.
+ * ------------------------------------------------------------------------- */
+
+static void
+capture_atfork_prepare(void)
+{
+    G_LOCK(capture);
+}
+
+static void
+capture_atfork_parent(void)
+{
+    G_UNLOCK(capture);
+}
+
+static void
+capture_atfork_child(void)
+{
+    __atomic_store_n(&dsmesock_capture_active, false, __ATOMIC_RELAXED);
+
+    if( capture_map )
+        munmap(capture_map, capture_mapped);
+    if( capture_fd != -1 )
+        close(capture_fd);
+
+    capture_fd     = -1;
+    capture_map    = 0;
+    capture_mapped = 0;
+    capture_used   = 0;
+
+    G_UNLOCK(capture);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Initialization
+ * ------------------------------------------------------------------------- */
+
+static void capture_init(void) __attribute__((constructor));
+static void capture_quit(void) __attribute__((destructor));
+
+static void
+capture_init(void)
+{
+    const char *env = getenv("DSME_CAPTURE");
+
+    pthread_atfork(capture_atfork_prepare, capture_atfork_parent,
+                   capture_atfork_child);
+
+    if( env && *env )
+        dsmesock_capture_start(env);
+}
+
+static void
+capture_quit(void)
+{
+    dsmesock_capture_stop();
+}
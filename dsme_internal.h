@@ -0,0 +1,203 @@
+/**
+   @file dsme_internal.h
+
+   Interfaces shared between libdsme source files. Not installed.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_INTERNAL_H
+#define DSME_INTERNAL_H
+
+#include "include/dsme/capture.h"
+#include "include/dsme/flightrec.h"
+#include "include/dsme/messages.h"
+#include "include/dsme/msgstats.h"
+#include "include/dsme/protocol.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define dsme_likely(X)   __builtin_expect(!!(X), 1)
+#define dsme_unlikely(X) __builtin_expect(!!(X), 0)
+
+/** Keep a symbol shared between the library sources out of the
+ *  dynamic symbol table; everything declared here is internal */
+#define DSME_INTERNAL __attribute__((visibility("hidden")))
+
+/** Get CLOCK_MONOTONIC time in nanoseconds
+ */
+static inline int64_t dsme_monotonic_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Static tracepoints
+ *
+ * When built with <sys/sdt.h> available, the library contains USDT
+ * probes under provider "libdsme". An untraced probe is a single nop
+ * instruction. The probes and their arguments are:
+ *
+ *   frame_received    fd, msg id, line_size_, peer pid
+ *   frame_sent        fd, msg id, line_size_, peer pid
+ *   short_write       fd, msg id, line_size_, peer pid, bytes written
+ *   oos_close         fd, msg id, line_size_, peer pid  (from bad header)
+ *   broadcast_fanout  -1, msg id, line_size_, 0, number of connections
+ *   backlog_high      fd, 0, queued bytes, peer pid, queued frames
+ *
+ * For example: perf probe -x libdsme.so.0 sdt_libdsme:frame_sent
+ *
+ * Define DSME_DISABLE_SDT to build without probes.
+ * ------------------------------------------------------------------------- */
+
+#if !defined(DSME_DISABLE_SDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define DSME_PROBE(NAME, ARGS...) STAP_PROBEV(libdsme, NAME, ##ARGS)
+# endif
+#endif
+
+#ifndef DSME_PROBE
+# define DSME_PROBE(NAME, ARGS...) do { } while (0)
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * protocol.c
+ * ------------------------------------------------------------------------- */
+
+/** Byte stream operations behind a connection
+ *
+ * The descriptor of a connection must poll readable while there is
+ * input or the peer has gone away; attached sources and blocking
+ * receives wait on it. Operations follow read() and writev()
+ * conventions, and fail with EAGAIN when nothing can be transferred
+ * without blocking.
+ */
+typedef struct dsmesock_transport_t
+{
+    const char *name;
+
+    /** Read up to size bytes; a descriptor passed along with the data
+     *  is stored in *rxfd, which is -1 on entry. If rxfd is NULL, the
+     *  connection does not accept descriptors and any passed along
+     *  are closed */
+    ssize_t (*recv)(void *data, int fd, void *buf, size_t size, int *rxfd);
+
+    /** Write buffers; passfd, unless -1, travels with the first byte */
+    ssize_t (*send)(void *data, int fd, const struct iovec *iov, int count,
+                    int passfd);
+
+    /** Get credentials of the peer; -1 if not available */
+    int     (*peercred)(void *data, int fd, struct ucred *cred);
+
+    /** Release the descriptor and transport data */
+    void    (*close)(void *data, int fd);
+
+    /** The descriptor polls readable, rather than writable, when
+     *  output that could not be written earlier can proceed */
+    bool    wakes_writer;
+} dsmesock_transport_t;
+
+/** Stream sockets; used by dsmesock_init() */
+DSME_INTERNAL extern const dsmesock_transport_t dsmesock_unix_transport;
+
+/** Create a connection using the given transport
+ *
+ * Like dsmesock_init(), but the descriptor is only polled; all
+ * transfers go through the transport operations.
+ */
+DSME_INTERNAL
+dsmesock_connection_t *dsmesock_init_transport(int fd,
+                                               const dsmesock_transport_t *transport,
+                                               void *data);
+
+/** Give the calling thread a set of connections of its own
+ *
+ * Connections the thread creates afterwards are not visible to other
+ * threads, and broadcasts made from it reach only them. Meant for
+ * threads that own their connections exclusively, such as server
+ * workers.
+ *
+ * @return false if memory could not be allocated
+ */
+DSME_INTERNAL bool dsmesock_domain_enter(void);
+
+/** Close the connections of the calling thread and make it use the
+ *  shared set again
+ *
+ * Must not be called while one of the connections is being
+ * dispatched, e.g. from a handler.
+ *
+ * @return false with errno set to EBUSY, and nothing closed, if a
+ *         connection is being dispatched
+ */
+DSME_INTERNAL bool dsmesock_domain_leave(void);
+
+/* ------------------------------------------------------------------------- *
+ * message.c
+ * ------------------------------------------------------------------------- */
+
+/** Get name of a known message type; async-signal-safe
+ *
+ * @return name, or NULL for unknown message types
+ */
+DSME_INTERNAL const char *dsmemsg_id_lookup(uint32_t id);
+
+/* ------------------------------------------------------------------------- *
+ * msgstats.c
+ * ------------------------------------------------------------------------- */
+
+/** Collection enabled flag; test via DSMEMSG_STATS_ACTIVE() */
+DSME_INTERNAL extern bool dsmemsg_stats_active;
+
+#define DSMEMSG_STATS_ACTIVE() \
+    dsme_unlikely(__atomic_load_n(&dsmemsg_stats_active, __ATOMIC_RELAXED))
+
+/* ------------------------------------------------------------------------- *
+ * capture.c
+ * ------------------------------------------------------------------------- */
+
+/** Capture enabled flag; test via DSMESOCK_CAPTURE_ACTIVE() */
+DSME_INTERNAL extern bool dsmesock_capture_active;
+
+#define DSMESOCK_CAPTURE_ACTIVE() \
+    dsme_unlikely(__atomic_load_n(&dsmesock_capture_active, __ATOMIC_RELAXED))
+
+/** Append a frame, given as scatter list, to the capture file
+ */
+DSME_INTERNAL
+void dsmesock_capture_frame(uint32_t connection, dsmesock_capture_dir_t dir,
+                            const struct iovec *iov, int count);
+
+/* ------------------------------------------------------------------------- *
+ * flightrec.c
+ * ------------------------------------------------------------------------- */
+
+/** Record an event in the flight recorder; lock-free, always active
+ */
+DSME_INTERNAL
+void dsmesock_flightrec_record(dsmesock_flightrec_event_t event, int fd,
+                               const dsmemsg_generic_t *msg, uint32_t reason);
+
+#endif
@@ -0,0 +1,240 @@
+/**
+   @file flightrec.c
+
+   Lock-free ring of recent dsme socket frame headers.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/flightrec.h"
+#include "dsme_internal.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <glib.h>
+
+#if DSMESOCK_FLIGHTREC_SIZE & (DSMESOCK_FLIGHTREC_SIZE - 1)
+# error DSMESOCK_FLIGHTREC_SIZE must be a power of two
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * State data
+ * ------------------------------------------------------------------------- */
+
+/** Number of events recorded so far */
+static uint64_t flightrec_head = 0;
+
+/** Event ring
+ *
+ * Writers claim a slot with an atomic increment of flightrec_head,
+ * clear the slot sequence number, fill in the data and then publish
+ * the sequence number. Readers discard slots whose sequence number
+ * is not the expected one or changes while copying.
+ */
+static dsmesock_flightrec_entry_t flightrec_ring[DSMESOCK_FLIGHTREC_SIZE];
+
+/* ------------------------------------------------------------------------- *
+ * Internal API
+ * ------------------------------------------------------------------------- */
+
+void
+dsmesock_flightrec_record(dsmesock_flightrec_event_t event, int fd,
+                          const dsmemsg_generic_t *msg, uint32_t reason)
+{
+    uint64_t seq = __atomic_add_fetch(&flightrec_head, 1, __ATOMIC_RELAXED);
+    dsmesock_flightrec_entry_t *ent =
+        &flightrec_ring[(seq - 1) & (DSMESOCK_FLIGHTREC_SIZE - 1)];
+
+    __atomic_store_n(&ent->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ent->timestamp_ns = dsme_monotonic_ns();
+    ent->id           = msg ? msg->type_ : 0;
+    ent->line_size    = msg ? msg->line_size_ : 0;
+    ent->size         = msg ? msg->size_ : 0;
+    ent->fd           = fd;
+    ent->event        = event;
+    ent->reason       = reason;
+
+    __atomic_store_n(&ent->seq, seq, __ATOMIC_RELEASE);
+}
+
+/** Copy one event, unless it has been overwritten or is being written */
+static bool
+flightrec_read(uint64_t seq, dsmesock_flightrec_entry_t *out)
+{
+    const dsmesock_flightrec_entry_t *ent =
+        &flightrec_ring[(seq - 1) & (DSMESOCK_FLIGHTREC_SIZE - 1)];
+
+    if( __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE) != seq )
+        return false;
+
+    memcpy(out, ent, sizeof *ent);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if( __atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq )
+        return false;
+
+    out->seq = seq;
+    return true;
+}
+
+/** Get sequence number of the oldest event still in the ring */
+static uint64_t
+flightrec_first(uint64_t head)
+{
+    return head > DSMESOCK_FLIGHTREC_SIZE ?
+        head - DSMESOCK_FLIGHTREC_SIZE + 1 : 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Public API
+ * ------------------------------------------------------------------------- */
+
+size_t
+dsmesock_flightrec_snapshot(dsmesock_flightrec_entry_t *out, size_t max)
+{
+    uint64_t head  = __atomic_load_n(&flightrec_head, __ATOMIC_ACQUIRE);
+    uint64_t first = flightrec_first(head);
+    size_t   count = 0;
+
+    if( head - first + 1 > max )
+        first = head - max + 1;
+
+    for( uint64_t seq = first; seq <= head; ++seq ) {
+        if( flightrec_read(seq, &out[count]) )
+            ++count;
+    }
+
+    return count;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Signal safe formatting
+ * ------------------------------------------------------------------------- */
+
+typedef struct
+{
+    char   data[160];
+    size_t used;
+} flightrec_line_t;
+
+static void
+flightrec_put_str(flightrec_line_t *line, const char *str)
+{
+    while( *str && line->used < sizeof line->data )
+        line->data[line->used++] = *str++;
+}
+
+static void
+flightrec_put_num(flightrec_line_t *line, uint64_t num, unsigned base,
+                  int width, char pad)
+{
+    char   tmp[24];
+    size_t n = 0;
+
+    do {
+        tmp[n++] = "0123456789abcdef"[num % base];
+        num /= base;
+    } while( num );
+
+    while( width-- > (int)n && line->used < sizeof line->data )
+        line->data[line->used++] = pad;
+
+    while( n > 0 && line->used < sizeof line->data )
+        line->data[line->used++] = tmp[--n];
+}
+
+static void
+flightrec_write(int fd, const char *data, size_t size)
+{
+    while( size > 0 ) {
+        ssize_t rc = write(fd, data, size);
+        if( rc == -1 && errno == EINTR )
+            continue;
+        if( rc <= 0 )
+            break;
+        data += rc, size -= rc;
+    }
+}
+
+void
+dsmesock_flightrec_dump(int fd)
+{
+    static const char * const event_name[] = {
+        [DSMESOCK_FLIGHTREC_RX]    = "RX",
+        [DSMESOCK_FLIGHTREC_TX]    = "TX",
+        [DSMESOCK_FLIGHTREC_CLOSE] = "CL",
+    };
+
+    uint64_t head  = __atomic_load_n(&flightrec_head, __ATOMIC_ACQUIRE);
+    int      saved = errno;
+
+    static const char header[] =
+        "libdsme flight recorder: SEQ TIME_MS EV FD ID LINE_SIZE SIZE\n";
+    flightrec_write(fd, header, sizeof header - 1);
+
+    /* Copy one event at a time; the handler may run on a small stack */
+    for( uint64_t seq = flightrec_first(head); seq <= head; ++seq ) {
+        dsmesock_flightrec_entry_t ent;
+        flightrec_line_t           line = { .used = 0 };
+        const char                *name;
+
+        if( !flightrec_read(seq, &ent) )
+            continue;
+
+        name = dsmemsg_id_lookup(ent.id);
+
+        flightrec_put_num(&line, ent.seq, 10, 8, ' ');
+        flightrec_put_str(&line, " ");
+        flightrec_put_num(&line, ent.timestamp_ns / 1000000, 10, 10, ' ');
+        flightrec_put_str(&line, ".");
+        flightrec_put_num(&line, ent.timestamp_ns / 1000 % 1000, 10, 3, '0');
+        flightrec_put_str(&line, " ");
+        flightrec_put_str(&line, ent.event < G_N_ELEMENTS(event_name) ?
+                          event_name[ent.event] : "??");
+        flightrec_put_str(&line, " ");
+        if( ent.fd < 0 )
+            flightrec_put_str(&line, "  -1");
+        else
+            flightrec_put_num(&line, ent.fd, 10, 4, ' ');
+        flightrec_put_str(&line, " 0x");
+        flightrec_put_num(&line, ent.id, 16, 8, '0');
+        flightrec_put_str(&line, " ");
+        flightrec_put_num(&line, ent.line_size, 10, 6, ' ');
+        flightrec_put_str(&line, " ");
+        flightrec_put_num(&line, ent.size, 10, 6, ' ');
+        if( name ) {
+            flightrec_put_str(&line, " ");
+            flightrec_put_str(&line, name);
+        }
+        if( ent.event == DSMESOCK_FLIGHTREC_CLOSE ) {
+            flightrec_put_str(&line, " reason=");
+            flightrec_put_num(&line, ent.reason, 10, 0, ' ');
+        }
+        flightrec_put_str(&line, "\n");
+        flightrec_write(fd, line.data, line.used);
+    }
+
+    errno = saved;
+}
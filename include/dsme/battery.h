@@ -0,0 +1,100 @@
+/**
+   @file battery.h
+
+   Publisher side filter for battery level updates.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_BATTERY_H
+#define DSME_BATTERY_H
+
+#include "protocol.h"
+#include "state.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** When to pass battery level changes on
+ */
+typedef struct {
+    unsigned hysteresis;      /**< level change that is passed on; 0 or 1
+                               *   passes on every change */
+    unsigned min_interval_ms; /**< minimum time between ordinary updates */
+    int      low_level;       /**< crossing this level is passed on
+                               *   immediately; negative to disable */
+} dsme_battery_filter_config_t;
+
+/** Battery level update filter
+ *
+ * Levels are passed on immediately when the level becomes known or
+ * unknown, reaches or leaves DSME_BATTERY_LEVEL_MINIMUM or
+ * DSME_BATTERY_LEVEL_MAXIMUM, or crosses the low battery level in
+ * either direction. Other changes are passed on once they differ from
+ * the last passed on level by the hysteresis, at most once per minimum
+ * interval.
+ */
+typedef struct dsme_battery_filter_t dsme_battery_filter_t;
+
+dsme_battery_filter_t *
+dsme_battery_filter_new(const dsme_battery_filter_config_t *config);
+void dsme_battery_filter_free(dsme_battery_filter_t *filter);
+
+/** Feed a battery level to the filter
+ *
+ * @param now_ns  CLOCK_MONOTONIC time of the update
+ *
+ * @return true if the level should be passed on
+ */
+bool dsme_battery_filter_update(dsme_battery_filter_t *filter,
+                                dsme_battery_level_t level,
+                                int64_t now_ns);
+
+/** Time when a level held back by the minimum interval can be passed on
+ *
+ * The publisher can arrange a timer for this time and then feed the
+ * latest level again.
+ *
+ * @return CLOCK_MONOTONIC time, or 0 if no level is held back
+ */
+int64_t dsme_battery_filter_due_ns(const dsme_battery_filter_t *filter);
+
+/** Last level passed on by the filter
+ */
+dsme_battery_level_t
+dsme_battery_filter_level(const dsme_battery_filter_t *filter);
+
+/** Send DSM_MSGTYPE_SET_BATTERY_LEVEL if the filter passes the level
+ *
+ * The level is taken as passed on only once it has been sent, so
+ * after a failure the same level is passed again on the next call.
+ *
+ * @return 1 if sent, 0 if filtered out, or -1 with errno set
+ */
+int dsme_battery_filter_send(dsmesock_connection_t *conn,
+                             dsme_battery_filter_t *filter,
+                             dsme_battery_level_t level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+/**
+   @file capture.h
+
+   Recording of dsme socket traffic into a capture file.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_CAPTURE_H
+#define DSME_CAPTURE_H
+
+#include "messages.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Direction of captured traffic
+ */
+typedef enum
+{
+    DSMESOCK_CAPTURE_RX = 0,
+    DSMESOCK_CAPTURE_TX = 1,
+} dsmesock_capture_dir_t;
+
+/** Capture file record
+ *
+ * A capture file is a sequence of these records, using the same
+ * framing as messages on dsme socket. The captured frame, including
+ * its own header and extra data, is stored as extra data of the
+ * record. Records are padded to 8 byte alignment, so the length of
+ * the captured frame must be taken from its own header.
+ *
+ * A record with zero line size marks the end of data; the file can
+ * have unused space at the end if the process did not stop capturing
+ * before exiting.
+ */
+typedef struct {
+    DSMEMSG_PRIVATE_FIELDS
+    uint32_t connection;    /**< connection serial number within process */
+    int64_t  timestamp_ns;  /**< CLOCK_MONOTONIC time of capture */
+    uint32_t direction;     /**< dsmesock_capture_dir_t */
+    uint32_t reserved;
+} DSM_MSGTYPE_CAPTURE_FRAME;
+
+enum {
+    /* DSME Protocol messages 000000xx */
+    DSME_MSG_ENUM(DSM_MSGTYPE_CAPTURE_FRAME, 0x00000010),
+};
+
+/** Start capturing traffic of all dsme socket connections
+ *
+ * Every frame received with dsmesock_receive() or via dsmesock_attach()
+ * and every frame passed to dsmesock_send() is appended to the given
+ * file, which is created or truncated. The file is memory mapped, so
+ * data captured before an abnormal exit is not lost.
+ *
+ * Capturing can also be started by setting DSME_CAPTURE environment
+ * variable to a file path.
+ *
+ * @param path capture file path
+ *
+ * @return true on success, false on failure
+ */
+bool dsmesock_capture_start(const char *path);
+
+/** Stop capturing and truncate capture file to the size of data
+ */
+void dsmesock_capture_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+/**
+   @file flightrec.h
+
+   In-memory record of recent dsme socket traffic.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_FLIGHTREC_H
+#define DSME_FLIGHTREC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of events kept in the flight recorder
+ */
+#define DSMESOCK_FLIGHTREC_SIZE 256
+
+/** Flight recorder event types
+ */
+typedef enum
+{
+    DSMESOCK_FLIGHTREC_RX    = 0, /**< frame received */
+    DSMESOCK_FLIGHTREC_TX    = 1, /**< frame sent or queued for sending */
+    DSMESOCK_FLIGHTREC_CLOSE = 2, /**< connection closed by library */
+} dsmesock_flightrec_event_t;
+
+/** Flight recorder event
+ *
+ * For CLOSE events the message fields describe the frame header at
+ * the head of the receive buffer, if any; for an out-of-sync close
+ * that is the header that could not be parsed.
+ */
+typedef struct
+{
+    uint64_t seq;          /**< event sequence number, starting from 1 */
+    int64_t  timestamp_ns; /**< CLOCK_MONOTONIC time of the event */
+    uint32_t id;           /**< message type */
+    uint32_t line_size;    /**< frame size, including extra data */
+    uint32_t size;         /**< message size, excluding extra data */
+    int32_t  fd;           /**< connection file descriptor */
+    uint32_t event;        /**< dsmesock_flightrec_event_t */
+    uint32_t reason;       /**< close reason, for CLOSE events */
+} dsmesock_flightrec_entry_t;
+
+/** Copy recorded events
+ *
+ * The flight recorder is always active; it keeps headers of the last
+ * DSMESOCK_FLIGHTREC_SIZE frames sent or received through dsmesock
+ * connections in the process, together with library initiated
+ * connection closes.
+ *
+ * @param out  array to fill, oldest event first
+ * @param max  number of elements in out
+ *
+ * @return number of entries copied
+ */
+size_t dsmesock_flightrec_snapshot(dsmesock_flightrec_entry_t *out,
+                                   size_t max);
+
+/** Write recorded events as text
+ *
+ * Uses only async-signal-safe functions, so it can be called e.g.
+ * from a SIGSEGV or watchdog signal handler.
+ *
+ * @param fd  file descriptor to write to
+ */
+void dsmesock_flightrec_dump(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -42,6 +42,9 @@ extern "C" {
 #define DSME_MSG_NEW_WITH_EXTRA(T, E) \
   (T*)dsmemsg_new(DSME_MSG_ID_(T), sizeof(T), (E))
 
+#define DSME_MSG_RESERVE(A, T, E) \
+  (T*)dsmemsg_arena_reserve((A), DSME_MSG_ID_(T), sizeof(T), (E))
+
 #ifdef __cplusplus
 #define DSME_MSG_INIT(T)               \
   (T){                                 \
@@ -119,7 +122,8 @@ enum {
   TSMSG_CLOSE_REASON_OOS = 0, /* Protocol out of sync (local) */
   TSMSG_CLOSE_REASON_EOF = 1, /* EOF read from socket (local) */
   TSMSG_CLOSE_REASON_REQ = 2, /* Peer requests close */
-  TSMSG_CLOSE_REASON_ERR = 3  /* Undefined error conditions or read after close */
+  TSMSG_CLOSE_REASON_ERR = 3, /* Undefined error conditions or read after close */
+  TSMSG_CLOSE_REASON_SLOW = 4 /* Peer does not read its messages (local) */
 };
 
 
@@ -245,6 +249,82 @@ const void *dsmemsg_extra_data(const dsmemsg_generic_t *msg);
  */
 const char * dsmemsg_id_name(uint32_t id);
 
+/** Buffer for building messages in place
+ *
+ * Frames are reserved back to back, laid out as they go on the wire,
+ * either in a buffer given by the caller, e.g. on the stack, or in one
+ * that the arena allocates and keeps for reuse after
+ * dsmemsg_arena_reset(). Nothing is zeroed: reserving fills in the
+ * header, and the caller writes the body and extra data in place.
+ *
+ * Each frame starts at an offset that is a multiple of eight from the
+ * start of the buffer, so frames are aligned as long as the buffer
+ * is; buffers allocated by the arena always are. The padding after
+ * a frame is not part of it and is not sent.
+ */
+typedef struct dsmemsg_arena_t {
+  unsigned char *buf;
+  size_t         size;
+  size_t         used;
+  int            owned;  /**< buf was allocated by the arena */
+} dsmemsg_arena_t;
+
+/** Initialize message arena
+ *
+ * @param arena  arena to initialize
+ * @param buf    buffer to build messages in, or NULL to have the arena
+ *               allocate one as needed
+ * @param size   size of buf
+ */
+void dsmemsg_arena_init(dsmemsg_arena_t *arena, void *buf, size_t size);
+
+/** Forget reserved messages, keeping the buffer for reuse
+ *
+ * @param arena  message arena
+ */
+void dsmemsg_arena_reset(dsmemsg_arena_t *arena);
+
+/** Release buffer allocated by the arena
+ *
+ * The arena can be used again after dsmemsg_arena_init().
+ *
+ * @param arena  message arena
+ */
+void dsmemsg_arena_release(dsmemsg_arena_t *arena);
+
+/** Reserve space for a message
+ *
+ * The header is filled in; body and extra data are uninitialized.
+ * Extra data starts at DSMEMSG_EXTRA() of the returned message.
+ *
+ * When an arena that allocates its buffer has to grow, messages
+ * reserved earlier can move: fill in each message before reserving
+ * the next one.
+ *
+ * @sa #DSME_MSG_RESERVE()
+ *
+ * @param arena  message arena
+ * @param id     message type identifier
+ * @param size   message body size
+ * @param extra  space to reserve for extra data
+ *
+ * @return message, or NULL if it does not fit in the buffer given by
+ *         the caller or memory could not be allocated
+ */
+void *dsmemsg_arena_reserve(dsmemsg_arena_t *arena, uint32_t id,
+                            size_t size, size_t extra);
+
+/** Iterate over messages reserved from an arena
+ *
+ * @param arena  message arena
+ * @param prev   previous message, or NULL to get the first one
+ *
+ * @return next message, or NULL after the last one or at a frame whose
+ *         size does not fit what was reserved
+ */
+const dsmemsg_generic_t *dsmemsg_arena_next(const dsmemsg_arena_t *arena,
+                                            const dsmemsg_generic_t *prev);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,98 @@
+/**
+   @file msgstats.h
+
+   Optional per message type size and latency statistics.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_MSGSTATS_H
+#define DSME_MSGSTATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Direction of recorded traffic
+ */
+typedef enum
+{
+    DSMEMSG_STATS_RX = 0,
+    DSMEMSG_STATS_TX = 1,
+} dsmemsg_stats_dir_t;
+
+/** Enable or disable collection of message statistics
+ *
+ * Collection is disabled by default, and can also be enabled by
+ * setting DSME_MSGSTATS environment variable to a non-empty value.
+ * While disabled, the dsmesock send and receive paths skip all
+ * timestamping and bookkeeping.
+ *
+ * Once enabled, the dsmesock library records:
+ * - RX: size of each received frame, and for connections attached
+ *       with dsmesock_attach() the time the handler takes
+ * - TX: size of each sent frame, and the time from dsmesock_send()
+ *       to the frame being completely written to the socket; for
+ *       frames written right away, the time the write takes
+ *
+ * @param enable true to start collecting, false to stop
+ */
+void dsmemsg_stats_enable(bool enable);
+
+/** Check whether message statistics are being collected
+ *
+ * @return true if enabled, false otherwise
+ */
+bool dsmemsg_stats_enabled(void);
+
+/** Record one message event
+ *
+ * Can be used for accounting application side processing, such as
+ * handling of messages obtained via dsmesock_receive().
+ *
+ * Safe to call from multiple threads; each thread updates its own
+ * set of counters without locking.
+ *
+ * @param id          message type identifier
+ * @param dir         traffic direction
+ * @param size        message line size
+ * @param latency_ns  latency in nanoseconds, or negative if not known
+ */
+void dsmemsg_stats_record(uint32_t id, dsmemsg_stats_dir_t dir,
+                          size_t size, int64_t latency_ns);
+
+/** Print collected statistics
+ *
+ * Counters from all threads are summed up and printed one line
+ * per message type and direction, labeled with dsmemsg_id_name().
+ * Sizes are in bytes and latencies in microseconds; percentiles are
+ * upper bounds of the power of two buckets they fall in.
+ *
+ * @param out stream to print to
+ */
+void dsmemsg_stats_dump(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
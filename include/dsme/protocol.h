@@ -38,6 +38,8 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,6 +59,10 @@ extern "C" {
 //       (see arch ticket #230:
 //        https://maemo.research.nokia.com/archtool/ticket/230)
 struct _GIOChannel;
+struct _GMainContext;
+struct dsmesock_connection_t;
+struct dsmemsg_generic_t;
+struct dsmemsg_arena_t;
 
 /**
    DSME socket internal information.
@@ -95,6 +101,24 @@ dsmesock_connection_t*  dsmesock_connect(void);
 */
 dsmesock_connection_t*  dsmesock_init(int fd);
 
+/**
+   Creates two connections that are connected to each other in memory.
+
+   Frames move between the connections through lock-free ring buffers
+   without system calls, apart from waking up the receiving side when
+   its buffer turns non-empty. The connections behave like socket
+   connections otherwise: they can be attached to main contexts,
+   descriptors can be passed with dsmesock_send_with_fd(), and the peer
+   credentials are those of the calling process.
+
+   @ingroup dsmesock_client
+   @param a  Location for the first connection.
+   @param b  Location for the second connection.
+   @return true on success, or false with errno set.
+*/
+bool dsmesock_loopback_pair(dsmesock_connection_t** a,
+                            dsmesock_connection_t** b);
+
 /**
    Receives data from connection.
    @ingroup dsmesock_client
@@ -103,14 +127,60 @@ dsmesock_connection_t*  dsmesock_init(int fd);
 */
 void* dsmesock_receive(dsmesock_connection_t* conn);
 
+/**
+   Receives data from connection, waiting until a deadline.
+
+   Frames set aside by dsmesock_receive_id() are returned first, in
+   the order they were received.
+
+   @ingroup dsmesock_client
+   @param conn         Connection to be read.
+   @param deadline_ns  CLOCK_MONOTONIC time in nanoseconds to wait until,
+                       or negative to wait without a time limit.
+   @return pointer to received message, or NULL with errno set to
+           ETIMEDOUT if nothing arrived before the deadline.
+*/
+void* dsmesock_receive_timeout(dsmesock_connection_t* conn,
+                               int64_t                deadline_ns);
+
+/**
+   Receives message of a given type, waiting until a deadline.
+
+   Other messages that arrive before it are set aside and returned by
+   later dsmesock_receive(), dsmesock_receive_timeout() and
+   dsmesock_receive_id() calls, or passed to the handler once the
+   connection is attached. Note that the socket does not poll readable
+   for messages that have been set aside.
+
+   @ingroup dsmesock_client
+   @param conn         Connection to be read.
+   @param id           Message type identifier to wait for.
+   @param deadline_ns  CLOCK_MONOTONIC time in nanoseconds to wait until,
+                       or negative to wait without a time limit.
+   @return pointer to received message, DSM_MSGTYPE_CLOSE message if
+           the connection got closed, or NULL with errno set to
+           ETIMEDOUT if the message did not arrive before the deadline.
+*/
+void* dsmesock_receive_id(dsmesock_connection_t* conn,
+                          uint32_t               id,
+                          int64_t                deadline_ns);
+
 
 /**
    Sends message to an other end of the dsmesock connection. Does not free the message.
 
+   Data that the socket does not accept without blocking is queued and
+   written out before any later message, either by following sends, by
+   the main loop source set up with dsmesock_attach() or by
+   dsmesock_flush(). A connection that is not attached must call
+   dsmesock_flush() whenever the socket becomes writable while
+   dsmesock_has_pending_output() is true; otherwise queued output is
+   only written out by the next send.
+
    @ingroup dsmesock_client
    @param conn	Destination connection.
    @param msg	Pointer to message to be sent.
-   @return Number of bytes sent, or -1 on error.
+   @return Number of bytes sent or queued, or -1 on error.
 */
 int dsmesock_send(dsmesock_connection_t* conn, const void* msg);
 
@@ -119,6 +189,94 @@ int dsmesock_send_with_extra(dsmesock_connection_t* conn,
                                       size_t                 extra_size,
                                       const void*            extra);
 
+/**
+   Sends all messages built in an arena, in order, gathering up to
+   16 frames per write and leaving out the padding between them.
+
+   Data that the socket does not accept without blocking is queued
+   like with dsmesock_send(). The arena is left as it is, so that the
+   same messages can be sent to several connections.
+
+   Nothing is sent if a frame header was overwritten so that the
+   frames no longer cover the reserved space; the call then fails
+   with EINVAL.
+
+   @ingroup dsmesock_client
+   @param conn   Destination connection.
+   @param arena  Messages reserved with dsmemsg_arena_reserve().
+   @return Number of bytes sent or queued, or -1 on error.
+*/
+int dsmesock_send_arena(dsmesock_connection_t*        conn,
+                        const struct dsmemsg_arena_t* arena);
+
+
+/**
+   Sends message together with a file descriptor.
+
+   The descriptor is duplicated to the peer, which can pick it up with
+   dsmesock_take_fd() once it has received the message, provided that
+   it has enabled dsmesock_set_fd_passing(). Extra data is
+   not supported. Fails with EAGAIN if earlier output is still queued.
+
+   @ingroup dsmesock_client
+   @param conn  Destination connection.
+   @param msg   Pointer to message to be sent.
+   @param fd    Descriptor to pass.
+   @return Number of bytes sent or queued, or -1 on error.
+*/
+int dsmesock_send_with_fd(dsmesock_connection_t* conn,
+                          const void*            msg,
+                          int                    fd);
+
+/**
+   Writes out queued output, as much as the socket accepts without
+   blocking.
+
+   Attached connections do this from the main loop; others should call
+   it when poll() reports the socket writable.
+
+   @ingroup dsmesock_client
+   @param conn  Connection.
+   @return 0 on success, also if some output is still queued,
+           or -1 on error.
+*/
+int dsmesock_flush(dsmesock_connection_t* conn);
+
+/**
+   Tells whether output is queued waiting for the socket to accept it.
+
+   @ingroup dsmesock_client
+   @param conn  Connection.
+   @return true if dsmesock_flush() has something left to write.
+*/
+bool dsmesock_has_pending_output(dsmesock_connection_t* conn);
+
+/**
+   Enables or disables accepting file descriptors from the peer.
+
+   Descriptors are not accepted by default: ones passed along with
+   messages are closed as they arrive. Disabling also closes a
+   descriptor received earlier but not yet taken.
+
+   @ingroup dsmesock_client
+   @param conn    Connection.
+   @param enable  Whether to accept descriptors.
+   @return previous setting, 1 or 0, or -1 if the connection is not valid.
+*/
+int dsmesock_set_fd_passing(dsmesock_connection_t* conn, bool enable);
+
+/**
+   Takes the latest file descriptor passed by the peer.
+
+   Only the latest descriptor is kept; a descriptor that is not taken
+   before the next one arrives is closed.
+
+   @ingroup dsmesock_client
+   @param conn  Connection.
+   @return descriptor owned by the caller, or -1 if none.
+*/
+int dsmesock_take_fd(dsmesock_connection_t* conn);
+
 
 /**
    Sends message to all dsmesock client connections.
@@ -148,6 +306,442 @@ void dsmesock_close(dsmesock_connection_t* conn);
 const struct ucred* dsmesock_getucred(dsmesock_connection_t* conn);
 
 
+/**
+   Callback for messages received on an attached connection.
+
+   The message is borrowed from the connection receive buffer, or from
+   an aligned copy of it when it does not start at an 8 byte boundary:
+   it is valid only until the callback returns and must not be freed. When
+   the connection gets closed, a DSM_MSGTYPE_CLOSE message is passed
+   as the last one; dsmesock_close() may be called from the callback.
+
+   @ingroup dsmesock_client
+   @param conn       Connection the message was received from.
+   @param msg        Received message.
+   @param user_data  Pointer given to dsmesock_attach().
+   @return true to keep receiving, or false to detach the connection.
+*/
+typedef bool (*dsmesock_handler_t)(struct dsmesock_connection_t*    conn,
+                                   const struct dsmemsg_generic_t*  msg,
+                                   void*                            user_data);
+
+/**
+   Attaches connection to a glib main context.
+
+   All complete messages that are available are passed to the handler
+   on each dispatch, and queued output is written out as the socket
+   becomes writable. While attached, the channel member of the
+   connection holds an io channel for the socket.
+
+   @ingroup dsmesock_client
+   @param conn       Connection to attach.
+   @param context    Main context to use, or NULL for the default context.
+   @param handler    Callback for received messages.
+   @param user_data  Pointer to pass to the handler.
+   @return true on success, or false on error.
+*/
+bool dsmesock_attach(dsmesock_connection_t* conn,
+                     struct _GMainContext*  context,
+                     dsmesock_handler_t     handler,
+                     void*                  user_data);
+
+/**
+   Detaches connection from the main context it was attached to.
+   @ingroup dsmesock_client
+   @param conn  Connection to detach.
+*/
+void dsmesock_detach(dsmesock_connection_t* conn);
+
+
+/**
+   Callback for replies to dsmesock_call_async().
+
+   The reply is borrowed like messages passed to dsmesock_handler_t.
+   It is NULL if the call timed out, or if the connection was closed
+   or detached before a reply arrived; in these cases the callback
+   must not close or detach the connection.
+
+   @ingroup dsmesock_client
+   @param conn       Connection the call was made on.
+   @param reply      Reply message, or NULL on failure.
+   @param user_data  Pointer given to dsmesock_call_async().
+*/
+typedef void (*dsmesock_reply_cb_t)(struct dsmesock_connection_t*   conn,
+                                    const struct dsmemsg_generic_t* reply,
+                                    void*                           user_data);
+
+/**
+   Sends a request and arranges the reply to be passed to a callback.
+
+   The connection must be attached with dsmesock_attach(). Any number
+   of calls can be outstanding at the same time. A received message
+   of type reply_id completes the oldest call waiting for that type,
+   and is not passed to the connection handler.
+
+   If token is non-zero, it is sent as the first eight bytes of extra
+   data, followed by the given extra data, and only replies whose
+   extra data starts with the same token complete the call. This
+   requires the peer to echo the token, e.g. by sending the first
+   eight bytes of request extra data as reply extra data.
+
+   @ingroup dsmesock_client
+   @param conn        Connection to use.
+   @param msg         Request message.
+   @param extra_size  Size of extra data, or 0.
+   @param extra       Extra data, or NULL.
+   @param reply_id    Message type identifier of the expected reply.
+   @param token       Correlation token, or 0.
+   @param timeout_ms  Timeout in milliseconds, or -1 for none.
+   @param callback    Function to call with the reply.
+   @param user_data   Pointer to pass to the callback.
+   @return non-zero call identifier, or 0 on error.
+*/
+unsigned dsmesock_call_async(dsmesock_connection_t* conn,
+                             const void*            msg,
+                             size_t                 extra_size,
+                             const void*            extra,
+                             uint32_t               reply_id,
+                             uint64_t               token,
+                             int                    timeout_ms,
+                             dsmesock_reply_cb_t    callback,
+                             void*                  user_data);
+
+/**
+   Cancels an outstanding call without invoking its callback.
+   @ingroup dsmesock_client
+   @param conn  Connection the call was made on.
+   @param id    Identifier returned by dsmesock_call_async().
+   @return true if the call was cancelled, or false if not found.
+*/
+bool dsmesock_call_cancel(dsmesock_connection_t* conn, unsigned id);
+
+
+/**
+   Outcome of an acknowledged broadcast for one connection.
+   @ingroup dsmesock_client
+*/
+typedef struct dsmesock_ack_result_t {
+  /** Connection; only for identification, it may have been closed */
+  dsmesock_connection_t* conn;
+  pid_t                  pid;        /**< Peer process */
+  bool                   acked;      /**< Acknowledgement was received */
+  int64_t                latency_ns; /**< Time to acknowledgement or failure */
+} dsmesock_ack_result_t;
+
+/**
+   Callback for completion of dsmesock_broadcast_acked().
+
+   The results are valid only during the call. The same restrictions
+   as for dsmesock_reply_cb_t apply.
+
+   @ingroup dsmesock_client
+   @param results    One entry per participating connection.
+   @param count      Number of entries.
+   @param user_data  Pointer given to dsmesock_broadcast_acked().
+*/
+typedef void (*dsmesock_acked_cb_t)(const dsmesock_ack_result_t* results,
+                                    size_t                       count,
+                                    void*                        user_data);
+
+/**
+   Selects connections taking part in dsmesock_broadcast_acked().
+   @ingroup dsmesock_client
+   @return true to include the connection.
+*/
+typedef bool (*dsmesock_ack_filter_t)(dsmesock_connection_t* conn,
+                                      void*                  user_data);
+
+/**
+   Sends a message to attached connections and waits for each of them
+   to acknowledge it.
+
+   The broadcast completes as soon as every participant has replied
+   with a message of type ack_id, or has timed out or disconnected.
+   For example, DSM_MSGTYPE_SAVE_DATA_IND can be sent to clients that
+   are known to reply with DSM_MSGTYPE_SAVE_DATA_ACK once their data
+   is saved, so that shutdown need not wait longer than it takes the
+   slowest client to save.
+
+   Acknowledgements are matched like replies to dsmesock_call_async()
+   without a token. If no connection takes part, the callback is
+   called before this function returns.
+
+   @ingroup dsmesock_client
+   @param msg         Message to send.
+   @param extra_size  Size of extra data, or 0.
+   @param extra       Extra data, or NULL.
+   @param ack_id      Message type identifier of acknowledgements.
+   @param timeout_ms  Timeout in milliseconds, or -1 for none.
+   @param filter      Function selecting participants, or NULL for all
+                      attached connections.
+   @param callback    Function to call with the results.
+   @param user_data   Pointer to pass to filter and callback.
+   @return number of participating connections.
+*/
+size_t dsmesock_broadcast_acked(const void*           msg,
+                                size_t                extra_size,
+                                const void*           extra,
+                                uint32_t              ack_id,
+                                int                   timeout_ms,
+                                dsmesock_ack_filter_t filter,
+                                dsmesock_acked_cb_t   callback,
+                                void*                 user_data);
+
+
+/**
+   Queue for sending messages from threads other than the one running
+   the connections.
+
+   Connections may only be used from the thread that owns them,
+   usually the one running their main context. Other threads can hand
+   messages to that thread through a send queue without locking:
+   submitted frames are copied into a lock-free multi-producer queue,
+   and the owning main context is woken up to send them in batches.
+   Frames from one thread are sent in the order they were submitted.
+
+   @ingroup dsmesock_client
+*/
+typedef struct dsmesock_sendqueue_t dsmesock_sendqueue_t;
+
+/**
+   Creates a send queue.
+
+   Frames are sent by the thread running the main context, which must
+   be the thread that owns the connections.
+
+   @ingroup dsmesock_client
+   @param context  Main context of the owning thread, or NULL for the
+                   default context.
+   @return send queue, or NULL with errno set.
+*/
+dsmesock_sendqueue_t* dsmesock_sendqueue_new(struct _GMainContext* context);
+
+/**
+   Destroys a send queue, dropping frames that were not sent yet.
+
+   Must be called from the owning thread, once no other thread uses
+   the queue any more.
+
+   @ingroup dsmesock_client
+   @param queue  Send queue, or NULL.
+*/
+void dsmesock_sendqueue_free(dsmesock_sendqueue_t* queue);
+
+/**
+   Submits a message for sending; may be called from any thread.
+
+   The connection must be open when the call is made, and the caller
+   must keep it open until the call returns: closing it from another
+   thread while the call is in progress lets the connection slot be
+   reused, and the frame may then go to the new connection. If the
+   connection is closed after the call returns but before the frame
+   would be sent, the frame is dropped.
+
+   @ingroup dsmesock_client
+   @param queue       Send queue.
+   @param conn        Connection to send to, or NULL to broadcast.
+   @param msg         Message to send.
+   @param extra_size  Size of extra data, or 0.
+   @param extra       Extra data, or NULL.
+   @return true on success, or false if memory could not be allocated.
+*/
+bool dsmesock_sendqueue_submit(dsmesock_sendqueue_t*  queue,
+                               dsmesock_connection_t* conn,
+                               const void*            msg,
+                               size_t                 extra_size,
+                               const void*            extra);
+
+
+/**
+   Limits how fast messages are taken from an attached connection.
+
+   Each interval the connection gets a budget of messages and bytes.
+   Once either is used up, the library stops reading from the socket
+   until the next interval begins, and the peer eventually blocks or
+   gets EAGAIN when the socket buffers fill up. A message is passed on
+   as long as some budget is left, so messages larger than the byte
+   budget still get through, one per interval.
+
+   Connections read with dsmesock_receive() are not limited.
+
+   @ingroup dsmesock_client
+   @param conn         Connection to limit.
+   @param msgs         Messages per interval, or 0 for no message limit.
+   @param bytes        Bytes per interval, or 0 for no byte limit.
+   @param interval_ms  Interval length in milliseconds, or 0 to disable.
+*/
+void dsmesock_set_rate_limit(dsmesock_connection_t* conn,
+                             unsigned               msgs,
+                             unsigned               bytes,
+                             unsigned               interval_ms);
+
+/**
+   Sets rate limit given to connections created after the call.
+   May be called from any thread.
+   @ingroup dsmesock_client
+   @see dsmesock_set_rate_limit()
+*/
+void dsmesock_set_default_rate_limit(unsigned msgs,
+                                     unsigned bytes,
+                                     unsigned interval_ms);
+
+
+/**
+   Sets how much input an attached connection may process per main
+   loop iteration.
+
+   Each iteration dispatches every attached connection that has input
+   once. A dispatch delivers at most @c frames frames, and frames only
+   as long as the connection has byte credit left; the credit grows
+   by @c bytes every iteration and is dropped when the connection runs
+   out of input. Connections with input left over are served again on
+   the next iteration, after the others have had their turn, so a busy
+   peer can not delay a quiet one by more than one quantum per
+   connection.
+
+   The defaults are 32 frames and 16384 bytes.
+
+   The setting is process wide and may be changed from any thread.
+   Credit carried over from earlier iterations is cleared only for the
+   connections of the calling thread; connections owned by other
+   threads, such as the workers of dsmesock_server_start(), switch
+   to the new quantum as they use up their credit.
+
+   @ingroup dsmesock_client
+   @param frames  Frames per iteration, or 0 for no frame limit.
+   @param bytes   Byte credit per iteration, or 0 for no byte limit.
+*/
+void dsmesock_set_dispatch_quantum(unsigned frames, unsigned bytes);
+
+
+/**
+   Output backlog watermarks of a connection.
+
+   Output that the peer does not read fast enough is queued in the
+   library. A connection becomes congested when the queue reaches
+   either high mark, and stops being congested when the queue is
+   back at or below both low marks. Low marks above the corresponding
+   high marks are lowered to the high marks.
+
+   @ingroup dsmesock_client
+*/
+typedef struct dsmesock_backlog_limits_t {
+  size_t   high_bytes;  /**< Queued bytes, or 0 for no byte limit */
+  size_t   low_bytes;   /**< Queued bytes to get back to */
+  unsigned high_age_ms; /**< Age of oldest queued frame, or 0 for no limit */
+  unsigned low_age_ms;  /**< Age of oldest queued frame to get back to */
+  bool     disconnect;  /**< Close connection when it gets congested */
+} dsmesock_backlog_limits_t;
+
+/**
+   Callback for output backlog watermark crossings.
+
+   Called from within dsmesock_send() and friends, or from main loop
+   dispatch for attached connections. The connection must not be
+   closed or detached from the callback.
+
+   @ingroup dsmesock_client
+   @param conn       Connection whose backlog crossed a watermark.
+   @param congested  true when crossing a high mark, false when
+                     crossing back below the low marks.
+   @param user_data  Data given when setting the limits.
+*/
+typedef void (*dsmesock_backlog_cb_t)(dsmesock_connection_t* conn,
+                                      bool                   congested,
+                                      void*                  user_data);
+
+/**
+   Sets output backlog watermarks of a connection.
+
+   With limits->disconnect set, a connection that gets congested is
+   disconnected: its queued output is discarded, further sends fail
+   with ENOTCONN, and the connection is reported closed with reason
+   TSMSG_CLOSE_REASON_SLOW, via the handler of an attached connection
+   or from the next dsmesock_receive() call. This keeps one peer that
+   has stopped reading from holding on to an ever growing amount of
+   broadcast data.
+
+   Age limits are checked on every send to the connection, and also
+   by a timer while the connection is attached.
+
+   @ingroup dsmesock_client
+   @param conn       Connection.
+   @param limits     Watermarks, or NULL to disable.
+   @param callback   Function to call on crossings, or NULL.
+   @param user_data  Data to pass to the callback.
+   @return true on success, or false if the connection is not valid.
+*/
+bool dsmesock_set_backlog_limits(dsmesock_connection_t*           conn,
+                                 const dsmesock_backlog_limits_t* limits,
+                                 dsmesock_backlog_cb_t            callback,
+                                 void*                            user_data);
+
+/**
+   Sets output backlog watermarks given to connections created after
+   the call. May be called from any thread.
+
+   By default connections get a high mark of 1 MiB and a low mark of
+   256 KiB, with limits->disconnect set, so that a peer that stops
+   reading cannot make the queue grow without bound. Passing NULL
+   queues output without any limit.
+   @ingroup dsmesock_client
+   @see dsmesock_set_backlog_limits()
+*/
+void dsmesock_set_default_backlog_limits(const dsmesock_backlog_limits_t* limits,
+                                         dsmesock_backlog_cb_t callback,
+                                         void*                 user_data);
+
+
+/**
+   Number of distinct TSMSG_CLOSE_REASON_* values.
+   @ingroup dsmesock_client
+*/
+#define DSMESOCK_CLOSE_REASON_COUNT 5
+
+/**
+   I/O counters of a dsmesock connection.
+   @ingroup dsmesock_client
+*/
+typedef struct dsmesock_stats_t {
+  uint64_t msgs_in;           /**< Messages received */
+  uint64_t bytes_in;          /**< Bytes received in messages */
+  uint64_t msgs_out;          /**< Messages sent or queued for sending */
+  uint64_t bytes_out;         /**< Bytes written to the socket */
+  uint64_t syscalls;          /**< read, writev and getsockopt calls */
+  uint64_t eagain;            /**< Reads and writes that would have blocked */
+  uint64_t short_writes;      /**< Writes that left data to the queue */
+  uint64_t buffer_allocs;     /**< Receive buffer allocations and resizes */
+  uint64_t queue_peak_frames; /**< Highest number of queued output frames */
+  uint64_t queue_peak_bytes;  /**< Highest number of queued output bytes */
+  uint64_t closes[DSMESOCK_CLOSE_REASON_COUNT]; /**< By TSMSG_CLOSE_REASON_* */
+  uint64_t throttles;         /**< Times reading was paused by rate limit */
+  uint64_t throttled_ns;      /**< Time spent paused by rate limit */
+  uint64_t yields;            /**< Dispatches ended with input left over */
+  uint64_t congestions;       /**< Output backlog high watermark crossings */
+} dsmesock_stats_t;
+
+/**
+   Retrieves I/O counters of a connection.
+   @ingroup dsmesock_client
+   @param conn   Connection
+   @param stats  Where to store the counters.
+   @return true on success, or false if the connection is not valid.
+*/
+bool dsmesock_get_stats(dsmesock_connection_t* conn, dsmesock_stats_t* stats);
+
+/**
+   Retrieves I/O counters summed over all connections of the process,
+   open and closed, including those owned by other threads such as
+   the workers of dsmesock_server_start(). May be called from any
+   thread; counters of connections that other threads are using may
+   be a frame or so behind. Queue peaks are the highest values seen on
+   any single connection.
+   @ingroup dsmesock_client
+   @param stats  Where to store the counters.
+*/
+void dsmesock_get_total_stats(dsmesock_stats_t* stats);
+
+
 /**
    Holds path to dsme socket default location
 */
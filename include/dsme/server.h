@@ -0,0 +1,114 @@
+/**
+   @file server.h
+
+   Serving dsmesock clients from several worker threads.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_SERVER_H
+#define DSME_SERVER_H
+
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** How new clients are assigned to workers
+ */
+typedef enum {
+    /** Worker with the fewest connections */
+    DSMESOCK_SERVER_LEAST_LOADED,
+
+    /** By peer pid, so that reconnecting clients land on the same
+     *  worker */
+    DSMESOCK_SERVER_PEER_PID,
+} dsmesock_server_balance_t;
+
+/** Server settings
+ */
+typedef struct {
+    unsigned                  workers;   /**< worker threads, or 0 for
+                                          *   one per online cpu */
+    dsmesock_server_balance_t balance;
+    dsmesock_handler_t        handler;   /**< called in worker threads */
+    void                     *user_data; /**< passed to the handler */
+} dsmesock_server_config_t;
+
+/** Acceptor thread with a pool of worker threads
+ *
+ * The acceptor hands each new client to one worker, which then owns
+ * the connection exclusively: all messages from a client are passed to
+ * the handler in one thread, in the order they were received, and the
+ * handler may reply with dsmesock_send() directly. Broadcasts made
+ * from a handler reach the clients of that worker only; use
+ * dsmesock_server_broadcast() to reach all clients.
+ *
+ * The server closes a connection after passing DSM_MSGTYPE_CLOSE to
+ * the handler, or when the handler returns false.
+ */
+typedef struct dsmesock_server_t dsmesock_server_t;
+
+/** Start serving clients
+ *
+ * @param listen_fd  listening stream socket; it is put to nonblocking
+ *                   mode, and stays owned by the caller
+ * @param config     server settings
+ *
+ * Returns once every worker is running with a connection set of its
+ * own. If any worker fails to set one up, the threads already started
+ * are stopped and the call fails.
+ *
+ * @return server, or NULL with errno set on failure
+ */
+dsmesock_server_t *dsmesock_server_start(int listen_fd,
+                                         const dsmesock_server_config_t *config);
+
+/** Stop threads and close all client connections
+ */
+void dsmesock_server_stop(dsmesock_server_t *server);
+
+/** Send a message to all clients; may be called from any thread
+ *
+ * Goes through the send queue of each worker, see
+ * dsmesock_sendqueue_submit().
+ *
+ * @return false if memory could not be allocated for some worker
+ */
+bool dsmesock_server_broadcast(dsmesock_server_t *server,
+                               const void *msg,
+                               size_t extra_size,
+                               const void *extra);
+
+/** Number of worker threads
+ */
+unsigned dsmesock_server_workers(const dsmesock_server_t *server);
+
+/** Number of clients handed to a worker and not closed yet
+ */
+unsigned dsmesock_server_load(const dsmesock_server_t *server,
+                              unsigned worker);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
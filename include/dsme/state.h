@@ -64,6 +64,7 @@ typedef struct {
 
 typedef dsmemsg_generic_t DSM_MSGTYPE_STATE_QUERY;
 typedef dsmemsg_generic_t DSM_MSGTYPE_SAVE_DATA_IND;
+typedef dsmemsg_generic_t DSM_MSGTYPE_SAVE_DATA_ACK;
 typedef dsmemsg_generic_t DSM_MSGTYPE_THERMAL_SHUTDOWN_IND;
 typedef dsmemsg_generic_t DSM_MSGTYPE_REBOOT_REQ;
 typedef dsmemsg_generic_t DSM_MSGTYPE_POWERUP_REQ;
@@ -92,6 +93,7 @@ enum {
     DSME_MSG_ENUM(DSM_MSGTYPE_STATE_REQ_DENIED_IND, 0x00000309),
     DSME_MSG_ENUM(DSM_MSGTYPE_THERMAL_SHUTDOWN_IND, 0x00000310),
     DSME_MSG_ENUM(DSM_MSGTYPE_BATTERY_EMPTY_IND,    0x00000315),
+    DSME_MSG_ENUM(DSM_MSGTYPE_SAVE_DATA_ACK,        0x00000321),
 };
 
 
@@ -0,0 +1,183 @@
+/**
+   @file statuspage.h
+
+   Shared memory page with current dsme status values.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_STATUSPAGE_H
+#define DSME_STATUSPAGE_H
+
+#include "messages.h"
+#include "protocol.h"
+#include "state.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Status page identification */
+#define DSME_STATUSPAGE_MAGIC       0x50534d44 /* "DMSP" */
+#define DSME_STATUSPAGE_VERSION     1
+
+/** Number of thermal sensors the status page can hold */
+#define DSME_STATUSPAGE_SENSORS_MAX 16
+
+/** Thermal sensor status
+ */
+typedef struct
+{
+    char    name[DSM_TEMP_SENSOR_MAX_NAME_LEN]; /**< nul terminated */
+    int32_t status;      /**< dsme_thermal_status_t */
+    int32_t temperature; /**< as in DSM_MSGTYPE_SET_THERMAL_STATUS */
+} dsme_statuspage_sensor_t;
+
+/** Status values
+ */
+typedef struct
+{
+    int32_t  state;           /**< dsme_state_t */
+    int32_t  battery_level;   /**< dsme_battery_level_t */
+    uint8_t  charger;         /**< charger connected */
+    uint8_t  emergency_call;  /**< emergency call ongoing */
+    uint8_t  reserved[2];
+    int32_t  snooze_timeout;  /**< dsme_snooze_timeout_in_seconds() */
+    uint32_t sensor_count;    /**< used entries in sensors[] */
+    dsme_statuspage_sensor_t sensors[DSME_STATUSPAGE_SENSORS_MAX];
+} dsme_status_t;
+
+/** Status page layout
+ *
+ * The publisher increments seq before and after each update, so
+ * it is odd while an update is in progress. Use dsme_statuspage_read()
+ * rather than accessing the status directly.
+ */
+typedef struct
+{
+    uint32_t      magic;    /**< DSME_STATUSPAGE_MAGIC */
+    uint32_t      version;  /**< DSME_STATUSPAGE_VERSION */
+    uint32_t      size;     /**< sizeof(dsme_statuspage_t) */
+    uint32_t      seq;      /**< update sequence counter */
+    dsme_status_t status;
+} dsme_statuspage_t;
+
+/** Status page request; replied with DSM_MSGTYPE_STATUSPAGE
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_GET_STATUSPAGE;
+
+/** Status page reply; the page descriptor is passed along with it
+ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_STATUSPAGE;
+
+enum {
+    /* DSME Protocol messages 000000xx */
+    DSME_MSG_ENUM(DSM_MSGTYPE_GET_STATUSPAGE, 0x00000011),
+    DSME_MSG_ENUM(DSM_MSGTYPE_STATUSPAGE,     0x00000012),
+};
+
+/* ------------------------------------------------------------------------- *
+ * Publisher side
+ * ------------------------------------------------------------------------- */
+
+/** Create the status page of the process
+ *
+ * The page lives in a sealed memfd. Descriptors handed out with
+ * dsme_statuspage_send() are opened for reading only, so mappings
+ * made from them can not be written to.
+ * Initially the state is DSME_STATE_NOT_SET, battery level unknown
+ * and there are no thermal sensors.
+ *
+ * @return true on success, or if the page already exists
+ */
+bool dsme_statuspage_create(void);
+
+/** Destroy the status page; existing client mappings stay valid
+ */
+void dsme_statuspage_destroy(void);
+
+/* The page has a single writer: the setters below must be called from
+ * one thread only, or be serialized by the caller. */
+
+void dsme_statuspage_set_state(dsme_state_t state);
+void dsme_statuspage_set_battery_level(dsme_battery_level_t level);
+void dsme_statuspage_set_charger(bool connected);
+void dsme_statuspage_set_emergency_call(bool ongoing);
+
+/** Set status of a thermal sensor
+ *
+ * @return false if the sensor is new and the page has no room for it
+ */
+bool dsme_statuspage_set_thermal(const char *sensor,
+                                 dsme_thermal_status_t status,
+                                 int temperature);
+
+/** Send DSM_MSGTYPE_STATUSPAGE with the page descriptor
+ *
+ * @return 0 on success, or -1 with errno set
+ */
+int dsme_statuspage_send(dsmesock_connection_t *conn);
+
+/* ------------------------------------------------------------------------- *
+ * Client side
+ * ------------------------------------------------------------------------- */
+
+/** Map a status page from a descriptor
+ *
+ * The descriptor can be closed after mapping.
+ *
+ * @return page, or NULL if the descriptor is not a valid status page
+ */
+const dsme_statuspage_t *dsme_statuspage_map(int fd);
+
+/** Request the status page over a connection and map it
+ *
+ * Frames received while waiting are kept for later receive calls,
+ * see dsmesock_receive_id(). Descriptor passing is enabled on the
+ * connection only while waiting, see dsmesock_set_fd_passing().
+ *
+ * @param conn        connection to the publisher
+ * @param timeout_ms  how long to wait for the reply
+ *
+ * @return page, or NULL on failure
+ */
+const dsme_statuspage_t *dsme_statuspage_open(dsmesock_connection_t *conn,
+                                              int timeout_ms);
+
+/** Unmap a page returned by dsme_statuspage_map() or _open()
+ */
+void dsme_statuspage_unmap(const dsme_statuspage_t *page);
+
+/** Take a consistent copy of the status values
+ *
+ * Does not make system calls; retries a bounded number of times while
+ * the publisher is in the middle of an update.
+ *
+ * @return true on success, or false with errno set to EAGAIN if no
+ *         consistent copy could be taken, e.g. because the publisher
+ *         died while updating the page; status is then not valid
+ */
+bool dsme_statuspage_read(const dsme_statuspage_t *page, dsme_status_t *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
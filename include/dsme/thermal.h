@@ -0,0 +1,214 @@
+/**
+   @file thermal.h
+
+   Thermal sensor registry for compact thermal status messages, and
+   per-sensor aggregation of thermal status updates.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_THERMAL_H
+#define DSME_THERMAL_H
+
+#include "messages.h"
+#include "protocol.h"
+#include "state.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of sensors one connection can announce */
+#define DSME_THERMAL_SENSORS_MAX 64
+
+/** Binds a sensor name to an id for the rest of the connection
+ *
+ * Sent by the status publisher before the first
+ * DSM_MSGTYPE_THERMAL_SENSOR_STATUS that uses the id.
+ */
+typedef struct {
+    DSMEMSG_PRIVATE_FIELDS
+    uint32_t sensor_id;
+    char     sensor_name[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+} DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE;
+
+/** Compact equivalent of DSM_MSGTYPE_SET_THERMAL_STATUS
+ */
+typedef struct {
+    DSMEMSG_PRIVATE_FIELDS
+    uint32_t              sensor_id;
+    dsme_thermal_status_t status;
+    int                   temperature;
+} DSM_MSGTYPE_THERMAL_SENSOR_STATUS;
+
+enum {
+    DSME_MSG_ENUM(DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE, 0x00000322),
+    DSME_MSG_ENUM(DSM_MSGTYPE_THERMAL_SENSOR_STATUS,   0x00000323),
+};
+
+/** Sensor as seen by a registry
+ */
+typedef struct {
+    uint32_t              id;
+    char                  name[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+    dsme_thermal_status_t status;
+    int                   temperature;
+    bool                  valid;  /**< a status has been received */
+} dsme_thermal_sensor_t;
+
+/** Sensor names and ids of one connection
+ *
+ * On the sending side the registry remembers which names have been
+ * announced over the connection, on the receiving side it maps ids
+ * back to sensors. Use one registry per connection and direction.
+ */
+typedef struct dsme_thermal_registry_t dsme_thermal_registry_t;
+
+dsme_thermal_registry_t *dsme_thermal_registry_new(void);
+void dsme_thermal_registry_free(dsme_thermal_registry_t *reg);
+
+/** Send thermal status using the compact message
+ *
+ * Announces the sensor first, if not done yet on this registry.
+ *
+ * @return 0 on success, or -1 with errno set
+ */
+int dsme_thermal_send_status(dsmesock_connection_t *conn,
+                             dsme_thermal_registry_t *reg,
+                             const char *sensor,
+                             dsme_thermal_status_t status,
+                             int temperature);
+
+/** Process a received thermal message
+ *
+ * Handles DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE,
+ * DSM_MSGTYPE_THERMAL_SENSOR_STATUS and the legacy
+ * DSM_MSGTYPE_SET_THERMAL_STATUS, whose sensor names are interned
+ * into the same registry.
+ *
+ * @return the updated sensor for status messages, or NULL for
+ *         announcements, other messages and unknown sensor ids
+ */
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_handle(dsme_thermal_registry_t *reg,
+                             const dsmemsg_generic_t *msg);
+
+/** Look up a sensor by id; O(1)
+ *
+ * @return sensor, or NULL if the id is not known
+ */
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_sensor(const dsme_thermal_registry_t *reg,
+                             uint32_t id);
+
+/** Look up a sensor by name
+ *
+ * @return sensor, or NULL if the name is not known
+ */
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_find(const dsme_thermal_registry_t *reg,
+                           const char *name);
+
+/* ------------------------------------------------------------------------- *
+ * Aggregation
+ * ------------------------------------------------------------------------- */
+
+/** Number of samples kept per sensor */
+#define DSME_THERMAL_WINDOW_SAMPLES 32
+
+/** When to pass sensor updates on
+ */
+typedef struct {
+    unsigned window_ms;       /**< statistics cover samples this recent */
+    unsigned min_interval_ms; /**< minimum time between delta updates */
+    unsigned delta;           /**< temperature change that is passed on,
+                               *   or 0 to pass on status changes only */
+} dsme_thermal_aggregator_config_t;
+
+/** Statistics of one sensor over the configured window
+ */
+typedef struct {
+    dsme_thermal_status_t status;      /**< latest status */
+    int                   temperature; /**< latest temperature */
+    int                   min;
+    int                   max;
+    double                mean;
+    double                slope;       /**< change per second, by least
+                                        *   squares fit; 0 if unknown */
+    unsigned              samples;     /**< samples within the window */
+} dsme_thermal_stats_t;
+
+/** Called when a sensor update is passed on
+ */
+typedef void (*dsme_thermal_publish_cb_t)(const char *sensor,
+                                          const dsme_thermal_stats_t *stats,
+                                          void *user_data);
+
+/** Per-sensor rolling statistics and update filter
+ */
+typedef struct dsme_thermal_aggregator_t dsme_thermal_aggregator_t;
+
+dsme_thermal_aggregator_t *
+dsme_thermal_aggregator_new(const dsme_thermal_aggregator_config_t *config,
+                            dsme_thermal_publish_cb_t callback,
+                            void *user_data);
+void dsme_thermal_aggregator_free(dsme_thermal_aggregator_t *agg);
+
+/** Add a sample
+ *
+ * The callback is called for the first sample of a sensor, for every
+ * status change, and for temperature changes of at least delta since
+ * the last update passed on, at most once per minimum interval.
+ *
+ * @param timestamp_ns  CLOCK_MONOTONIC time of the sample
+ *
+ * @return true if the update was passed on
+ */
+bool dsme_thermal_aggregator_feed(dsme_thermal_aggregator_t *agg,
+                                  const char *sensor,
+                                  dsme_thermal_status_t status,
+                                  int temperature,
+                                  int64_t timestamp_ns);
+
+/** Add a sample from a received thermal message
+ *
+ * The message is first passed to dsme_thermal_registry_handle(), so
+ * both compact and legacy status messages are accepted.
+ *
+ * @return true if the update was passed on
+ */
+bool dsme_thermal_aggregator_handle(dsme_thermal_aggregator_t *agg,
+                                    dsme_thermal_registry_t *reg,
+                                    const dsmemsg_generic_t *msg);
+
+/** Get current statistics of a sensor
+ *
+ * @return false if the sensor is not known
+ */
+bool dsme_thermal_aggregator_stats(dsme_thermal_aggregator_t *agg,
+                                   const char *sensor,
+                                   int64_t now_ns,
+                                   dsme_thermal_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
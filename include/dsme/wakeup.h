@@ -0,0 +1,129 @@
+/**
+   @file wakeup.h
+
+   Client side scheduler that aligns periodic work to dsme wakeups.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_WAKEUP_H
+#define DSME_WAKEUP_H
+
+#include "messages.h"
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Wakeup request; replaces any earlier request of the connection
+ *
+ * The wakeup service replies with DSM_MSGTYPE_WAKEUP_IND at a system
+ * wakeup that falls within the window, or at the end of the window.
+ *
+ * These identifiers belong to the client scheduler; the daemon's own
+ * WAIT and WAKEUP messages (0x600 and 0x601) have a different layout
+ * and are not used here.
+ */
+typedef struct {
+    DSMEMSG_PRIVATE_FIELDS
+    uint32_t mintime_ms; /**< earliest wakeup, relative to sending */
+    uint32_t maxtime_ms; /**< latest wakeup, relative to sending */
+} DSM_MSGTYPE_WAKEUP_REQ;
+
+/** Reply to DSM_MSGTYPE_WAKEUP_REQ */
+typedef dsmemsg_generic_t DSM_MSGTYPE_WAKEUP_IND;
+
+enum {
+    DSME_MSG_ENUM(DSM_MSGTYPE_WAKEUP_REQ, 0x00000013),
+    DSME_MSG_ENUM(DSM_MSGTYPE_WAKEUP_IND, 0x00000014),
+};
+
+/** How long past the end of a window to wait for the daemon before
+ *  running work from the local timer */
+#define DSME_WAKEUP_GRACE_MS 1000
+
+/** Periodic work callback
+ *
+ * @return true to run again after the task interval, false to remove
+ *         the task
+ */
+typedef bool (*dsme_wakeup_cb_t)(void *user_data);
+
+/** Batches periodic work of a process into shared wakeups
+ *
+ * Each task runs no sooner than min_ms and no later than max_ms after
+ * it was added or last ran. The scheduler requests one wakeup that
+ * opens when the last window opens, but closes no later than the first
+ * window closes, and on wakeup runs every task that is due.
+ *
+ * Without a connection, or when the wakeup request can not be sent,
+ * a local timer fires at the end of the earliest window. Otherwise the
+ * local timer waits DSME_WAKEUP_GRACE_MS longer in case the daemon
+ * does not reply.
+ */
+typedef struct dsme_wakeup_scheduler_t dsme_wakeup_scheduler_t;
+
+/** Create a scheduler
+ *
+ * @param context  main context for the local timer, or NULL for the
+ *                 default context
+ */
+dsme_wakeup_scheduler_t *
+dsme_wakeup_scheduler_new(struct _GMainContext *context);
+void dsme_wakeup_scheduler_free(dsme_wakeup_scheduler_t *sched);
+
+/** Set connection for wakeup requests
+ *
+ * The scheduler does not receive from the connection; pass received
+ * messages to dsme_wakeup_handle(). Set to NULL before the connection
+ * is closed.
+ *
+ * @param conn  connection to dsme, or NULL to use the local timer only
+ */
+void dsme_wakeup_scheduler_set_connection(dsme_wakeup_scheduler_t *sched,
+                                          dsmesock_connection_t *conn);
+
+/** Add a periodic task
+ *
+ * @return task id, or 0 on failure
+ */
+unsigned dsme_wakeup_add(dsme_wakeup_scheduler_t *sched,
+                         unsigned min_ms, unsigned max_ms,
+                         dsme_wakeup_cb_t callback, void *user_data);
+
+/** Remove a task; may be called from task callbacks
+ */
+void dsme_wakeup_remove(dsme_wakeup_scheduler_t *sched, unsigned id);
+
+/** Process a received message
+ *
+ * Runs due tasks on DSM_MSGTYPE_WAKEUP_IND.
+ *
+ * @return true if the message was a wakeup
+ */
+bool dsme_wakeup_handle(dsme_wakeup_scheduler_t *sched,
+                        const dsmemsg_generic_t *msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,374 @@
+/**
+   @file loopback.c
+
+   In-process transport that connects two dsmesock connections.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/protocol.h"
+#include "dsme_internal.h"
+
+#include <sys/eventfd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* ------------------------------------------------------------------------- *
+ * Types
+ * ------------------------------------------------------------------------- */
+
+/** Ring buffer size; a power of two, and large enough for any frame */
+#define LOOPBACK_RING_SIZE 65536
+
+/** Bytes travelling to one side
+ *
+ * Single producer, single consumer: head is advanced only by the
+ * writing side and tail only by the reading side.
+ */
+typedef struct
+{
+    unsigned char data[LOOPBACK_RING_SIZE];
+    size_t        head;
+
+    /* Keep the sides from sharing a cache line */
+    char          pad[64 - sizeof(size_t)];
+    size_t        tail;
+
+    /** Readable while there is data or the writer has gone away */
+    int           eventfd;
+
+    /** Descriptor sent along, delivered when passfd_pos is read */
+    int           passfd;
+    size_t        passfd_pos;
+
+    bool          reader_closed;
+    bool          writer_closed;
+
+    /** The writer has output waiting for space */
+    bool          writer_waiting;
+} loopback_ring_t;
+
+/** Shared state of a connection pair
+ *
+ * ring[i] is read by side i, and its eventfd is the descriptor of
+ * side i. It also wakes up side i when space frees up in the ring
+ * side i writes to.
+ */
+typedef struct
+{
+    loopback_ring_t ring[2];
+    int             refs;
+} loopback_pair_t;
+
+/** Transport data of one side */
+typedef struct
+{
+    loopback_pair_t *pair;
+    int              side;
+} loopback_end_t;
+
+/* ------------------------------------------------------------------------- *
+ * Ring buffer
+ * ------------------------------------------------------------------------- */
+
+static void
+loopback_signal(loopback_ring_t *ring)
+{
+    uint64_t one = 1;
+
+    if( write(ring->eventfd, &one, sizeof one) == -1 ) {
+        /* Counter overflow can not happen; it is cleared on each drain */
+    }
+}
+
+static void
+loopback_clear(loopback_ring_t *ring)
+{
+    uint64_t count;
+
+    if( read(ring->eventfd, &count, sizeof count) == -1 ) {
+        /* EAGAIN: was not signaled */
+    }
+}
+
+static void
+loopback_pair_unref(loopback_pair_t *pair)
+{
+    if( __atomic_sub_fetch(&pair->refs, 1, __ATOMIC_ACQ_REL) != 0 )
+        return;
+
+    for( int i = 0; i < 2; ++i ) {
+        if( pair->ring[i].eventfd != -1 )
+            close(pair->ring[i].eventfd);
+        if( pair->ring[i].passfd != -1 )
+            close(pair->ring[i].passfd);
+    }
+    free(pair);
+}
+
+/** Ask the reader to wake us up when it makes space in the ring */
+static void
+loopback_wait(loopback_end_t *end, size_t tail)
+{
+    loopback_ring_t *ring = &end->pair->ring[!end->side];
+
+    __atomic_store_n(&ring->writer_waiting, true, __ATOMIC_SEQ_CST);
+
+    /* Space might have been made before the flag was seen */
+    if( __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != tail &&
+        __atomic_exchange_n(&ring->writer_waiting, false, __ATOMIC_SEQ_CST) )
+        loopback_signal(&end->pair->ring[end->side]);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Transport operations
+ * ------------------------------------------------------------------------- */
+
+static ssize_t
+loopback_recv(void *data, int fd, void *buf, size_t size, int *rxfd)
+{
+    loopback_end_t  *end  = data;
+    loopback_ring_t *ring = &end->pair->ring[end->side];
+    size_t           head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    size_t           tail = ring->tail;
+    size_t           avail = head - tail;
+    size_t           off;
+    size_t           len;
+    int              passfd;
+
+    (void)fd;
+
+    if( avail == 0 ) {
+        if( __atomic_load_n(&ring->writer_closed, __ATOMIC_ACQUIRE) )
+            return 0;
+
+        /* Woken up for writing only */
+        loopback_clear(ring);
+        if( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != head ||
+            __atomic_load_n(&ring->writer_closed, __ATOMIC_ACQUIRE) )
+            loopback_signal(ring);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if( size > avail )
+        size = avail;
+
+    off = tail & (LOOPBACK_RING_SIZE - 1);
+    len = LOOPBACK_RING_SIZE - off;
+    if( len > size )
+        len = size;
+    memcpy(buf, ring->data + off, len);
+    memcpy((unsigned char *)buf + len, ring->data, size - len);
+
+    /* The descriptor goes with the byte it was sent with */
+    passfd = __atomic_load_n(&ring->passfd, __ATOMIC_ACQUIRE);
+    if( passfd != -1 && ring->passfd_pos - tail < size ) {
+        if( rxfd )
+            *rxfd = passfd;
+        else
+            close(passfd);
+        __atomic_store_n(&ring->passfd, -1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_SEQ_CST);
+    if( __atomic_exchange_n(&ring->writer_waiting, false, __ATOMIC_SEQ_CST) )
+        loopback_signal(&end->pair->ring[!end->side]);
+
+    /* Clear the wakeup once drained, unless more arrived meanwhile */
+    if( tail + size == head ) {
+        loopback_clear(ring);
+        if( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != head ||
+            __atomic_load_n(&ring->writer_closed, __ATOMIC_ACQUIRE) )
+            loopback_signal(ring);
+    }
+    return size;
+}
+
+static ssize_t
+loopback_send(void *data, int fd, const struct iovec *iov, int count,
+              int passfd)
+{
+    loopback_end_t  *end  = data;
+    loopback_ring_t *ring = &end->pair->ring[!end->side];
+    size_t           tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t           head = ring->head;
+    size_t           space = LOOPBACK_RING_SIZE - (head - tail);
+    size_t           total = 0;
+    size_t           done = 0;
+
+    (void)fd;
+
+    for( int i = 0; i < count; ++i )
+        total += iov[i].iov_len;
+
+    if( __atomic_load_n(&ring->reader_closed, __ATOMIC_ACQUIRE) ) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if( space == 0 ) {
+        loopback_wait(end, tail);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if( passfd != -1 ) {
+        /* One descriptor in flight at a time */
+        if( __atomic_load_n(&ring->passfd, __ATOMIC_ACQUIRE) != -1 ) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if( (passfd = fcntl(passfd, F_DUPFD_CLOEXEC, 0)) == -1 )
+            return -1;
+        ring->passfd_pos = head;
+        __atomic_store_n(&ring->passfd, passfd, __ATOMIC_RELEASE);
+    }
+
+    for( int i = 0; i < count && done < space; ++i ) {
+        const unsigned char *src = iov[i].iov_base;
+        size_t               left = iov[i].iov_len;
+
+        if( left > space - done )
+            left = space - done;
+
+        while( left > 0 ) {
+            size_t off = (head + done) & (LOOPBACK_RING_SIZE - 1);
+            size_t len = LOOPBACK_RING_SIZE - off;
+
+            if( len > left )
+                len = left;
+            memcpy(ring->data + off, src, len);
+            src  += len;
+            left -= len;
+            done += len;
+        }
+    }
+
+    __atomic_store_n(&ring->head, head + done, __ATOMIC_SEQ_CST);
+
+    /* Wake up the reader if it may have drained the ring already */
+    if( __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head )
+        loopback_signal(ring);
+
+    if( done < total )
+        loopback_wait(end, tail);
+
+    return done;
+}
+
+static int
+loopback_peercred(void *data, int fd, struct ucred *cred)
+{
+    (void)data;
+    (void)fd;
+
+    cred->pid = getpid();
+    cred->uid = getuid();
+    cred->gid = getgid();
+    return 0;
+}
+
+static void
+loopback_close(void *data, int fd)
+{
+    loopback_end_t  *end  = data;
+    loopback_pair_t *pair = end->pair;
+    loopback_ring_t *peer = &pair->ring[!end->side];
+
+    (void)fd;
+
+    /* The descriptor stays open until both sides are closed, so that
+     * the peer never signals a reused descriptor number */
+    __atomic_store_n(&pair->ring[end->side].reader_closed, true,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&peer->writer_closed, true, __ATOMIC_RELEASE);
+    loopback_signal(peer);
+
+    free(end);
+    loopback_pair_unref(pair);
+}
+
+static const dsmesock_transport_t loopback_transport = {
+    .name         = "loopback",
+    .recv         = loopback_recv,
+    .send         = loopback_send,
+    .peercred     = loopback_peercred,
+    .close        = loopback_close,
+    .wakes_writer = true,
+};
+
+/* ------------------------------------------------------------------------- *
+ * Public interface
+ * ------------------------------------------------------------------------- */
+
+bool
+dsmesock_loopback_pair(dsmesock_connection_t **a, dsmesock_connection_t **b)
+{
+    dsmesock_connection_t *conn[2] = { 0, 0 };
+    loopback_pair_t       *pair;
+    loopback_end_t        *end;
+    int                    side;
+
+    if( !(pair = calloc(1, sizeof *pair)) )
+        return false;
+
+    for( side = 0; side < 2; ++side ) {
+        pair->ring[side].passfd = -1;
+        pair->ring[side].eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    if( pair->ring[0].eventfd == -1 || pair->ring[1].eventfd == -1 )
+        goto FAIL;
+
+    for( side = 0; side < 2; ++side ) {
+        if( !(end = calloc(1, sizeof *end)) )
+            goto FAIL;
+        end->pair = pair;
+        end->side = side;
+        ++pair->refs;
+
+        conn[side] = dsmesock_init_transport(pair->ring[side].eventfd,
+                                             &loopback_transport, end);
+        if( !conn[side] ) {
+            --pair->refs;
+            free(end);
+            goto FAIL;
+        }
+    }
+
+    *a = conn[0];
+    *b = conn[1];
+    return true;
+
+FAIL:
+    /* Closing the connections drops their references to the pair */
+    ++pair->refs;
+    for( side = 0; side < 2; ++side ) {
+        if( conn[side] )
+            dsmesock_close(conn[side]);
+    }
+    loopback_pair_unref(pair);
+    return false;
+}
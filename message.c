@@ -24,10 +24,16 @@
    License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
 #include "include/dsme/messages.h"
+#include "dsme_internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 /** Lookup table for message type id <-> name
  *
@@ -42,6 +48,11 @@ static const struct
 } dsmemsg_id_lut[] =
 {
     { "CLOSE",                          0x00000001 },
+    { "CAPTURE_FRAME",                  0x00000010 },
+    { "GET_STATUSPAGE",                 0x00000011 },
+    { "STATUSPAGE",                     0x00000012 },
+    { "WAKEUP_REQ",                     0x00000013 },
+    { "WAKEUP_IND",                     0x00000014 },
     { "DBUS_CONNECT",                   0x00000100 },
     { "DBUS_DISCONNECT",                0x00000101 },
     { "DBUS_CONNECTED",                 0x00000102 },
@@ -65,6 +76,9 @@ static const struct
     { "CHANGE_RUNLEVEL",                0x00000319 },
     { "SET_BATTERY_LEVEL",              0x0000031a },
     { "SET_THERMAL_STATUS",             0x00000320 },
+    { "SAVE_DATA_ACK",                  0x00000321 },
+    { "THERMAL_SENSOR_ANNOUNCE",        0x00000322 },
+    { "THERMAL_SENSOR_STATUS",          0x00000323 },
     { "PROCESSWD_CREATE",               0x00000500 },
     { "PROCESSWD_DELETE",               0x00000501 },
     { "PROCESSWD_CLEAR",                0x00000502 },
@@ -90,12 +104,21 @@ static const struct
 };
 
 const char *
-dsmemsg_id_name(uint32_t id)
+dsmemsg_id_lookup(uint32_t id)
 {
     for( size_t i = 0; dsmemsg_id_lut[i].name; ++i ) {
         if( dsmemsg_id_lut[i].id == id )
             return dsmemsg_id_lut[i].name;
     }
+    return 0;
+}
+
+const char *
+dsmemsg_id_name(uint32_t id)
+{
+    const char *name = dsmemsg_id_lookup(id);
+    if( name )
+        return name;
 
     static char buf[32];
     snprintf(buf, sizeof buf, "UNKNOWN_%08lx",
@@ -164,3 +187,107 @@ dsmemsg_extra_data(const dsmemsg_generic_t *msg)
 
     return data;
 }
+
+/* ------------------------------------------------------------------------- *
+ * Message arena
+ * ------------------------------------------------------------------------- */
+
+/* Initial size of buffers allocated by arenas */
+#define DSMEMSG_ARENA_MIN 1024
+
+/* Frames start at offsets that are multiples of this */
+#define DSMEMSG_ARENA_ALIGN 8
+
+static size_t
+dsmemsg_arena_align(size_t offs)
+{
+    return (offs + DSMEMSG_ARENA_ALIGN - 1) &
+           ~(size_t)(DSMEMSG_ARENA_ALIGN - 1);
+}
+
+void
+dsmemsg_arena_init(dsmemsg_arena_t *arena, void *buf, size_t size)
+{
+    arena->buf   = buf;
+    arena->size  = buf ? size : 0;
+    arena->used  = 0;
+    arena->owned = !buf;
+}
+
+void
+dsmemsg_arena_reset(dsmemsg_arena_t *arena)
+{
+    arena->used = 0;
+}
+
+void
+dsmemsg_arena_release(dsmemsg_arena_t *arena)
+{
+    if( arena->owned )
+        free(arena->buf);
+    arena->buf  = 0;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+void *
+dsmemsg_arena_reserve(dsmemsg_arena_t *arena, uint32_t id,
+                      size_t size, size_t extra)
+{
+    dsmemsg_generic_t *msg;
+    size_t             need = size + extra;
+    size_t             offs = dsmemsg_arena_align(arena->used);
+
+    if( size < sizeof *msg || need < size || need > UINT32_MAX ) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if( arena->size < offs || arena->size - offs < need ) {
+        size_t         grow = arena->size ? arena->size : DSMEMSG_ARENA_MIN;
+        unsigned char *buf;
+
+        if( !arena->owned ) {
+            errno = ENOBUFS;
+            return 0;
+        }
+        while( grow < offs || grow - offs < need )
+            grow *= 2;
+        if( !(buf = realloc(arena->buf, grow)) )
+            return 0;
+        arena->buf  = buf;
+        arena->size = grow;
+    }
+
+    msg = (dsmemsg_generic_t *)(arena->buf + offs);
+    msg->line_size_ = need;
+    msg->size_      = size;
+    msg->type_      = id;
+    arena->used = offs + need;
+
+    return msg;
+}
+
+const dsmemsg_generic_t *
+dsmemsg_arena_next(const dsmemsg_arena_t *arena,
+                   const dsmemsg_generic_t *prev)
+{
+    const dsmemsg_generic_t *msg;
+    size_t                   offs = 0;
+
+    if( prev ) {
+        offs = (const unsigned char *)prev - arena->buf + prev->line_size_;
+        offs = dsmemsg_arena_align(offs);
+    }
+
+    if( offs >= arena->used || arena->used - offs < sizeof *msg )
+        return 0;
+
+    /* Stop at a frame that does not fit what was reserved */
+    msg = (const dsmemsg_generic_t *)(arena->buf + offs);
+    if( msg->line_size_ < sizeof *msg ||
+        msg->line_size_ > arena->used - offs )
+        return 0;
+
+    return msg;
+}
@@ -0,0 +1,357 @@
+/**
+   @file msgstats.c
+
+   Per message type size and latency histograms.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/msgstats.h"
+#include "include/dsme/messages.h"
+#include "dsme_internal.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------------- *
+ * Data types
+ * ------------------------------------------------------------------------- */
+
+/** Number of message types that can be tracked per thread */
+#define MSGSTATS_SLOTS   64
+
+/** Number of power of two histogram buckets */
+#define MSGSTATS_BUCKETS 32
+
+/** Counters for one message type in one direction */
+typedef struct
+{
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t timed;
+    uint64_t latency_ns;
+    uint64_t size_hist[MSGSTATS_BUCKETS];
+    uint64_t latency_hist[MSGSTATS_BUCKETS];
+} msgstats_counters_t;
+
+/** Counters for one message type */
+typedef struct
+{
+    uint32_t            id;
+    uint32_t            used;
+    msgstats_counters_t dir[2];
+} msgstats_slot_t;
+
+/** Counters updated by one thread
+ *
+ * Only the owning thread writes to a shard, so updates need no
+ * read-modify-write atomics; relaxed stores just keep the values
+ * intact for dsmemsg_stats_dump() running in another thread. When
+ * the thread exits, its counters are merged to msgstats_retired and
+ * the shard is released.
+ */
+typedef struct msgstats_shard_t
+{
+    struct msgstats_shard_t *next;
+    uint64_t                 dropped;
+    msgstats_slot_t          slot[MSGSTATS_SLOTS];
+} msgstats_shard_t;
+
+/* ------------------------------------------------------------------------- *
+ * State data
+ * ------------------------------------------------------------------------- */
+
+bool dsmemsg_stats_active = false;
+
+/** Protects the list of shards and msgstats_retired */
+G_LOCK_DEFINE_STATIC(msgstats);
+
+/** Shards of running threads; protected by msgstats lock */
+static msgstats_shard_t *msgstats_shards = 0;
+
+/** Counters of exited threads; protected by msgstats lock */
+static msgstats_shard_t msgstats_retired;
+
+/** Shard of the current thread */
+static __thread msgstats_shard_t *msgstats_shard = 0;
+
+static void msgstats_shard_release(gpointer data);
+
+/** Releases the shard of a thread when it exits */
+static GPrivate msgstats_owner = G_PRIVATE_INIT(msgstats_shard_release);
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+#define MSGSTATS_ADD(PTR, VAL) \
+    __atomic_store_n((PTR), __atomic_load_n((PTR), __ATOMIC_RELAXED) + (VAL),\
+                     __ATOMIC_RELAXED)
+
+static unsigned
+msgstats_bucket(uint64_t value)
+{
+    unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+    return bucket < MSGSTATS_BUCKETS ? bucket : MSGSTATS_BUCKETS - 1;
+}
+
+static uint64_t
+msgstats_percentile(const uint64_t *hist, uint64_t total, unsigned permille)
+{
+    uint64_t limit = (total * permille + 999) / 1000;
+    uint64_t sum   = 0;
+
+    for( unsigned i = 0; i < MSGSTATS_BUCKETS; ++i ) {
+        sum += hist[i];
+        if( sum >= limit )
+            return i ? (UINT64_C(1) << i) - 1 : 0;
+    }
+    return UINT64_MAX;
+}
+
+static msgstats_shard_t *
+msgstats_get_shard(void)
+{
+    msgstats_shard_t *shard = msgstats_shard;
+
+    if( !shard && (shard = calloc(1, sizeof *shard)) ) {
+        G_LOCK(msgstats);
+        shard->next     = msgstats_shards;
+        msgstats_shards = shard;
+        G_UNLOCK(msgstats);
+        msgstats_shard = shard;
+        g_private_set(&msgstats_owner, shard);
+    }
+
+    return shard;
+}
+
+static msgstats_slot_t *
+msgstats_get_slot(msgstats_shard_t *shard, uint32_t id)
+{
+    unsigned hash = (id * 2654435761u) % MSGSTATS_SLOTS;
+
+    for( unsigned i = 0; i < MSGSTATS_SLOTS; ++i ) {
+        msgstats_slot_t *slot = &shard->slot[(hash + i) % MSGSTATS_SLOTS];
+
+        if( !slot->used ) {
+            slot->id = id;
+            __atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+            return slot;
+        }
+        if( slot->id == id )
+            return slot;
+    }
+
+    return 0;
+}
+
+/** Add counters of a slot, possibly being updated by its owner */
+static void
+msgstats_add_slot(msgstats_slot_t *dst, const msgstats_slot_t *src)
+{
+    /* Counters are all uint64_t; sum them up word by word */
+    const uint64_t *from  = (const uint64_t *)src->dir;
+    uint64_t       *to    = (uint64_t *)dst->dir;
+    size_t          words = sizeof src->dir / (sizeof *to);
+
+    for( size_t n = 0; n < words; ++n )
+        to[n] += __atomic_load_n(&from[n], __ATOMIC_RELAXED);
+}
+
+/** Merge counters of an exiting thread and release its shard */
+static void
+msgstats_shard_release(gpointer data)
+{
+    msgstats_shard_t  *shard = data;
+    msgstats_shard_t **prev;
+
+    G_LOCK(msgstats);
+    for( prev = &msgstats_shards; *prev; prev = &(*prev)->next ) {
+        if( *prev == shard ) {
+            *prev = shard->next;
+            break;
+        }
+    }
+
+    msgstats_retired.dropped += shard->dropped;
+    for( size_t i = 0; i < MSGSTATS_SLOTS; ++i ) {
+        const msgstats_slot_t *slot = &shard->slot[i];
+        msgstats_slot_t       *sum;
+
+        if( !slot->used )
+            continue;
+        if( (sum = msgstats_get_slot(&msgstats_retired, slot->id)) )
+            msgstats_add_slot(sum, slot);
+        else
+            msgstats_retired.dropped += (slot->dir[0].count +
+                                         slot->dir[1].count);
+    }
+    G_UNLOCK(msgstats);
+
+    if( msgstats_shard == shard )
+        msgstats_shard = 0;
+    free(shard);
+}
+
+/** Add counters of a shard to a list of per type sums */
+static uint64_t
+msgstats_sum_shard(msgstats_slot_t **sum, size_t *count,
+                   const msgstats_shard_t *shard)
+{
+    for( size_t i = 0; i < MSGSTATS_SLOTS; ++i ) {
+        const msgstats_slot_t *slot = &shard->slot[i];
+        size_t k;
+
+        if( !__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE) )
+            continue;
+
+        for( k = 0; k < *count; ++k ) {
+            if( (*sum)[k].id == slot->id )
+                break;
+        }
+        if( k == *count ) {
+            msgstats_slot_t *tmp = realloc(*sum, (k + 1) * sizeof *tmp);
+            if( !tmp )
+                continue;
+            *sum = tmp;
+            memset(&tmp[k], 0, sizeof *tmp);
+            tmp[k].id = slot->id;
+            *count = k + 1;
+        }
+        msgstats_add_slot(&(*sum)[k], slot);
+    }
+
+    return __atomic_load_n(&shard->dropped, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Public API
+ * ------------------------------------------------------------------------- */
+
+void
+dsmemsg_stats_enable(bool enable)
+{
+    __atomic_store_n(&dsmemsg_stats_active, enable, __ATOMIC_RELAXED);
+}
+
+bool
+dsmemsg_stats_enabled(void)
+{
+    return __atomic_load_n(&dsmemsg_stats_active, __ATOMIC_RELAXED);
+}
+
+void
+dsmemsg_stats_record(uint32_t id, dsmemsg_stats_dir_t dir,
+                     size_t size, int64_t latency_ns)
+{
+    msgstats_shard_t    *shard;
+    msgstats_slot_t     *slot;
+    msgstats_counters_t *cnt;
+
+    if( !(shard = msgstats_get_shard()) )
+        return;
+
+    if( !(slot = msgstats_get_slot(shard, id)) ) {
+        MSGSTATS_ADD(&shard->dropped, 1);
+        return;
+    }
+
+    cnt = &slot->dir[dir == DSMEMSG_STATS_TX];
+    MSGSTATS_ADD(&cnt->count, 1);
+    MSGSTATS_ADD(&cnt->bytes, size);
+    MSGSTATS_ADD(&cnt->size_hist[msgstats_bucket(size)], 1);
+
+    if( latency_ns >= 0 ) {
+        MSGSTATS_ADD(&cnt->timed, 1);
+        MSGSTATS_ADD(&cnt->latency_ns, latency_ns);
+        MSGSTATS_ADD(&cnt->latency_hist[msgstats_bucket(latency_ns)], 1);
+    }
+}
+
+void
+dsmemsg_stats_dump(FILE *out)
+{
+    msgstats_slot_t *sum     = 0;
+    size_t           count   = 0;
+    uint64_t         dropped = 0;
+
+    /* Merge shards from all threads, running and exited */
+    G_LOCK(msgstats);
+    for( msgstats_shard_t *shard = msgstats_shards; shard; shard = shard->next )
+        dropped += msgstats_sum_shard(&sum, &count, shard);
+    dropped += msgstats_sum_shard(&sum, &count, &msgstats_retired);
+    G_UNLOCK(msgstats);
+
+    fprintf(out, "%-3s %-26s %10s %12s %8s %8s %10s %10s %10s\n",
+            "DIR", "MESSAGE", "COUNT", "BYTES", "SIZE50", "SIZE99",
+            "AVG_US", "LAT50_US", "LAT99_US");
+
+    for( size_t k = 0; k < count; ++k ) {
+        for( int d = 0; d < 2; ++d ) {
+            const msgstats_counters_t *cnt = &sum[k].dir[d];
+
+            if( !cnt->count )
+                continue;
+
+            fprintf(out, "%-3s %-26s %10llu %12llu %8llu %8llu",
+                    d ? "TX" : "RX", dsmemsg_id_name(sum[k].id),
+                    (unsigned long long)cnt->count,
+                    (unsigned long long)cnt->bytes,
+                    (unsigned long long)msgstats_percentile(cnt->size_hist,
+                                                            cnt->count, 500),
+                    (unsigned long long)msgstats_percentile(cnt->size_hist,
+                                                            cnt->count, 990));
+            if( cnt->timed ) {
+                fprintf(out, " %10.1f %10.1f %10.1f\n",
+                        cnt->latency_ns / 1e3 / cnt->timed,
+                        msgstats_percentile(cnt->latency_hist,
+                                            cnt->timed, 500) / 1e3,
+                        msgstats_percentile(cnt->latency_hist,
+                                            cnt->timed, 990) / 1e3);
+            }
+            else {
+                fprintf(out, " %10s %10s %10s\n", "-", "-", "-");
+            }
+        }
+    }
+
+    if( dropped )
+        fprintf(out, "dropped: %llu (too many message types)\n",
+                (unsigned long long)dropped);
+
+    free(sum);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Initialization
+ * ------------------------------------------------------------------------- */
+
+static void msgstats_init(void) __attribute__((constructor));
+
+static void
+msgstats_init(void)
+{
+    const char *env = getenv("DSME_MSGSTATS");
+    if( env && *env )
+        dsmemsg_stats_enable(true);
+}
@@ -1,7 +1,7 @@
 /**
    @file protocol.c
 
-   Implementation of DSME socket communication. 
+   Implementation of DSME socket communication.
    <p>
    Copyright (C) 2004-2009 Nokia Corporation.
 
@@ -29,6 +29,7 @@
 
 #include "include/dsme/protocol.h"
 #include "include/dsme/messages.h"
+#include "dsme_internal.h"
 
 #include <sys/uio.h>
 #include <glib.h>
@@ -41,11 +42,576 @@
 #include <sys/un.h>
 #include <string.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
 
-static GSList* connections = 0;
+#define DSMESOCK_BUF_SIZE_DEFAULT  1024
+#define DSMESOCK_BUF_SIZE_MAX     65536
+
+/* Receive buffer size estimate follows the largest frame at once, and
+ * loses 1/2^shift of the excess with each smaller frame */
+#define DSMESOCK_RXSIZE_DECAY_SHIFT   3
+
+/* Alignment handlers can rely on for received frames */
+#define DSMESOCK_FRAME_ALIGN          8
+
+/* Maximum number of queued frames written with one writev() call */
+#define DSMESOCK_TX_IOV_MAX          16
+
+/* Default per round work limits of attached connections */
+#define DSMESOCK_QUANTUM_FRAMES      32
+#define DSMESOCK_QUANTUM_BYTES    16384
+
+/* Default output backlog watermarks; a peer that stops reading is
+ * disconnected instead of growing the queue without bound */
+#define DSMESOCK_BACKLOG_HIGH_BYTES (1024 * 1024)
+#define DSMESOCK_BACKLOG_LOW_BYTES   (256 * 1024)
+
+typedef struct dsmesock_source_t dsmesock_source_t;
+
+/**
+   Receive rate limit state, see dsmesock_set_rate_limit()
+*/
+typedef struct dsmesock_limit_t {
+  uint32_t msgs;          /* messages per interval, 0 = unlimited */
+  uint32_t bytes;         /* bytes per interval, 0 = unlimited */
+  int64_t  interval_ns;   /* 0 = no limit */
+  int64_t  window_ns;     /* start of the current interval */
+  int64_t  msgs_left;
+  int64_t  bytes_left;
+  int64_t  throttled_ns;  /* start of throttling, 0 when not throttled */
+} dsmesock_limit_t;
+
+/**
+   Output backlog watermarks, see dsmesock_set_backlog_limits()
+*/
+typedef struct dsmesock_backlog_t {
+  dsmesock_backlog_limits_t limits;
+  dsmesock_backlog_cb_t     callback;
+  void*                     user_data;
+} dsmesock_backlog_t;
+
+struct dsmesock_cold_t;
+struct dsmesock_domain_t;
+
+/**
+   Library private connection data.
+
+   The public part must be the first member: pointers handed out to
+   clients are converted back with a plain cast.
+
+   Connections are allocated from slabs, see dsmesock_slab_t. What is
+   needed on every read and write is kept here, in two cache lines: the
+   public part and the transport fill the first one, the private state
+   the second. The rest lives in dsmesock_cold_t.
+*/
+typedef struct dsmesock_private_t {
+  dsmesock_connection_t       pub;
+
+  /* Byte stream operations, see dsmesock_init_transport() */
+  const dsmesock_transport_t* transport;
+  void*                       transport_data;
+
+  /* Offset of the first unconsumed byte in pub.buf; non-zero only
+   * while frames read ahead by an attached source are pending */
+  unsigned long               rxhead;
+
+  /* Bytes in cold->txqueue */
+  unsigned long               txbytes;
+
+  /* Main loop integration, see dsmesock_attach() */
+  dsmesock_source_t*          source;
+
+  /* Slot in the parallel array of the same slab */
+  struct dsmesock_cold_t*     cold;
+
+  /* Owner while open, NULL once closed or not in use */
+  struct dsmesock_domain_t*   domain;
+
+  /* Byte credit left over from earlier dispatch rounds */
+  int64_t                     deficit;
+
+  /* Connection identifier in capture files */
+  uint32_t                    serial;
+
+  uint8_t                     dispatching;
+  uint8_t                     close_pending;
+
+  /* Output backlog watermarks; congested after crossing the high
+   * mark until the backlog falls below the low mark */
+  uint8_t                     congested;
+  uint8_t                     evicted;
+} __attribute__((aligned(64))) dsmesock_private_t;
+
+G_STATIC_ASSERT(sizeof(dsmesock_private_t) <= 128);
+
+/**
+   Connection data not needed on the common receive and send paths
+*/
+typedef struct dsmesock_cold_t {
+  /* Output that could not be written without blocking */
+  GQueue                txqueue;
+
+  /* Output backlog watermarks, see dsmesock_set_backlog_limits() */
+  dsmesock_backlog_t    backlog;
+
+  /* Outstanding dsmesock_call_async() requests, oldest first */
+  GQueue                calls;
+
+  /* Received frames set aside by dsmesock_receive_id() */
+  GQueue                stash;
+
+  /* Latest descriptor passed by the peer, see dsmesock_take_fd() */
+  int                   rxfd;
+
+  /* Descriptors from the peer are accepted, see dsmesock_set_fd_passing() */
+  bool                  fd_passing;
+
+  /* Receive rate limit for attached connections */
+  dsmesock_limit_t      limit;
+
+  /* I/O counters, see dsmesock_get_stats() */
+  dsmesock_stats_t      stats;
+
+  /* Receive buffer size estimate, see dsmesock_rxsize_note() */
+  uint32_t              rxsize;
+
+  /* Aligned copy of a read-ahead frame, see dsmesock_frame() */
+  uint32_t              scratch_size;
+  unsigned char*        scratch;
+
+  /* Next unused slot, while on the free list of the domain */
+  dsmesock_private_t*   next_free;
+} dsmesock_cold_t;
+
+/**
+   Queued output frame
+*/
+typedef struct dsmesock_txframe_t {
+  size_t        size;
+  size_t        done;
+  uint32_t      id;          /* message type, for statistics */
+  uint32_t      line_size;   /* size of the whole frame */
+  int64_t       queued_ns;   /* queueing time, if statistics are enabled */
+  unsigned char data[];
+} dsmesock_txframe_t;
+
+/**
+   Outstanding asynchronous call
+*/
+typedef struct dsmesock_call_t {
+  unsigned            id;
+  uint32_t            reply_id;
+  uint64_t            token;       /* 0 = match by reply type only */
+  int64_t             deadline_ns; /* 0 = no timeout */
+  dsmesock_reply_cb_t callback;
+  void*               user_data;
+} dsmesock_call_t;
+
+/**
+   GSource for dispatching frames from an attached connection
+*/
+struct dsmesock_source_t {
+  GSource             base;
+  dsmesock_private_t* priv;
+  gpointer            tag;
+  GIOCondition        events;
+  dsmesock_handler_t  handler;
+  void*               user_data;
+};
+
+/**
+   Block of connection slots
+
+   Slots are never given back to the system while the domain exists,
+   so a stale handle can still be checked for validity with a single
+   load, see dsmesock_valid().
+*/
+typedef struct dsmesock_slab_t {
+  struct dsmesock_slab_t* next;
+  unsigned                size;   /* slots */
+  unsigned                used;   /* slots handed out at least once */
+  dsmesock_private_t*     hot;    /* cache line aligned */
+  dsmesock_cold_t*        cold;
+} dsmesock_slab_t;
+
+/* Slots in the first slab of a domain; doubles up to the maximum */
+#define DSMESOCK_SLAB_MIN 16
+#define DSMESOCK_SLAB_MAX 1024
+
+/**
+   Set of connections, see dsmesock_domain_enter()
+*/
+typedef struct dsmesock_domain_t {
+  /* Newest and largest first */
+  dsmesock_slab_t*    slabs;
+
+  /* Released slots, reused before new ones */
+  dsmesock_private_t* free_slots;
+
+  /* Counters of all connections of the domain, open and closed;
+   * updated and read with atomics only */
+  dsmesock_stats_t    totals;
+
+  /* Next domain entered by a thread, see own_domains */
+  struct dsmesock_domain_t* next;
+} dsmesock_domain_t;
+
+/**
+   Position when walking over the connections of a domain
+*/
+typedef struct dsmesock_iter_t {
+  dsmesock_slab_t* slab;
+  unsigned         index;
+} dsmesock_iter_t;
+
+static dsmesock_domain_t shared_domain;
+
+/* Connections of the calling thread; shared by all threads except
+ * those that have entered a domain of their own */
+static __thread dsmesock_domain_t* domain = &shared_domain;
+
+/* Domains entered by threads, and counters of those already left */
+G_LOCK_DEFINE_STATIC(dsmesock_domains);
+static dsmesock_domain_t* own_domains;
+static dsmesock_stats_t   retired_stats;
+
+/* Count into a connection, and into the running totals of the calling
+ * thread's domain that dsmesock_get_total_stats() reads from any thread */
+#define DSMESOCK_COUNT(PRIV, FIELD, N) do { \
+    uint64_t count_ = (N); \
+    (PRIV)->cold->stats.FIELD += count_; \
+    __atomic_fetch_add(&domain->totals.FIELD, count_, __ATOMIC_RELAXED); \
+  } while (0)
+
+/* Serial number of the latest connection */
+static uint32_t connection_serial = 0;
+
+/* Identifier of the latest asynchronous call */
+static unsigned call_id = 0;
+
+/* Rate limit given to new connections; accessed with atomics, field
+ * by field, see dsmesock_limit_copy() */
+static dsmesock_limit_t default_limit;
+
+/* Backlog watermarks given to new connections; accessed with atomics,
+ * field by field, see dsmesock_backlog_copy() */
+static dsmesock_backlog_t default_backlog = {
+  .limits = {
+    .high_bytes = DSMESOCK_BACKLOG_HIGH_BYTES,
+    .low_bytes  = DSMESOCK_BACKLOG_LOW_BYTES,
+    .disconnect = true,
+  },
+};
+
+/* Work done for one attached connection per main loop round; accessed
+ * with atomics */
+static unsigned quantum_frames = DSMESOCK_QUANTUM_FRAMES;
+static unsigned quantum_bytes  = DSMESOCK_QUANTUM_BYTES;
 
 const char* dsmesock_default_location = "/run/dsme.socket";
 
+static inline dsmesock_private_t* dsmesock_private(dsmesock_connection_t* conn)
+{
+  return (dsmesock_private_t*)conn;
+}
+
+/* Is conn an open connection of the calling thread's domain? */
+static inline bool dsmesock_valid(const dsmesock_connection_t* conn)
+{
+  return conn != 0 && ((const dsmesock_private_t*)conn)->domain == domain;
+}
+
+static inline void dsmesock_iter_init(dsmesock_iter_t* iter)
+{
+  iter->slab  = domain->slabs;
+  iter->index = 0;
+}
+
+/* Returns the next open connection of the domain, or NULL when done */
+static dsmesock_private_t* dsmesock_iter_next(dsmesock_iter_t* iter)
+{
+  for (; iter->slab != 0; iter->slab = iter->slab->next, iter->index = 0) {
+      while (iter->index < iter->slab->used) {
+          dsmesock_private_t* priv = &iter->slab->hot[iter->index++];
+
+          if (priv->domain == domain) return priv;
+      }
+  }
+  return 0;
+}
+
+/* Takes a cleared slot from the domain, preferring released ones */
+static dsmesock_private_t* dsmesock_slot_alloc(void)
+{
+  dsmesock_slab_t*    slab = domain->slabs;
+  dsmesock_private_t* priv;
+  dsmesock_cold_t*    cold;
+  void*               hot;
+  unsigned            size;
+
+  if ((priv = domain->free_slots) != 0) {
+      domain->free_slots = priv->cold->next_free;
+  } else {
+      if (slab == 0 || slab->used == slab->size) {
+          size = slab ? slab->size * 2 : DSMESOCK_SLAB_MIN;
+          if (size > DSMESOCK_SLAB_MAX) size = DSMESOCK_SLAB_MAX;
+
+          if ((slab = calloc(1, sizeof *slab)) == 0) return 0;
+          if (posix_memalign(&hot, 64, size * sizeof *slab->hot) != 0) {
+              free(slab);
+              return 0;
+          }
+          if ((slab->cold = calloc(size, sizeof *slab->cold)) == 0) {
+              free(hot);
+              free(slab);
+              return 0;
+          }
+          slab->hot  = hot;
+          slab->size = size;
+          slab->next = domain->slabs;
+          domain->slabs = slab;
+      }
+      priv = &slab->hot[slab->used];
+      priv->cold = &slab->cold[slab->used];
+      ++slab->used;
+  }
+
+  cold = priv->cold;
+  memset(priv, 0, sizeof *priv);
+  memset(cold, 0, sizeof *cold);
+  priv->cold = cold;
+  return priv;
+}
+
+static void dsmesock_slot_free(dsmesock_private_t* priv)
+{
+  priv->domain = 0;
+  priv->cold->next_free = domain->free_slots;
+  domain->free_slots = priv;
+}
+
+static void dsmesock_release(dsmesock_private_t* priv);
+static void dsmesock_limit_copy(dsmesock_limit_t*       to,
+                                const dsmesock_limit_t* from);
+static void dsmesock_backlog_copy(dsmesock_backlog_t*       to,
+                                  const dsmesock_backlog_t* from);
+static bool dsmesock_calls_complete(dsmesock_private_t*      priv,
+                                    const dsmemsg_generic_t* msg);
+static void dsmesock_calls_expire(dsmesock_private_t* priv, bool all);
+static void dsmesock_source_rearm(dsmesock_private_t* priv);
+
+/* Update the receive buffer size estimate with a received frame */
+static inline void dsmesock_rxsize_note(dsmesock_private_t* priv,
+                                        unsigned long       size)
+{
+  dsmesock_cold_t* cold = priv->cold;
+
+  if (size < DSMESOCK_BUF_SIZE_DEFAULT) size = DSMESOCK_BUF_SIZE_DEFAULT;
+
+  if (size >= cold->rxsize) {
+      cold->rxsize = size;
+  } else {
+      cold->rxsize -= (cold->rxsize - size) >> DSMESOCK_RXSIZE_DECAY_SHIFT;
+  }
+}
+
+/* Trace a received frame; done before it is handled, so that a frame
+ * whose handler never returns is still in the flight recorder */
+static inline void dsmesock_trace_in(dsmesock_private_t*      priv,
+                                     const dsmemsg_generic_t* msg)
+{
+  DSME_PROBE(frame_received, priv->pub.fd, msg->type_, msg->line_size_,
+             priv->pub.ucred.pid);
+  dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_RX, priv->pub.fd, msg, 0);
+
+  if (DSMESOCK_CAPTURE_ACTIVE()) {
+      struct iovec iov = { (void*)msg, msg->line_size_ };
+      dsmesock_capture_frame(priv->serial, DSMESOCK_CAPTURE_RX, &iov, 1);
+  }
+}
+
+/* Count a received frame once it has been handled */
+static inline void dsmesock_count_in(dsmesock_private_t*      priv,
+                                     const dsmemsg_generic_t* msg,
+                                     int64_t                  since_ns)
+{
+  DSMESOCK_COUNT(priv, msgs_in, 1);
+  DSMESOCK_COUNT(priv, bytes_in, msg->line_size_);
+  dsmesock_rxsize_note(priv, msg->line_size_);
+
+  if (DSMEMSG_STATS_ACTIVE()) {
+      dsmemsg_stats_record(msg->type_, DSMEMSG_STATS_RX, msg->line_size_,
+                           since_ns ? dsme_monotonic_ns() - since_ns : -1);
+  }
+}
+
+/* Raise *peak to value unless it is higher already */
+static void dsmesock_stats_peak(uint64_t* peak, uint64_t value)
+{
+  uint64_t prev = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (prev < value &&
+         !__atomic_compare_exchange_n(peak, &prev, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+#define DSMESOCK_STATS_RETIRE(FIELD) \
+  __atomic_fetch_add(&retired_stats.FIELD, add->FIELD, __ATOMIC_RELAXED)
+
+/* Fold counters of a domain being left into the process totals */
+static void dsmesock_stats_retire(const dsmesock_stats_t* add)
+{
+  int i;
+
+  DSMESOCK_STATS_RETIRE(msgs_in);
+  DSMESOCK_STATS_RETIRE(bytes_in);
+  DSMESOCK_STATS_RETIRE(msgs_out);
+  DSMESOCK_STATS_RETIRE(bytes_out);
+  DSMESOCK_STATS_RETIRE(syscalls);
+  DSMESOCK_STATS_RETIRE(eagain);
+  DSMESOCK_STATS_RETIRE(short_writes);
+  DSMESOCK_STATS_RETIRE(buffer_allocs);
+  for (i = 0; i < DSMESOCK_CLOSE_REASON_COUNT; ++i) {
+      DSMESOCK_STATS_RETIRE(closes[i]);
+  }
+  dsmesock_stats_peak(&retired_stats.queue_peak_frames, add->queue_peak_frames);
+  dsmesock_stats_peak(&retired_stats.queue_peak_bytes, add->queue_peak_bytes);
+  DSMESOCK_STATS_RETIRE(throttles);
+  DSMESOCK_STATS_RETIRE(throttled_ns);
+  DSMESOCK_STATS_RETIRE(yields);
+  DSMESOCK_STATS_RETIRE(congestions);
+}
+
+static void dsmesock_stats_add(dsmesock_stats_t* sum, const dsmesock_stats_t* add)
+{
+  int i;
+
+  sum->msgs_in       += add->msgs_in;
+  sum->bytes_in      += add->bytes_in;
+  sum->msgs_out      += add->msgs_out;
+  sum->bytes_out     += add->bytes_out;
+  sum->syscalls      += add->syscalls;
+  sum->eagain        += add->eagain;
+  sum->short_writes  += add->short_writes;
+  sum->buffer_allocs += add->buffer_allocs;
+  for (i = 0; i < DSMESOCK_CLOSE_REASON_COUNT; ++i) {
+      sum->closes[i] += add->closes[i];
+  }
+  if (sum->queue_peak_frames < add->queue_peak_frames) {
+      sum->queue_peak_frames = add->queue_peak_frames;
+  }
+  if (sum->queue_peak_bytes < add->queue_peak_bytes) {
+      sum->queue_peak_bytes = add->queue_peak_bytes;
+  }
+  sum->throttles    += add->throttles;
+  sum->throttled_ns += add->throttled_ns;
+  sum->yields       += add->yields;
+  sum->congestions  += add->congestions;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Stream socket transport
+ * ------------------------------------------------------------------------- */
+
+static ssize_t dsmesock_unix_recv(void* data, int fd, void* buf, size_t size,
+                                  int* rxfd)
+{
+  union {
+    struct cmsghdr hdr;
+    char           space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec    iov = { .iov_base = buf, .iov_len = size };
+  struct msghdr   mh  = {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = &control,
+    .msg_controllen = sizeof control,
+  };
+  struct cmsghdr* cmsg;
+  ssize_t         rc;
+
+  (void)data;
+
+  /* without a control buffer, the kernel closes passed descriptors */
+  if (rxfd == 0) {
+      mh.msg_control    = 0;
+      mh.msg_controllen = 0;
+  }
+
+  rc = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+  if (rc == -1 && errno == ENOTSOCK) return read(fd, buf, size);
+
+  if (rc > 0 && mh.msg_controllen > 0) {
+      for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+          if (cmsg->cmsg_level == SOL_SOCKET &&
+              cmsg->cmsg_type  == SCM_RIGHTS &&
+              cmsg->cmsg_len   == CMSG_LEN(sizeof(int)))
+            {
+              if (*rxfd != -1) close(*rxfd);
+              memcpy(rxfd, CMSG_DATA(cmsg), sizeof(int));
+            }
+      }
+  }
+  return rc;
+}
+
+static ssize_t dsmesock_unix_send(void* data, int fd, const struct iovec* iov,
+                                  int count, int passfd)
+{
+  union {
+    struct cmsghdr hdr;
+    char           space[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr   mh  = {
+    .msg_iov        = (struct iovec*)iov,
+    .msg_iovlen     = count,
+    .msg_control    = &control,
+    .msg_controllen = sizeof control,
+  };
+  struct cmsghdr* cmsg;
+
+  (void)data;
+
+  if (passfd == -1) return writev(fd, iov, count);
+
+  memset(&control, 0, sizeof control);
+  cmsg             = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+
+  return sendmsg(fd, &mh, MSG_NOSIGNAL);
+}
+
+static int dsmesock_unix_peercred(void* data, int fd, struct ucred* cred)
+{
+  socklen_t optlen = sizeof *cred;
+
+  (void)data;
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &optlen);
+}
+
+static void dsmesock_unix_close(void* data, int fd)
+{
+  (void)data;
+
+  close(fd);
+}
+
+const dsmesock_transport_t dsmesock_unix_transport = {
+  .name     = "unix",
+  .recv     = dsmesock_unix_recv,
+  .send     = dsmesock_unix_send,
+  .peercred = dsmesock_unix_peercred,
+  .close    = dsmesock_unix_close,
+};
+
 dsmesock_connection_t* dsmesock_connect(void)
 {
   dsmesock_connection_t* ret               = 0;
@@ -88,47 +654,202 @@ dsmesock_connection_t* dsmesock_connect(void)
 
 dsmesock_connection_t* dsmesock_init(int fd)
 {
-  dsmesock_connection_t* newconn;
+  return dsmesock_init_transport(fd, &dsmesock_unix_transport, 0);
+}
+
+dsmesock_connection_t* dsmesock_init_transport(int fd,
+                                               const dsmesock_transport_t* transport,
+                                               void* data)
+{
+  dsmesock_private_t* priv;
 
   if (fd == -1) return 0;
 
   if(-1 == fcntl(fd, F_SETFL, O_NONBLOCK))  return 0;
 
-  newconn = calloc(1, sizeof *newconn);
-  if (newconn == 0) return 0;
+  if ((priv = dsmesock_slot_alloc()) == 0) return 0;
+
+  priv->pub.fd         = fd;
+  priv->pub.is_open    = 1;
+  priv->transport      = transport;
+  priv->transport_data = data;
+  priv->pub.channel = 0;
+  /* read by dsmesock_sendqueue_submit() from other threads */
+  __atomic_store_n(&priv->serial,
+                   __atomic_add_fetch(&connection_serial, 1, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  g_queue_init(&priv->cold->txqueue);
+  g_queue_init(&priv->cold->calls);
+  g_queue_init(&priv->cold->stash);
+  priv->cold->rxfd    = -1;
+  priv->cold->rxsize  = DSMESOCK_BUF_SIZE_DEFAULT;
+  dsmesock_limit_copy(&priv->cold->limit, &default_limit);
+  dsmesock_backlog_copy(&priv->cold->backlog, &default_backlog);
 
-  newconn->fd      = fd;
-  newconn->is_open = 1;
-  newconn->channel = 0;
+  /* peer pid is needed also on send paths, e.g. for tracing */
+  if (transport->peercred(data, fd, &priv->pub.ucred) == -1) {
+      priv->pub.ucred.pid = 0;
+      priv->pub.ucred.uid = -1;
+      priv->pub.ucred.gid = -1;
+  }
 
-  connections = g_slist_prepend(connections, newconn);
+  priv->domain = domain;
 
-  return newconn;
+  return &priv->pub;
 }
 
 
-void* dsmesock_receive(dsmesock_connection_t* conn)
+/* Move unconsumed read-ahead data to the start of the receive buffer */
+static void dsmesock_compact(dsmesock_private_t* priv)
+{
+  dsmesock_connection_t* conn = &priv->pub;
+
+  if (priv->rxhead > 0) {
+      conn->bufused -= priv->rxhead;
+      memmove(conn->buf, conn->buf + priv->rxhead, conn->bufused);
+      priv->rxhead = 0;
+  }
+}
+
+/* Locate complete frame at the head of the receive buffer
+ *
+ * Returns the size of the frame, or 0 if more data is needed. Sets
+ * *oos if the buffered header can not belong to a valid frame. The
+ * frame need not be aligned; see dsmesock_frame().
+ */
+static unsigned long dsmesock_peek(const dsmesock_private_t* priv, int* oos)
+{
+  const dsmesock_connection_t* conn  = &priv->pub;
+  unsigned long                avail = conn->bufused - priv->rxhead;
+  dsmemsg_generic_t            header;
+
+  if (conn->buf == 0 || avail < sizeof header) return 0;
+
+  memcpy(&header, conn->buf + priv->rxhead, sizeof header);
+  if (header.line_size_ < sizeof header ||
+      header.line_size_ > DSMESOCK_BUF_SIZE_MAX ||
+      header.size_ < sizeof header ||
+      header.size_ > header.line_size_)
+  {
+      if (oos) *oos = 1;
+      return 0;
+  }
+
+  return (avail < header.line_size_) ? 0 : header.line_size_;
+}
+
+/* Frame of given size at the head of the receive buffer, suitably
+ * aligned for message structures
+ *
+ * Frames follow each other without padding, so one that does not
+ * start at an aligned offset is copied aside first. Returns NULL if
+ * memory runs out.
+ */
+static const dsmemsg_generic_t* dsmesock_frame(dsmesock_private_t* priv,
+                                               unsigned long       size)
+{
+  dsmesock_cold_t* cold = priv->cold;
+  unsigned char*   head = priv->pub.buf + priv->rxhead;
+  unsigned char*   newbuf;
+
+  if (((uintptr_t)head & (DSMESOCK_FRAME_ALIGN - 1)) == 0) {
+      return (const dsmemsg_generic_t*)head;
+  }
+
+  if (cold->scratch_size < size) {
+      if ((newbuf = realloc(cold->scratch, size)) == 0) return 0;
+      cold->scratch      = newbuf;
+      cold->scratch_size = size;
+  }
+  memcpy(cold->scratch, head, size);
+  return (const dsmemsg_generic_t*)cold->scratch;
+}
+
+/* Read from the transport, picking up a descriptor passed by the peer */
+static ssize_t dsmesock_read(dsmesock_private_t* priv, void* buf, size_t size)
+{
+  int     rxfd = -1;
+  ssize_t rc;
+
+  DSMESOCK_COUNT(priv, syscalls, 1);
+  rc = priv->transport->recv(priv->transport_data, priv->pub.fd, buf, size,
+                             priv->cold->fd_passing ? &rxfd : 0);
+  if (rxfd != -1) {
+      if (priv->cold->rxfd != -1) close(priv->cold->rxfd);
+      priv->cold->rxfd = rxfd;
+  }
+  return rc;
+}
+
+/* Mark connection closed and release receive side resources */
+static void dsmesock_shutdown(dsmesock_private_t* priv, unsigned reason)
+{
+  dsmesock_connection_t* conn = &priv->pub;
+
+  const dsmemsg_generic_t* head = 0;
+  dsmemsg_generic_t        header;
+
+  if (reason < DSMESOCK_CLOSE_REASON_COUNT) {
+      DSMESOCK_COUNT(priv, closes[reason], 1);
+  }
+
+  if (conn->buf != 0 && conn->bufused - priv->rxhead >= sizeof header) {
+      memcpy(&header, conn->buf + priv->rxhead, sizeof header);
+      head = &header;
+  }
+  dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_CLOSE, conn->fd, head, reason);
+
+  if (reason == TSMSG_CLOSE_REASON_OOS) {
+      DSME_PROBE(oos_close, conn->fd, head ? head->type_ : 0,
+                 head ? head->line_size_ : 0, conn->ucred.pid);
+  }
+
+  conn->is_open = 0;
+  free(conn->buf);
+  conn->buf     = 0;
+  conn->bufsize = 0;
+  conn->bufused = 0;
+  priv->rxhead  = 0;
+  free(priv->cold->scratch);
+  priv->cold->scratch      = 0;
+  priv->cold->scratch_size = 0;
+  priv->transport->close(priv->transport_data, conn->fd);
+  conn->fd      = -1;
+}
+
+/* Receive one frame, optionally preferring frames set aside earlier */
+static void* dsmesock_receive_frame(dsmesock_connection_t* conn,
+                                    bool                   use_stash)
 {
-#define DSMESOCK_BUF_SIZE_DEFAULT  1024
-#define DSMESOCK_BUF_SIZE_MAX     65536
-  socklen_t          optlen;
   ssize_t            ret = 1;
   int                read_size;
   DSM_MSGTYPE_CLOSE* ret_close;
   unsigned           close_reason;
   void*              result;
-  GSList*            node;
+  bool                     valid;
+  dsmesock_private_t*      priv;
+  unsigned long            buffered;
+  int                      oos = 0;
 
   /* Is this connection valid? */
-  node = g_slist_find(connections, conn);
-  if (node == 0 || conn->is_open == 0) {
+  valid = dsmesock_valid(conn);
+  if (valid && use_stash &&
+      (result = g_queue_pop_head(&dsmesock_private(conn)->cold->stash)) != 0)
+  {
+      return result;
+  }
+  if (!valid || conn->is_open == 0) {
       close_reason = TSMSG_CLOSE_REASON_ERR;
+      if (valid && dsmesock_private(conn)->evicted) {
+          close_reason = TSMSG_CLOSE_REASON_SLOW;
+      }
       goto return_close_reason;
   }
+  priv = dsmesock_private(conn);
 
-  optlen = sizeof(conn->ucred);
-  if(getsockopt(conn->fd, SOL_SOCKET, SO_PEERCRED,
-                &conn->ucred, &optlen) == -1)
+  DSMESOCK_COUNT(priv, syscalls, 1);
+  if (priv->transport->peercred(priv->transport_data, conn->fd,
+                                &conn->ucred) == -1)
   {
       /* that fails, fill some bogus values */
       conn->ucred.pid = 0;
@@ -136,22 +857,45 @@ void* dsmesock_receive(dsmesock_connection_t* conn)
       conn->ucred.gid = -1;
   }
 
+  /* Hand out frames that an attached source has already read ahead */
+  dsmesock_compact(priv);
+  if ((buffered = dsmesock_peek(priv, &oos)) != 0 &&
+      buffered < conn->bufused)
+  {
+      result = malloc(buffered);
+      if (result == 0) return 0; /* Try again later */
+      memcpy(result, conn->buf, buffered);
+      dsmesock_trace_in(priv, result);
+      dsmesock_count_in(priv, result, 0);
+      priv->rxhead = buffered;
+      dsmesock_compact(priv);
+      return result;
+  }
+  if (oos) {
+      close_reason = TSMSG_CLOSE_REASON_OOS;
+      goto discard_and_return_close_reason;
+  }
+
   /* Allocate buffer if necessary */
   if (conn->bufsize == 0 || conn->buf == 0) {
-      /* Begin with 1k buffer (more than enough for most purposes) */
-      conn->buf = malloc(DSMESOCK_BUF_SIZE_DEFAULT);
+      /* Begin with the size recent frames have needed, so that peers
+       * sending large frames do not cause a resize each time */
+      conn->buf = malloc(priv->cold->rxsize);
       if (conn->buf == 0) return 0;
+      DSMESOCK_COUNT(priv, buffer_allocs, 1);
       conn->bufused = 0;
-      conn->bufsize = DSMESOCK_BUF_SIZE_DEFAULT;
+      conn->bufsize = priv->cold->rxsize;
   }
 
   /* read message header */
   while (conn->bufused < sizeof(dsmemsg_generic_t)) {
       read_size = sizeof(dsmemsg_generic_t) - conn->bufused;
 
-      if ((ret = read(conn->fd, conn->buf+conn->bufused, read_size)) <= 0) {
+      if ((ret = dsmesock_read(priv, conn->buf+conn->bufused, read_size)) <=
+          0)
+        {
           break;
-      }
+        }
 
       conn->bufused += ret;
   }
@@ -166,13 +910,14 @@ void* dsmesock_receive(dsmesock_connection_t* conn)
               if (newbuf == 0) return 0; /* Try again later */
               conn->buf     = newbuf;
               conn->bufsize = msg_line_size;
+              DSMESOCK_COUNT(priv, buffer_allocs, 1);
           }
 
           while (conn->bufused < msg_line_size) {
               read_size = msg_line_size - conn->bufused;
 
-              if ((ret = read(conn->fd, conn->buf+conn->bufused, read_size)) <=
-                  0)
+              if ((ret = dsmesock_read(priv, conn->buf+conn->bufused,
+                                       read_size)) <= 0)
                 {
                   break;
                 }
@@ -189,22 +934,34 @@ void* dsmesock_receive(dsmesock_connection_t* conn)
       goto discard_and_return_close_reason;
   } else if (ret < 0) {
       /* TODO: IS IT OK TO LEAVE RETRY TO THE CALLER? */
-      if (errno == EWOULDBLOCK) return 0; /* Ok, no data available */
+      if (errno == EWOULDBLOCK) {
+          DSMESOCK_COUNT(priv, eagain, 1);
+          return 0; /* Ok, no data available */
+      }
       if (errno == EINTR) return 0;       /* Got signal. retry (later) */
 
       /* Error encountered. Free up resources and report close. */
       close_reason = TSMSG_CLOSE_REASON_ERR;
       goto discard_and_return_close_reason;
   } else if (conn->bufused < sizeof(dsmemsg_generic_t) ||
+             ((dsmemsg_generic_t*)conn->buf)->line_size_ <
+             sizeof(dsmemsg_generic_t) ||
              ((dsmemsg_generic_t*)conn->buf)->line_size_ >
-             DSMESOCK_BUF_SIZE_MAX)
+             DSMESOCK_BUF_SIZE_MAX ||
+             ((dsmemsg_generic_t*)conn->buf)->size_ <
+             sizeof(dsmemsg_generic_t) ||
+             ((dsmemsg_generic_t*)conn->buf)->size_ >
+             ((dsmemsg_generic_t*)conn->buf)->line_size_)
     {
-      /* too short or long message; assume out-of-sync situation */
+      /* too short or long message, or body that does not fit in it;
+       * assume out-of-sync situation */
       close_reason = TSMSG_CLOSE_REASON_OOS;
       goto discard_and_return_close_reason;
     }
 
   /* success; detach the buffer from connection context and return it */
+  dsmesock_trace_in(priv, (dsmemsg_generic_t*)conn->buf);
+  dsmesock_count_in(priv, (dsmemsg_generic_t*)conn->buf, 0);
   result        = conn->buf;
   conn->buf     = 0;
   conn->bufsize = 0;
@@ -213,55 +970,429 @@ void* dsmesock_receive(dsmesock_connection_t* conn)
 
   /* error cases */
 discard_and_return_close_reason:
-  conn->is_open = 0;
-  free(conn->buf);
-  conn->buf     = 0;
-  close(conn->fd);
-  conn->fd      = -1;
+  dsmesock_shutdown(priv, close_reason);
 return_close_reason:
   ret_close = DSME_MSG_NEW(DSM_MSGTYPE_CLOSE);
   ret_close->reason = close_reason;
   return ret_close;
 }
 
+void* dsmesock_receive(dsmesock_connection_t* conn)
+{
+  return dsmesock_receive_frame(conn, true);
+}
 
-void dsmesock_close(dsmesock_connection_t* conn)
+/* Wait for input until deadline
+ *
+ * Returns 1 if there is input, 0 on timeout, -1 on error.
+ */
+static int dsmesock_wait_input(int fd, int64_t deadline_ns)
 {
-  GSList* node;
+  struct pollfd   pfd = { .fd = fd, .events = POLLIN };
+  struct timespec ts;
+  int64_t         left;
+  int             rc;
 
-  node = g_slist_find(connections, conn);
-  if (node != 0) {
-      if (conn->buf != 0) free(conn->buf);
-      if (conn->fd != -1) close(conn->fd);
-      free(conn);
-      connections = g_slist_delete_link(connections, node);
-      return;
+  for (;;) {
+      if (deadline_ns >= 0) {
+          if ((left = deadline_ns - dsme_monotonic_ns()) <= 0) return 0;
+          ts.tv_sec  = left / 1000000000;
+          ts.tv_nsec = left % 1000000000;
+      }
+      rc = ppoll(&pfd, 1, deadline_ns >= 0 ? &ts : 0, 0);
+      if (rc == -1 && errno == EINTR) continue;
+      return rc;
   }
 }
 
-
-int dsmesock_send(dsmesock_connection_t* conn, const void* msg)
+void* dsmesock_receive_timeout(dsmesock_connection_t* conn,
+                               int64_t                deadline_ns)
 {
-  return dsmesock_send_with_extra(conn, msg, 0, 0);
+  void* msg;
+
+  while ((msg = dsmesock_receive_frame(conn, true)) == 0) {
+      int rc = dsmesock_wait_input(conn->fd, deadline_ns);
+      if (rc == 0) errno = ETIMEDOUT;
+      if (rc <= 0) break;
+  }
+  return msg;
 }
 
-int dsmesock_send_with_extra(dsmesock_connection_t* conn,
-                             const void*            msg,
-                             size_t                 extra_size,
-                             const void*            extra)
+void* dsmesock_receive_id(dsmesock_connection_t* conn,
+                          uint32_t               id,
+                          int64_t                deadline_ns)
 {
-  GSList*                  node;
-  const dsmemsg_generic_t* m = (dsmemsg_generic_t*)msg;
-  dsmemsg_generic_t        header;
-  struct iovec             buffers[3];
-  int                      count = 0;
+  dsmesock_private_t* priv;
+  GList*              item;
+  void*               msg;
 
-  /* Is this connection valid? */
-  node = g_slist_find(connections, conn);
-  if (node == 0 || conn->is_open == 0) {
-    errno = ENOTCONN;
-    return -1;
+  if (!dsmesock_valid(conn)) {
+      return dsmesock_receive_frame(conn, false);
   }
+  priv = dsmesock_private(conn);
+
+  /* the frame might have been set aside already */
+  for (item = priv->cold->stash.head; item != 0; item = g_list_next(item)) {
+      msg = item->data;
+      if (((dsmemsg_generic_t*)msg)->type_ == id) {
+          g_queue_delete_link(&priv->cold->stash, item);
+          return msg;
+      }
+  }
+
+  for (;;) {
+      if ((msg = dsmesock_receive_frame(conn, false)) == 0) {
+          int rc = dsmesock_wait_input(conn->fd, deadline_ns);
+          if (rc == 0) errno = ETIMEDOUT;
+          if (rc <= 0) break;
+          continue;
+      }
+      if (((dsmemsg_generic_t*)msg)->type_ == id ||
+          DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg))
+        {
+          break;
+        }
+      /* keep unrelated frames for later receive calls */
+      g_queue_push_tail(&priv->cold->stash, msg);
+  }
+  return msg;
+}
+
+
+void dsmesock_close(dsmesock_connection_t* conn)
+{
+  if (dsmesock_valid(conn)) {
+      dsmesock_private_t* priv = dsmesock_private(conn);
+
+      dsmesock_detach(conn);
+      priv->domain = 0;
+
+      if (priv->dispatching) {
+          /* Called from attached handler; finish after dispatch */
+          priv->close_pending = 1;
+          return;
+      }
+      dsmesock_release(priv);
+      return;
+  }
+}
+
+static void dsmesock_release(dsmesock_private_t* priv)
+{
+  dsmesock_connection_t* conn = &priv->pub;
+  dsmesock_txframe_t*    frame;
+  dsmesock_call_t*       call;
+  void*                  stashed;
+
+  while ((frame = g_queue_pop_head(&priv->cold->txqueue)) != 0) {
+      free(frame);
+  }
+  while ((call = g_queue_pop_head(&priv->cold->calls)) != 0) {
+      free(call);
+  }
+  while ((stashed = g_queue_pop_head(&priv->cold->stash)) != 0) {
+      free(stashed);
+  }
+  if (conn->buf != 0) free(conn->buf);
+  free(priv->cold->scratch);
+  if (conn->fd != -1) priv->transport->close(priv->transport_data, conn->fd);
+  if (priv->cold->rxfd != -1) close(priv->cold->rxfd);
+  dsmesock_slot_free(priv);
+}
+
+
+/* Write out queued frames, as many as the socket accepts
+ *
+ * Returns 0 on success (including would-block), -1 on error.
+ */
+static int dsmesock_flush_queue(dsmesock_private_t* priv)
+{
+  while (!g_queue_is_empty(&priv->cold->txqueue)) {
+      struct iovec buffers[DSMESOCK_TX_IOV_MAX];
+      int          count = 0;
+      GList*       item;
+      ssize_t      rc;
+
+      for (item = priv->cold->txqueue.head;
+           item != 0 && count < DSMESOCK_TX_IOV_MAX;
+           item = g_list_next(item))
+        {
+          dsmesock_txframe_t* frame = item->data;
+          buffers[count].iov_base = frame->data + frame->done;
+          buffers[count].iov_len  = frame->size - frame->done;
+          ++count;
+        }
+
+      DSMESOCK_COUNT(priv, syscalls, 1);
+      rc = priv->transport->send(priv->transport_data, priv->pub.fd,
+                                 buffers, count, -1);
+      if (rc == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+              DSMESOCK_COUNT(priv, eagain, 1);
+              return 0;
+          }
+          if (errno == EINTR) return 0;
+          return -1;
+      }
+
+      priv->txbytes         -= rc;
+      DSMESOCK_COUNT(priv, bytes_out, rc);
+      while (rc > 0) {
+          dsmesock_txframe_t* frame = g_queue_peek_head(&priv->cold->txqueue);
+          size_t              left  = frame->size - frame->done;
+
+          if ((size_t)rc < left) {
+              frame->done += rc;
+              DSMESOCK_COUNT(priv, short_writes, 1);
+              DSME_PROBE(short_write, priv->pub.fd, frame->id,
+                         frame->line_size, priv->pub.ucred.pid, rc);
+              return 0; /* short write; socket buffer is full */
+          }
+          rc -= left;
+          DSME_PROBE(frame_sent, priv->pub.fd, frame->id, frame->line_size,
+                     priv->pub.ucred.pid);
+          if (DSMEMSG_STATS_ACTIVE()) {
+              dsmemsg_stats_record(frame->id, DSMEMSG_STATS_TX,
+                                   frame->line_size,
+                                   frame->queued_ns ?
+                                   dsme_monotonic_ns() - frame->queued_ns : -1);
+          }
+          free(g_queue_pop_head(&priv->cold->txqueue));
+      }
+  }
+
+  return 0;
+}
+
+/* Append the part of a frame that was not written yet to the output queue */
+static int dsmesock_queue(dsmesock_private_t* priv,
+                          const struct iovec* buffers,
+                          int                 count,
+                          size_t              skip)
+{
+  const dsmemsg_generic_t* header = buffers[0].iov_base;
+  dsmesock_txframe_t*      frame;
+  size_t                   size = 0;
+  int                      i;
+
+  for (i = 0; i < count; ++i) {
+      size += buffers[i].iov_len;
+  }
+  size -= skip;
+
+  if ((frame = malloc(sizeof *frame + size)) == 0) return -1;
+  frame->size      = size;
+  frame->done      = 0;
+  frame->id        = header->type_;
+  frame->line_size = header->line_size_;
+  frame->queued_ns = (DSMEMSG_STATS_ACTIVE() ||
+                      priv->cold->backlog.limits.high_age_ms) ?
+                     dsme_monotonic_ns() : 0;
+
+  size = 0;
+  for (i = 0; i < count; ++i) {
+      const unsigned char* base = buffers[i].iov_base;
+      size_t               len  = buffers[i].iov_len;
+
+      if (skip >= len) {
+          skip -= len;
+          continue;
+      }
+      memcpy(frame->data + size, base + skip, len - skip);
+      size += len - skip;
+      skip  = 0;
+  }
+
+  g_queue_push_tail(&priv->cold->txqueue, frame);
+  priv->txbytes += frame->size;
+
+  if (priv->cold->stats.queue_peak_frames < priv->cold->txqueue.length) {
+      priv->cold->stats.queue_peak_frames = priv->cold->txqueue.length;
+      dsmesock_stats_peak(&domain->totals.queue_peak_frames,
+                          priv->cold->txqueue.length);
+  }
+  if (priv->cold->stats.queue_peak_bytes < priv->txbytes) {
+      priv->cold->stats.queue_peak_bytes = priv->txbytes;
+      dsmesock_stats_peak(&domain->totals.queue_peak_bytes, priv->txbytes);
+  }
+  return 0;
+}
+
+/* Age of the oldest queued frame, or 0 if not known */
+static int64_t dsmesock_backlog_age(dsmesock_private_t* priv, int64_t now)
+{
+  const dsmesock_txframe_t* frame = g_queue_peek_head(&priv->cold->txqueue);
+
+  return (frame && frame->queued_ns) ? now - frame->queued_ns : 0;
+}
+
+/* Disconnect a peer that does not keep up with its output
+ *
+ * Queued output is dropped right away. The connection is closed like
+ * on read errors: immediately if not attached, otherwise from the
+ * next dispatch, so that the handler gets a CLOSE message.
+ */
+static void dsmesock_evict(dsmesock_private_t* priv)
+{
+  dsmesock_txframe_t* frame;
+
+  priv->evicted = 1;
+  while ((frame = g_queue_pop_head(&priv->cold->txqueue)) != 0) {
+      free(frame);
+  }
+  priv->txbytes = 0;
+
+  if (priv->source) {
+      g_source_set_ready_time(&priv->source->base, 0);
+  } else {
+      dsmesock_shutdown(priv, TSMSG_CLOSE_REASON_SLOW);
+  }
+}
+
+/* Track crossings of the output backlog watermarks */
+static void dsmesock_backlog_check(dsmesock_private_t* priv)
+{
+  const dsmesock_backlog_limits_t* limits = &priv->cold->backlog.limits;
+  int64_t                          age    = 0;
+
+  if (limits->high_bytes == 0 && limits->high_age_ms == 0) return;
+  if (priv->evicted) return;
+
+  if (limits->high_age_ms && !g_queue_is_empty(&priv->cold->txqueue)) {
+      age = dsmesock_backlog_age(priv, dsme_monotonic_ns());
+  }
+
+  if (!priv->congested) {
+      if ((limits->high_bytes && priv->txbytes >= limits->high_bytes) ||
+          (limits->high_age_ms &&
+           age >= limits->high_age_ms * INT64_C(1000000)))
+        {
+          priv->congested = 1;
+          DSMESOCK_COUNT(priv, congestions, 1);
+          DSME_PROBE(backlog_high, priv->pub.fd, 0, priv->txbytes,
+                     priv->pub.ucred.pid, priv->cold->txqueue.length);
+          if (priv->cold->backlog.callback) {
+              priv->cold->backlog.callback(&priv->pub, true,
+                                     priv->cold->backlog.user_data);
+          }
+          if (limits->disconnect) dsmesock_evict(priv);
+        }
+  } else if (priv->txbytes <= limits->low_bytes &&
+             age <= limits->low_age_ms * INT64_C(1000000))
+    {
+      priv->congested = 0;
+      if (priv->cold->backlog.callback) {
+          priv->cold->backlog.callback(&priv->pub, false,
+                                 priv->cold->backlog.user_data);
+      }
+    }
+}
+
+static void dsmesock_backlog_init(dsmesock_backlog_t*              backlog,
+                                  const dsmesock_backlog_limits_t* limits,
+                                  dsmesock_backlog_cb_t            callback,
+                                  void*                            user_data)
+{
+  memset(backlog, 0, sizeof *backlog);
+  if (limits == 0 || (limits->high_bytes == 0 && limits->high_age_ms == 0)) {
+      return;
+  }
+
+  backlog->limits    = *limits;
+  backlog->callback  = callback;
+  backlog->user_data = user_data;
+  if (backlog->limits.low_bytes > backlog->limits.high_bytes) {
+      backlog->limits.low_bytes = backlog->limits.high_bytes;
+  }
+  if (backlog->limits.low_age_ms > backlog->limits.high_age_ms) {
+      backlog->limits.low_age_ms = backlog->limits.high_age_ms;
+  }
+}
+
+/* Copy backlog settings, field by field with atomics, so that defaults
+ * can be changed from any thread. A connection created meanwhile may
+ * get a mix of old and new settings, but no torn values. */
+static void dsmesock_backlog_copy(dsmesock_backlog_t*       to,
+                                  const dsmesock_backlog_t* from)
+{
+  __atomic_store_n(&to->limits.high_bytes,
+                   __atomic_load_n(&from->limits.high_bytes, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->limits.low_bytes,
+                   __atomic_load_n(&from->limits.low_bytes, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->limits.high_age_ms,
+                   __atomic_load_n(&from->limits.high_age_ms, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->limits.low_age_ms,
+                   __atomic_load_n(&from->limits.low_age_ms, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->limits.disconnect,
+                   __atomic_load_n(&from->limits.disconnect, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->callback,
+                   __atomic_load_n(&from->callback, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->user_data,
+                   __atomic_load_n(&from->user_data, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+}
+
+bool dsmesock_set_backlog_limits(dsmesock_connection_t*           conn,
+                                 const dsmesock_backlog_limits_t* limits,
+                                 dsmesock_backlog_cb_t            callback,
+                                 void*                            user_data)
+{
+  dsmesock_private_t* priv;
+
+  if (!dsmesock_valid(conn)) {
+      errno = EINVAL;
+      return false;
+  }
+  priv = dsmesock_private(conn);
+
+  dsmesock_backlog_init(&priv->cold->backlog, limits, callback, user_data);
+  priv->congested = 0;
+  dsmesock_backlog_check(priv);
+  dsmesock_source_rearm(priv);
+  return true;
+}
+
+void dsmesock_set_default_backlog_limits(const dsmesock_backlog_limits_t* limits,
+                                         dsmesock_backlog_cb_t callback,
+                                         void*                 user_data)
+{
+  dsmesock_backlog_t backlog;
+
+  dsmesock_backlog_init(&backlog, limits, callback, user_data);
+  dsmesock_backlog_copy(&default_backlog, &backlog);
+}
+
+int dsmesock_send(dsmesock_connection_t* conn, const void* msg)
+{
+  return dsmesock_send_with_extra(conn, msg, 0, 0);
+}
+
+int dsmesock_send_with_extra(dsmesock_connection_t* conn,
+                             const void*            msg,
+                             size_t                 extra_size,
+                             const void*            extra)
+{
+  const dsmemsg_generic_t* m = (dsmemsg_generic_t*)msg;
+  dsmemsg_generic_t        header;
+  struct iovec             buffers[3];
+  int                      count = 0;
+  dsmesock_private_t*      priv;
+  ssize_t                  sent  = 0;
+  int64_t                  tx_ns = 0;
+
+  /* Is this connection valid? */
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      dsmesock_private(conn)->evicted) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  priv = dsmesock_private(conn);
 
   /* set up message header for sending */
   memcpy(&header, msg, sizeof header);
@@ -284,10 +1415,292 @@ int dsmesock_send_with_extra(dsmesock_connection_t* conn,
     ++count;
   }
 
+  /* previously queued output must go out first */
+  if (!g_queue_is_empty(&priv->cold->txqueue)) {
+    if (dsmesock_flush_queue(priv) == -1) return -1;
+    dsmesock_backlog_check(priv);
+  }
+
   /* send the message */
-  return writev(conn->fd, buffers, count);
+  if (g_queue_is_empty(&priv->cold->txqueue)) {
+    if (DSMEMSG_STATS_ACTIVE()) tx_ns = dsme_monotonic_ns();
+    DSMESOCK_COUNT(priv, syscalls, 1);
+    sent = priv->transport->send(priv->transport_data, conn->fd,
+                                 buffers, count, -1);
+    if (sent == header.line_size_) {
+      DSMESOCK_COUNT(priv, msgs_out, 1);
+      DSMESOCK_COUNT(priv, bytes_out, sent);
+      DSME_PROBE(frame_sent, conn->fd, header.type_, header.line_size_,
+                 conn->ucred.pid);
+      if (DSMEMSG_STATS_ACTIVE()) {
+        dsmemsg_stats_record(header.type_, DSMEMSG_STATS_TX, sent,
+                             tx_ns ? dsme_monotonic_ns() - tx_ns : -1);
+      }
+      dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_TX, conn->fd, &header, 0);
+      if (DSMESOCK_CAPTURE_ACTIVE()) {
+        dsmesock_capture_frame(priv->serial, DSMESOCK_CAPTURE_TX,
+                               buffers, count);
+      }
+      return sent;
+    }
+    if (sent == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+      }
+      if (errno != EINTR) DSMESOCK_COUNT(priv, eagain, 1);
+      sent = 0;
+    } else {
+      DSMESOCK_COUNT(priv, short_writes, 1);
+      DSMESOCK_COUNT(priv, bytes_out, sent);
+    }
+    DSME_PROBE(short_write, conn->fd, header.type_, header.line_size_,
+               conn->ucred.pid, sent);
+  }
+
+  /* queue the rest instead of leaving the stream out of sync */
+  if (dsmesock_queue(priv, buffers, count, sent) == -1) {
+    errno = ENOMEM;
+    return -1;
+  }
+  DSMESOCK_COUNT(priv, msgs_out, 1);
+  dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_TX, conn->fd, &header, 0);
+  if (DSMESOCK_CAPTURE_ACTIVE()) {
+    dsmesock_capture_frame(priv->serial, DSMESOCK_CAPTURE_TX, buffers, count);
+  }
+
+  dsmesock_backlog_check(priv);
+  if (priv->evicted) {
+    errno = EPIPE;
+    return -1;
+  }
+  return header.line_size_;
+}
+
+int dsmesock_send_arena(dsmesock_connection_t*        conn,
+                        const struct dsmemsg_arena_t* arena)
+{
+  const dsmemsg_generic_t* m;
+  dsmesock_private_t*      priv;
+  struct iovec             buffers[DSMESOCK_TX_IOV_MAX];
+  int                      count;
+  int                      i;
+  ssize_t                  sent;
+  size_t                   batch;
+  size_t                   offs;
+  size_t                   end   = 0;
+  size_t                   total = 0;
+  int64_t                  tx_ns;
+
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      dsmesock_private(conn)->evicted) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  priv = dsmesock_private(conn);
+
+  /* the frames must cover what was reserved, or the peer would get
+   * a stream it cannot parse */
+  for (m = 0; (m = dsmemsg_arena_next(arena, m)) != 0; ) {
+    end    = (const unsigned char*)m - arena->buf + m->line_size_;
+    total += m->line_size_;
+  }
+  if (end != arena->used || total > G_MAXINT) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (total == 0) return 0;
+
+  /* previously queued output must go out first */
+  if (!g_queue_is_empty(&priv->cold->txqueue)) {
+    if (dsmesock_flush_queue(priv) == -1) return -1;
+    dsmesock_backlog_check(priv);
+  }
+
+  /* one buffer per frame leaves out the padding between them */
+  for (m = dsmemsg_arena_next(arena, 0); m != 0; ) {
+    for (count = 0, batch = 0; m != 0 && count < DSMESOCK_TX_IOV_MAX;
+         m = dsmemsg_arena_next(arena, m), ++count)
+      {
+        buffers[count].iov_base = (void*)m;
+        buffers[count].iov_len  = m->line_size_;
+        batch += m->line_size_;
+      }
+
+    sent  = 0;
+    tx_ns = 0;
+    if (g_queue_is_empty(&priv->cold->txqueue)) {
+      if (DSMEMSG_STATS_ACTIVE()) tx_ns = dsme_monotonic_ns();
+      DSMESOCK_COUNT(priv, syscalls, 1);
+      sent = priv->transport->send(priv->transport_data, conn->fd,
+                                   buffers, count, -1);
+      if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          return -1;
+        }
+        if (errno != EINTR) DSMESOCK_COUNT(priv, eagain, 1);
+        sent = 0;
+      } else if ((size_t)sent < batch) {
+        DSMESOCK_COUNT(priv, short_writes, 1);
+      }
+      DSMESOCK_COUNT(priv, bytes_out, sent);
+      if (tx_ns) tx_ns = dsme_monotonic_ns() - tx_ns;
+    }
+
+    /* account for the frames written, queue the rest */
+    for (i = 0, offs = 0; i < count; offs += buffers[i].iov_len, ++i) {
+      const dsmemsg_generic_t* f    = buffers[i].iov_base;
+      size_t                   skip = (size_t)sent > offs ?
+                                      (size_t)sent - offs : 0;
+
+      if (skip >= f->line_size_) {
+        DSME_PROBE(frame_sent, conn->fd, f->type_, f->line_size_,
+                   conn->ucred.pid);
+        if (DSMEMSG_STATS_ACTIVE()) {
+          dsmemsg_stats_record(f->type_, DSMEMSG_STATS_TX, f->line_size_,
+                               tx_ns ? tx_ns : -1);
+        }
+      } else {
+        if (skip > 0) {
+          DSME_PROBE(short_write, conn->fd, f->type_, f->line_size_,
+                     conn->ucred.pid, skip);
+        }
+        if (dsmesock_queue(priv, &buffers[i], 1, skip) == -1) {
+          errno = ENOMEM;
+          return -1;
+        }
+      }
+      DSMESOCK_COUNT(priv, msgs_out, 1);
+      dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_TX, conn->fd, f, 0);
+      if (DSMESOCK_CAPTURE_ACTIVE()) {
+        dsmesock_capture_frame(priv->serial, DSMESOCK_CAPTURE_TX,
+                               &buffers[i], 1);
+      }
+    }
+  }
+
+  if (!g_queue_is_empty(&priv->cold->txqueue)) {
+    dsmesock_backlog_check(priv);
+    if (priv->evicted) {
+      errno = EPIPE;
+      return -1;
+    }
+  }
+  return total;
+}
+
+int dsmesock_send_with_fd(dsmesock_connection_t* conn,
+                          const void*            msg,
+                          int                    fd)
+{
+  const dsmemsg_generic_t* m = msg;
+  struct iovec             iov = {
+    .iov_base = (void*)msg,
+    .iov_len  = m->line_size_,
+  };
+  dsmesock_private_t*      priv;
+  ssize_t                  sent;
+
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      dsmesock_private(conn)->evicted)
+  {
+    errno = ENOTCONN;
+    return -1;
+  }
+  priv = dsmesock_private(conn);
+
+  /* the descriptor must travel with the first byte of the frame */
+  if (!g_queue_is_empty(&priv->cold->txqueue) &&
+      (dsmesock_flush_queue(priv) == -1 || !g_queue_is_empty(&priv->cold->txqueue)))
+  {
+    if (!g_queue_is_empty(&priv->cold->txqueue)) errno = EAGAIN;
+    return -1;
+  }
+
+  DSMESOCK_COUNT(priv, syscalls, 1);
+  sent = priv->transport->send(priv->transport_data, conn->fd, &iov, 1, fd);
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) DSMESOCK_COUNT(priv, eagain, 1);
+    return -1;
+  }
+
+  DSMESOCK_COUNT(priv, msgs_out, 1);
+  DSMESOCK_COUNT(priv, bytes_out, sent);
+  if ((size_t)sent < iov.iov_len) {
+    /* the descriptor went with the part that was written */
+    DSMESOCK_COUNT(priv, short_writes, 1);
+    if (dsmesock_queue(priv, &iov, 1, sent) == -1) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  dsmesock_flightrec_record(DSMESOCK_FLIGHTREC_TX, conn->fd, m, 0);
+  if (DSMESOCK_CAPTURE_ACTIVE()) {
+    dsmesock_capture_frame(priv->serial, DSMESOCK_CAPTURE_TX, &iov, 1);
+  }
+  DSME_PROBE(frame_sent, conn->fd, m->type_, m->line_size_, conn->ucred.pid);
+  return m->line_size_;
+}
+
+int dsmesock_flush(dsmesock_connection_t* conn)
+{
+  dsmesock_private_t* priv;
+
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      dsmesock_private(conn)->evicted) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  priv = dsmesock_private(conn);
+
+  if (g_queue_is_empty(&priv->cold->txqueue)) return 0;
+  if (dsmesock_flush_queue(priv) == -1) return -1;
+
+  dsmesock_backlog_check(priv);
+  if (priv->evicted) {
+    errno = EPIPE;
+    return -1;
+  }
+  return 0;
+}
+
+bool dsmesock_has_pending_output(dsmesock_connection_t* conn)
+{
+  return dsmesock_valid(conn) &&
+         !g_queue_is_empty(&dsmesock_private(conn)->cold->txqueue);
+}
+
+int dsmesock_set_fd_passing(dsmesock_connection_t* conn, bool enable)
+{
+  dsmesock_private_t* priv;
+  bool                prev;
+
+  if (!dsmesock_valid(conn)) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  priv = dsmesock_private(conn);
+
+  prev                   = priv->cold->fd_passing;
+  priv->cold->fd_passing = enable;
+  if (!enable && priv->cold->rxfd != -1) {
+    close(priv->cold->rxfd);
+    priv->cold->rxfd = -1;
+  }
+  return prev;
 }
 
+int dsmesock_take_fd(dsmesock_connection_t* conn)
+{
+  dsmesock_private_t* priv;
+  int                 fd;
+
+  if (!dsmesock_valid(conn)) return -1;
+  priv = dsmesock_private(conn);
+
+  fd         = priv->cold->rxfd;
+  priv->cold->rxfd = -1;
+  return fd;
+}
 
 void dsmesock_broadcast(const void* msg)
 {
@@ -298,24 +1711,1158 @@ void dsmesock_broadcast_with_extra(const void* msg,
                                    size_t      extra_size,
                                    const void* extra)
 {
-  GSList* node;
+  dsmesock_iter_t     iter;
+  dsmesock_private_t* priv;
+  unsigned            fanout = 0;
 
-  for (node = connections; node != 0; node = g_slist_next(node)) {
-      dsmesock_send_with_extra((dsmesock_connection_t *)(node->data),
+  dsmesock_iter_init(&iter);
+  while ((priv = dsmesock_iter_next(&iter)) != 0) {
+      dsmesock_send_with_extra(&priv->pub,
                                msg,
                                extra_size,
                                extra);
+      ++fanout;
   }
+
+  DSME_PROBE(broadcast_fanout, -1, ((const dsmemsg_generic_t*)msg)->type_,
+             ((const dsmemsg_generic_t*)msg)->line_size_ + extra_size, 0,
+             fanout);
 }
 
 const struct ucred* dsmesock_getucred(dsmesock_connection_t* conn)
 {
-    GSList* node;
-
-    node = g_slist_find(connections, conn);
-    if (node != 0) {
+    if (dsmesock_valid(conn)) {
         return &conn->ucred;
     }
 
     return 0;
 }
+
+
+/* ------------------------------------------------------------------------- *
+ * Receive rate limiting
+ * ------------------------------------------------------------------------- */
+
+static void dsmesock_limit_init(dsmesock_limit_t* limit,
+                                unsigned          msgs,
+                                unsigned          bytes,
+                                unsigned          interval_ms)
+{
+  memset(limit, 0, sizeof *limit);
+  if (interval_ms == 0 || (msgs == 0 && bytes == 0)) return;
+
+  limit->msgs        = msgs;
+  limit->bytes       = bytes;
+  limit->interval_ns = interval_ms * INT64_C(1000000);
+}
+
+/* Copy rate limit settings, field by field with atomics, so that
+ * defaults can be changed from any thread; the interval state is
+ * left cleared */
+static void dsmesock_limit_copy(dsmesock_limit_t*       to,
+                                const dsmesock_limit_t* from)
+{
+  __atomic_store_n(&to->msgs,
+                   __atomic_load_n(&from->msgs, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->bytes,
+                   __atomic_load_n(&from->bytes, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&to->interval_ns,
+                   __atomic_load_n(&from->interval_ns, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+}
+
+/* Start a new interval with full budget, if the current one is over */
+static void dsmesock_limit_refill(dsmesock_private_t* priv, int64_t now)
+{
+  dsmesock_limit_t* limit = &priv->cold->limit;
+
+  if (now - limit->window_ns < limit->interval_ns) return;
+
+  limit->window_ns  = now;
+  limit->msgs_left  = limit->msgs;
+  limit->bytes_left = limit->bytes;
+
+  if (limit->throttled_ns) {
+      DSMESOCK_COUNT(priv, throttled_ns, now - limit->throttled_ns);
+      limit->throttled_ns = 0;
+  }
+}
+
+/* Check whether the budget allows passing one more frame on
+ *
+ * A frame is let through as long as some budget is left, so that
+ * frames larger than the byte budget do not stall the connection.
+ */
+static bool dsmesock_limit_exceeded(dsmesock_private_t* priv, int64_t now)
+{
+  dsmesock_limit_t* limit = &priv->cold->limit;
+
+  if (limit->interval_ns == 0) return false;
+
+  dsmesock_limit_refill(priv, now);
+  if ((limit->msgs  == 0 || limit->msgs_left  > 0) &&
+      (limit->bytes == 0 || limit->bytes_left > 0))
+  {
+      return false;
+  }
+
+  if (limit->throttled_ns == 0) {
+      limit->throttled_ns = now;
+      DSMESOCK_COUNT(priv, throttles, 1);
+  }
+  return true;
+}
+
+static inline void dsmesock_limit_charge(dsmesock_private_t* priv,
+                                         unsigned long       size)
+{
+  priv->cold->limit.msgs_left  -= 1;
+  priv->cold->limit.bytes_left -= size;
+}
+
+/* Wake up the attached source when the earliest call times out,
+ * or when a throttled connection gets new budget */
+static void dsmesock_source_rearm(dsmesock_private_t* priv)
+{
+  int64_t earliest = 0;
+  GList*  item;
+
+  if (priv->source == 0) return;
+
+  for (item = priv->cold->calls.head; item != 0; item = g_list_next(item)) {
+      const dsmesock_call_t* call = item->data;
+
+      if (call->deadline_ns &&
+          (earliest == 0 || earliest > call->deadline_ns))
+        {
+          earliest = call->deadline_ns;
+        }
+  }
+
+  if (priv->cold->limit.throttled_ns) {
+      int64_t resume = priv->cold->limit.window_ns + priv->cold->limit.interval_ns;
+      if (earliest == 0 || earliest > resume) earliest = resume;
+  }
+
+  /* the oldest queued frame reaching the high age mark */
+  if (priv->cold->backlog.limits.high_age_ms && !priv->congested) {
+      const dsmesock_txframe_t* frame = g_queue_peek_head(&priv->cold->txqueue);
+
+      if (frame && frame->queued_ns) {
+          int64_t due = frame->queued_ns +
+                        priv->cold->backlog.limits.high_age_ms * INT64_C(1000000);
+          if (earliest == 0 || earliest > due) earliest = due;
+      }
+  }
+
+  if (priv->evicted) {
+      g_source_set_ready_time(&priv->source->base, 0);
+      return;
+  }
+
+  /* glib monotonic time is CLOCK_MONOTONIC in microseconds */
+  g_source_set_ready_time(&priv->source->base,
+                          earliest ? (earliest + 999) / 1000 : -1);
+}
+
+void dsmesock_set_rate_limit(dsmesock_connection_t* conn,
+                             unsigned               msgs,
+                             unsigned               bytes,
+                             unsigned               interval_ms)
+{
+  dsmesock_private_t* priv;
+
+  if (!dsmesock_valid(conn)) return;
+  priv = dsmesock_private(conn);
+
+  if (priv->cold->limit.throttled_ns) {
+      DSMESOCK_COUNT(priv, throttled_ns, dsme_monotonic_ns() -
+                     priv->cold->limit.throttled_ns);
+  }
+  dsmesock_limit_init(&priv->cold->limit, msgs, bytes, interval_ms);
+  dsmesock_source_rearm(priv);
+}
+
+void dsmesock_set_default_rate_limit(unsigned msgs,
+                                     unsigned bytes,
+                                     unsigned interval_ms)
+{
+  dsmesock_limit_t limit;
+
+  dsmesock_limit_init(&limit, msgs, bytes, interval_ms);
+  dsmesock_limit_copy(&default_limit, &limit);
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Dispatch scheduling
+ *
+ * Every attached connection with input is dispatched once per main
+ * loop iteration. Capping the work done per dispatch makes the
+ * iterations deficit round robin rounds: a connection gets a byte
+ * quantum of credit per round, frames are delivered while the credit
+ * covers them, and unused credit carries over to the next round as
+ * long as the connection has input left.
+ * ------------------------------------------------------------------------- */
+
+/* Check whether this round allows delivering a frame, and charge it */
+static bool dsmesock_quantum_take(dsmesock_private_t* priv,
+                                  unsigned long       size,
+                                  unsigned*           frames)
+{
+  unsigned max_frames = __atomic_load_n(&quantum_frames, __ATOMIC_RELAXED);
+
+  if (max_frames && *frames >= max_frames) return false;
+  if (__atomic_load_n(&quantum_bytes, __ATOMIC_RELAXED)) {
+      if (priv->deficit < (int64_t)size) return false;
+      priv->deficit -= size;
+  }
+  ++*frames;
+  return true;
+}
+
+void dsmesock_set_dispatch_quantum(unsigned frames, unsigned bytes)
+{
+  dsmesock_iter_t     iter;
+  dsmesock_private_t* priv;
+
+  __atomic_store_n(&quantum_frames, frames, __ATOMIC_RELAXED);
+  __atomic_store_n(&quantum_bytes, bytes, __ATOMIC_RELAXED);
+
+  /* only connections of the calling thread can be touched here */
+  dsmesock_iter_init(&iter);
+  while ((priv = dsmesock_iter_next(&iter)) != 0) {
+      priv->deficit = 0;
+  }
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Main loop integration
+ * ------------------------------------------------------------------------- */
+
+/* Read as much as fits in the receive buffer
+ *
+ * Returns number of bytes read, 0 on EOF, or -1 on error.
+ * Sets *drained when the socket is known to have no more data.
+ */
+static ssize_t dsmesock_read_ahead(dsmesock_private_t* priv, int* drained)
+{
+  dsmesock_connection_t*   conn = &priv->pub;
+  const dsmemsg_generic_t* msg;
+  unsigned long            want;
+  ssize_t                  rc;
+
+  dsmesock_compact(priv);
+
+  /* make room for at least the frame at the head of the buffer */
+  want = priv->cold->rxsize;
+  if (conn->bufused >= sizeof *msg) {
+      msg = (const dsmemsg_generic_t*)conn->buf;
+      if (want < msg->line_size_) want = msg->line_size_;
+  }
+  if (conn->bufsize < want || conn->bufsize - conn->bufused == 0) {
+      unsigned long  size   = conn->bufsize ? conn->bufsize : want;
+      unsigned char* newbuf;
+
+      while (size < want || size - conn->bufused == 0) size *= 2;
+      if ((newbuf = realloc(conn->buf, size)) == 0) {
+          errno = ENOMEM;
+          return -1;
+      }
+      conn->buf     = newbuf;
+      conn->bufsize = size;
+      DSMESOCK_COUNT(priv, buffer_allocs, 1);
+  }
+
+  want = conn->bufsize - conn->bufused;
+  if ((rc = dsmesock_read(priv, conn->buf + conn->bufused, want)) > 0) {
+      conn->bufused += rc;
+      if ((unsigned long)rc < want) *drained = 1;
+  } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      DSMESOCK_COUNT(priv, eagain, 1);
+  }
+  return rc;
+}
+
+/* Shrink the receive buffer of an attached connection once recent
+ * frames no longer need all of it */
+static void dsmesock_rxbuf_trim(dsmesock_private_t* priv)
+{
+  dsmesock_connection_t* conn = &priv->pub;
+  unsigned long          size = priv->cold->rxsize;
+  unsigned char*         newbuf;
+
+  if (conn->bufsize <= 2 * size || conn->bufused > size) return;
+
+  if ((newbuf = realloc(conn->buf, size)) == 0) return;
+  conn->buf     = newbuf;
+  conn->bufsize = size;
+  DSMESOCK_COUNT(priv, buffer_allocs, 1);
+}
+
+static gboolean dsmesock_source_prepare(GSource* base, gint* timeout)
+{
+  dsmesock_source_t*  src  = (dsmesock_source_t*)base;
+  dsmesock_private_t* priv = src->priv;
+  GIOCondition        events;
+
+  *timeout = -1;
+
+  if (priv == 0 || src->tag == 0) return FALSE;
+
+  /* poll for writability only while there is something to write,
+   * and for input only while not throttled */
+  events = priv->cold->limit.throttled_ns ? 0 : G_IO_IN;
+  if (!g_queue_is_empty(&priv->cold->txqueue) && !priv->transport->wakes_writer) {
+      events |= G_IO_OUT;
+  }
+  if (src->events != events) {
+      g_source_modify_unix_fd(base, src->tag, events);
+      src->events = events;
+  }
+
+  if (!g_queue_is_empty(&priv->cold->stash)) return TRUE;
+  return !priv->cold->limit.throttled_ns && dsmesock_peek(priv, 0) != 0;
+}
+
+static gboolean dsmesock_source_check(GSource* base)
+{
+  dsmesock_source_t* src = (dsmesock_source_t*)base;
+
+  if (src->priv == 0) return FALSE;
+  if (src->tag && g_source_query_unix_fd(base, src->tag)) return TRUE;
+  if (!g_queue_is_empty(&src->priv->cold->stash)) return TRUE;
+  return !src->priv->cold->limit.throttled_ns && dsmesock_peek(src->priv, 0) != 0;
+}
+
+static gboolean dsmesock_source_dispatch(GSource*    base,
+                                         GSourceFunc callback,
+                                         gpointer    user_data)
+{
+  dsmesock_source_t*       src      = (dsmesock_source_t*)base;
+  dsmesock_private_t*      priv     = src->priv;
+  dsmesock_connection_t*   conn;
+  GIOCondition             revents  = 0;
+  const dsmemsg_generic_t* msg;
+  unsigned long            size;
+  int                      oos      = 0;
+  int                      drained  = 0;
+  bool                     keep     = true;
+  int64_t                  rx_ns    = 0;
+  int64_t                  now      = 0;
+  unsigned                 frames   = 0;
+  unsigned                 quantum;
+  bool                     yielded  = false;
+  bool                     hangup;
+  unsigned                 close_reason;
+  DSM_MSGTYPE_CLOSE        close_msg;
+  dsmemsg_generic_t*       stashed;
+
+  (void)callback;
+  (void)user_data;
+
+  if (priv == 0) return G_SOURCE_REMOVE;
+  conn = &priv->pub;
+
+  if (src->tag) revents = g_source_query_unix_fd(base, src->tag);
+  if (!(revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) drained = 1;
+
+  /* a peer that has gone away is not throttled any more */
+  hangup = (revents & (G_IO_HUP | G_IO_ERR)) != 0;
+  if (priv->cold->limit.interval_ns) {
+      now = dsme_monotonic_ns();
+      dsmesock_limit_refill(priv, now);
+  }
+
+  priv->dispatching = 1;
+  quantum = __atomic_load_n(&quantum_bytes, __ATOMIC_RELAXED);
+  if (quantum) priv->deficit += quantum;
+
+  if (priv->transport->wakes_writer && (revents & G_IO_IN)) {
+      revents |= G_IO_OUT;
+  }
+  if ((revents & G_IO_OUT) && dsmesock_flush_queue(priv) == -1) {
+      close_reason = TSMSG_CLOSE_REASON_ERR;
+      goto closed;
+  }
+  dsmesock_backlog_check(priv);
+  if (priv->evicted) {
+      close_reason = TSMSG_CLOSE_REASON_SLOW;
+      goto closed;
+  }
+
+  dsmesock_calls_expire(priv, false);
+
+  /* frames set aside by dsmesock_receive_id() precede buffered ones */
+  while (keep && !priv->close_pending && priv->source == src &&
+         (stashed = g_queue_pop_head(&priv->cold->stash)) != 0)
+    {
+      if (!dsmesock_calls_complete(priv, stashed)) {
+          keep = src->handler(conn, stashed, src->user_data);
+      }
+      free(stashed);
+    }
+
+  for (;;) {
+      ssize_t rc;
+
+      /* hand every complete frame to the handler without copying */
+      while (keep && !priv->close_pending && priv->source == src &&
+             (size = dsmesock_peek(priv, &oos)) != 0 &&
+             (hangup || !dsmesock_limit_exceeded(priv, now)))
+        {
+          if ((msg = dsmesock_frame(priv, size)) == 0) {
+              /* out of memory; try again on a later round */
+              yielded = true;
+              break;
+          }
+          if (!hangup && !dsmesock_quantum_take(priv, size, &frames)) {
+              /* let other connections have their turn */
+              yielded = true;
+              break;
+          }
+          dsmesock_limit_charge(priv, size);
+          dsmesock_trace_in(priv, msg);
+          /* latency is the time the handler takes */
+          rx_ns = DSMEMSG_STATS_ACTIVE() ? dsme_monotonic_ns() : 0;
+          if (!dsmesock_calls_complete(priv, msg)) {
+              keep = src->handler(conn, msg, src->user_data);
+          }
+          dsmesock_count_in(priv, msg, rx_ns);
+          if (priv->close_pending) break;
+          priv->rxhead += size;
+        }
+
+      if (priv->source != src) goto done;
+      if (oos) {
+          close_reason = TSMSG_CLOSE_REASON_OOS;
+          goto closed;
+      }
+      if (!keep || priv->close_pending || drained || yielded) break;
+      if (priv->cold->limit.throttled_ns && !hangup) break;
+
+      rc = dsmesock_read_ahead(priv, &drained);
+      if (rc == 0) {
+          close_reason = TSMSG_CLOSE_REASON_EOF;
+          goto closed;
+      }
+      if (rc < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+          close_reason = TSMSG_CLOSE_REASON_ERR;
+          goto closed;
+      }
+  }
+
+  if (priv->evicted) {
+      /* the handler sent more than the peer could take */
+      close_reason = TSMSG_CLOSE_REASON_SLOW;
+      goto closed;
+  }
+
+  if (yielded) {
+      DSMESOCK_COUNT(priv, yields, 1);
+      /* unused credit is carried over only for frames larger than
+       * the quantum, not when the frame limit ended the round */
+      if (frames && priv->deficit > (int64_t)quantum) {
+          priv->deficit = quantum;
+      }
+  } else {
+      priv->deficit = 0;
+  }
+  dsmesock_compact(priv);
+  if (drained) dsmesock_rxbuf_trim(priv);
+  dsmesock_source_rearm(priv);
+  goto done;
+
+closed:
+  /* report close like dsmesock_receive() does, then stop polling */
+  g_source_remove_unix_fd(base, src->tag);
+  src->tag = 0;
+  dsmesock_shutdown(priv, close_reason);
+  dsmesock_calls_expire(priv, true);
+  close_msg = DSME_MSG_INIT(DSM_MSGTYPE_CLOSE);
+  close_msg.reason = close_reason;
+  src->handler(conn, (dsmemsg_generic_t*)&close_msg, src->user_data);
+  keep = false;
+
+done:
+  priv->dispatching = 0;
+  if (priv->close_pending) {
+      dsmesock_release(priv);
+      return G_SOURCE_REMOVE;
+  }
+  if (priv->source != src) {
+      /* detached or attached anew by the handler; frames left over
+       * are for dsmesock_receive() or the new source */
+      return G_SOURCE_REMOVE;
+  }
+  if (!keep) {
+      dsmesock_detach(conn);
+      return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs dsmesock_source_funcs = {
+  .prepare  = dsmesock_source_prepare,
+  .check    = dsmesock_source_check,
+  .dispatch = dsmesock_source_dispatch,
+};
+
+bool dsmesock_attach(dsmesock_connection_t* conn,
+                     struct _GMainContext*  context,
+                     dsmesock_handler_t     handler,
+                     void*                  user_data)
+{
+  dsmesock_private_t* priv;
+  dsmesock_source_t*  src;
+
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      handler == 0)
+  {
+      errno = EINVAL;
+      return false;
+  }
+  priv = dsmesock_private(conn);
+
+  dsmesock_detach(conn);
+
+  src = (dsmesock_source_t*)g_source_new(&dsmesock_source_funcs, sizeof *src);
+  src->priv      = priv;
+  src->events    = G_IO_IN;
+  src->tag       = g_source_add_unix_fd(&src->base, conn->fd, src->events);
+  src->handler   = handler;
+  src->user_data = user_data;
+  g_source_set_name(&src->base, "dsmesock");
+  g_source_attach(&src->base, context);
+
+  priv->source  = src;
+  conn->channel = g_io_channel_unix_new(conn->fd);
+
+  return true;
+}
+
+void dsmesock_detach(dsmesock_connection_t* conn)
+{
+  dsmesock_private_t* priv;
+
+  if (!dsmesock_valid(conn)) return;
+  priv = dsmesock_private(conn);
+
+  if (priv->source) {
+      priv->source->priv = 0;
+      g_source_destroy(&priv->source->base);
+      g_source_unref(&priv->source->base);
+      priv->source = 0;
+  }
+
+  /* replies can not be received any more */
+  dsmesock_calls_expire(priv, true);
+  if (conn->channel) {
+      g_io_channel_unref(conn->channel);
+      conn->channel = 0;
+  }
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Asynchronous calls
+ * ------------------------------------------------------------------------- */
+
+/* Pass reply to the oldest call waiting for it
+ *
+ * Returns true if the message was consumed by a call.
+ */
+static bool dsmesock_calls_complete(dsmesock_private_t*      priv,
+                                    const dsmemsg_generic_t* msg)
+{
+  GList* item;
+
+  for (item = priv->cold->calls.head; item != 0; item = g_list_next(item)) {
+      dsmesock_call_t* call = item->data;
+
+      if (call->reply_id != msg->type_) continue;
+
+      if (call->token) {
+          if (msg->size_ > msg->line_size_ ||
+              msg->line_size_ - msg->size_ < sizeof call->token ||
+              memcmp((const char*)msg + msg->size_, &call->token,
+                     sizeof call->token) != 0)
+            {
+              continue;
+            }
+      }
+
+      g_queue_delete_link(&priv->cold->calls, item);
+      call->callback(&priv->pub, msg, call->user_data);
+      free(call);
+      dsmesock_source_rearm(priv);
+      return true;
+  }
+
+  return false;
+}
+
+/* Fail calls that have timed out, or all calls */
+static void dsmesock_calls_expire(dsmesock_private_t* priv, bool all)
+{
+  int64_t now = all ? 0 : dsme_monotonic_ns();
+  GList*  item;
+  GList*  next;
+
+  if (g_queue_is_empty(&priv->cold->calls)) return;
+
+  for (item = priv->cold->calls.head; item != 0; item = next) {
+      dsmesock_call_t* call = item->data;
+
+      next = g_list_next(item);
+      if (!all && (call->deadline_ns == 0 || call->deadline_ns > now)) {
+          continue;
+      }
+
+      g_queue_delete_link(&priv->cold->calls, item);
+      call->callback(&priv->pub, 0, call->user_data);
+      free(call);
+
+      /* the callback may have issued new calls; start over */
+      next = priv->cold->calls.head;
+  }
+
+  dsmesock_source_rearm(priv);
+}
+
+unsigned dsmesock_call_async(dsmesock_connection_t* conn,
+                             const void*            msg,
+                             size_t                 extra_size,
+                             const void*            extra,
+                             uint32_t               reply_id,
+                             uint64_t               token,
+                             int                    timeout_ms,
+                             dsmesock_reply_cb_t    callback,
+                             void*                  user_data)
+{
+  dsmesock_private_t* priv;
+  dsmesock_call_t*    call;
+  unsigned char*      payload = 0;
+  int                 rc;
+
+  if (!dsmesock_valid(conn) || conn->is_open == 0 ||
+      callback == 0)
+  {
+      errno = EINVAL;
+      return 0;
+  }
+  priv = dsmesock_private(conn);
+
+  /* replies are picked up by the attached source */
+  if (priv->source == 0) {
+      errno = EINVAL;
+      return 0;
+  }
+
+  if ((call = calloc(1, sizeof *call)) == 0) return 0;
+
+  /* the token goes in front of any other extra data */
+  if (token) {
+      if ((payload = malloc(sizeof token + extra_size)) == 0) {
+          free(call);
+          return 0;
+      }
+      memcpy(payload, &token, sizeof token);
+      if (extra_size > 0) memcpy(payload + sizeof token, extra, extra_size);
+      extra       = payload;
+      extra_size += sizeof token;
+  }
+
+  rc = dsmesock_send_with_extra(conn, msg, extra_size, extra);
+  free(payload);
+  if (rc == -1) {
+      free(call);
+      return 0;
+  }
+
+  do {
+      call->id = __atomic_add_fetch(&call_id, 1, __ATOMIC_RELAXED);
+  } while (call->id == 0);
+  call->reply_id    = reply_id;
+  call->token       = token;
+  call->deadline_ns = timeout_ms < 0 ? 0 :
+                      dsme_monotonic_ns() + timeout_ms * INT64_C(1000000);
+  call->callback    = callback;
+  call->user_data   = user_data;
+
+  g_queue_push_tail(&priv->cold->calls, call);
+  if (call->deadline_ns) dsmesock_source_rearm(priv);
+
+  return call->id;
+}
+
+bool dsmesock_call_cancel(dsmesock_connection_t* conn, unsigned id)
+{
+  dsmesock_private_t* priv;
+  GList*              item;
+
+  if (!dsmesock_valid(conn)) return false;
+  priv = dsmesock_private(conn);
+
+  for (item = priv->cold->calls.head; item != 0; item = g_list_next(item)) {
+      dsmesock_call_t* call = item->data;
+
+      if (call->id == id) {
+          g_queue_delete_link(&priv->cold->calls, item);
+          free(call);
+          dsmesock_source_rearm(priv);
+          return true;
+      }
+  }
+
+  return false;
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Acknowledged broadcasts
+ *
+ * Built on asynchronous calls: every participating connection gets a
+ * call that completes on acknowledgement, timeout or close, and the
+ * broadcast completes when the last of its calls does.
+ * ------------------------------------------------------------------------- */
+
+typedef struct dsmesock_acked_t {
+  size_t                 count;
+  size_t                 pending;
+  int64_t                started_ns;
+  dsmesock_acked_cb_t    callback;
+  void*                  user_data;
+  dsmesock_ack_result_t* results;
+} dsmesock_acked_t;
+
+static void dsmesock_acked_finish(dsmesock_acked_t* acked)
+{
+  acked->callback(acked->results, acked->count, acked->user_data);
+  free(acked->results);
+  free(acked);
+}
+
+static void dsmesock_acked_reply_cb(dsmesock_connection_t*   conn,
+                                    const dsmemsg_generic_t* reply,
+                                    void*                    user_data)
+{
+  dsmesock_acked_t* acked = user_data;
+  size_t            i;
+
+  for (i = 0; i < acked->count; ++i) {
+      dsmesock_ack_result_t* result = &acked->results[i];
+
+      if (result->conn != conn || result->latency_ns >= 0) continue;
+
+      result->acked      = reply != 0;
+      result->latency_ns = dsme_monotonic_ns() - acked->started_ns;
+      break;
+  }
+
+  if (--acked->pending == 0) dsmesock_acked_finish(acked);
+}
+
+size_t dsmesock_broadcast_acked(const void*           msg,
+                                size_t                extra_size,
+                                const void*           extra,
+                                uint32_t              ack_id,
+                                int                   timeout_ms,
+                                dsmesock_ack_filter_t filter,
+                                dsmesock_acked_cb_t   callback,
+                                void*                 user_data)
+{
+  dsmesock_acked_t*   acked;
+  dsmesock_iter_t     iter;
+  dsmesock_private_t* priv;
+  size_t              count = 0;
+  size_t              i;
+
+  if (callback == 0) {
+      errno = EINVAL;
+      return 0;
+  }
+  if ((acked = calloc(1, sizeof *acked)) == 0) return 0;
+
+  /* pick participants before sending, so that callbacks can not
+   * change the set of connections under us */
+  dsmesock_iter_init(&iter);
+  while ((priv = dsmesock_iter_next(&iter)) != 0) {
+      dsmesock_connection_t* conn = &priv->pub;
+
+      if (!conn->is_open || priv->source == 0) continue;
+      if (filter && !filter(conn, user_data)) continue;
+      ++count;
+  }
+
+  acked->results = calloc(count ? count : 1, sizeof *acked->results);
+  if (acked->results == 0) {
+      free(acked);
+      return 0;
+  }
+  dsmesock_iter_init(&iter);
+  while (acked->count < count && (priv = dsmesock_iter_next(&iter)) != 0) {
+      dsmesock_connection_t* conn   = &priv->pub;
+      dsmesock_ack_result_t* result;
+
+      if (!conn->is_open || priv->source == 0) continue;
+      if (filter && !filter(conn, user_data)) continue;
+
+      result             = &acked->results[acked->count++];
+      result->conn       = conn;
+      result->pid        = conn->ucred.pid;
+      result->acked      = false;
+      result->latency_ns = -1;
+  }
+
+  acked->started_ns = dsme_monotonic_ns();
+  acked->callback   = callback;
+  acked->user_data  = user_data;
+
+  /* hold a reference of our own while sending */
+  acked->pending = acked->count + 1;
+  for (i = 0; i < acked->count; ++i) {
+      dsmesock_ack_result_t* result = &acked->results[i];
+
+      if (dsmesock_call_async(result->conn, msg, extra_size, extra, ack_id,
+                              0, timeout_ms, dsmesock_acked_reply_cb,
+                              acked) == 0)
+        {
+          result->latency_ns = 0;
+          --acked->pending;
+        }
+  }
+
+  DSME_PROBE(broadcast_fanout, -1, ((const dsmemsg_generic_t*)msg)->type_,
+             ((const dsmemsg_generic_t*)msg)->line_size_ + extra_size, 0,
+             count);
+
+  if (--acked->pending == 0) dsmesock_acked_finish(acked);
+  return count;
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Connection domains
+ * ------------------------------------------------------------------------- */
+
+bool dsmesock_domain_enter(void)
+{
+  dsmesock_domain_t* own;
+
+  if (domain != &shared_domain) return true;
+
+  if ((own = calloc(1, sizeof *own)) == 0) return false;
+
+  G_LOCK(dsmesock_domains);
+  own->next   = own_domains;
+  own_domains = own;
+  G_UNLOCK(dsmesock_domains);
+
+  domain = own;
+  return true;
+}
+
+bool dsmesock_domain_leave(void)
+{
+  dsmesock_domain_t*  own = domain;
+  dsmesock_domain_t** link;
+  dsmesock_slab_t*    slab;
+  dsmesock_iter_t     iter;
+  dsmesock_private_t* priv;
+  unsigned            i;
+
+  if (own == &shared_domain) return true;
+
+  /* a connection being dispatched further up the stack would be
+   * freed from under its dispatch */
+  for (slab = own->slabs; slab != 0; slab = slab->next) {
+      for (i = 0; i < slab->used; ++i) {
+          if (slab->hot[i].dispatching) {
+              errno = EBUSY;
+              return false;
+          }
+      }
+  }
+
+  dsmesock_iter_init(&iter);
+  while ((priv = dsmesock_iter_next(&iter)) != 0) dsmesock_close(&priv->pub);
+
+  /* hand the counters over in one step, so that totals read meanwhile
+   * neither miss nor repeat them */
+  G_LOCK(dsmesock_domains);
+  for (link = &own_domains; *link != own; link = &(*link)->next) {
+  }
+  *link = own->next;
+  dsmesock_stats_retire(&own->totals);
+  G_UNLOCK(dsmesock_domains);
+
+  while ((slab = own->slabs) != 0) {
+      own->slabs = slab->next;
+      free(slab->hot);
+      free(slab->cold);
+      free(slab);
+  }
+  free(own);
+  domain = &shared_domain;
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Cross-thread submission
+ *
+ * Submitted frames go through an intrusive multi-producer, single
+ * consumer queue: producers swap themselves in as the head with one
+ * atomic exchange, and the owning thread pops from the tail. An
+ * eventfd wakes up the owning main context; it is written only when
+ * the queue was not already signalled.
+ * ------------------------------------------------------------------------- */
+
+/* Frames sent per main loop round */
+#define DSMESOCK_SUBMIT_BATCH 64
+
+typedef struct dsmesock_submission_t {
+  struct dsmesock_submission_t* next;
+  dsmesock_connection_t*        conn;    /* NULL = broadcast */
+  uint32_t                      serial;  /* guards against address reuse */
+  union {
+    dsmemsg_generic_t           header;
+    unsigned char               data[1];
+  } frame;
+} dsmesock_submission_t;
+
+typedef struct dsmesock_sendqueue_source_t {
+  GSource               base;
+  dsmesock_sendqueue_t* queue;
+  gpointer              tag;
+} dsmesock_sendqueue_source_t;
+
+struct dsmesock_sendqueue_t {
+  dsmesock_submission_t*       head;      /* last pushed, producers */
+  dsmesock_submission_t*       tail;      /* next to pop, owner */
+  dsmesock_submission_t        stub;
+  int                          signaled;
+  int                          eventfd;
+  dsmesock_sendqueue_source_t* source;
+};
+
+static void dsmesock_sendqueue_push(dsmesock_sendqueue_t*  queue,
+                                    dsmesock_submission_t* item)
+{
+  dsmesock_submission_t* prev;
+
+  item->next = 0;
+  prev = __atomic_exchange_n(&queue->head, item, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+/* Returns the oldest submission, or NULL if the queue is empty or a
+ * producer is half way through pushing */
+static dsmesock_submission_t* dsmesock_sendqueue_pop(dsmesock_sendqueue_t* queue)
+{
+  dsmesock_submission_t* tail = queue->tail;
+  dsmesock_submission_t* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &queue->stub) {
+      if (next == 0) return 0;
+      queue->tail = tail = next;
+      next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+      queue->tail = next;
+      return tail;
+  }
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return 0;
+
+  /* the last item can be taken once the stub is behind it */
+  dsmesock_sendqueue_push(queue, &queue->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next == 0) return 0;
+  queue->tail = next;
+  return tail;
+}
+
+static bool dsmesock_sendqueue_pending(dsmesock_sendqueue_t* queue)
+{
+  return queue->tail != &queue->stub ||
+         __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) != &queue->stub;
+}
+
+static void dsmesock_sendqueue_deliver(dsmesock_submission_t* item)
+{
+  dsmesock_connection_t* conn = item->conn;
+
+  if (conn == 0) {
+      dsmesock_broadcast(&item->frame);
+  } else if (dsmesock_valid(conn) &&
+             dsmesock_private(conn)->serial == item->serial) {
+      dsmesock_send(conn, &item->frame);
+  }
+}
+
+static gboolean dsmesock_sendqueue_check(GSource* base)
+{
+  dsmesock_sendqueue_source_t* src = (dsmesock_sendqueue_source_t*)base;
+
+  return g_source_query_unix_fd(base, src->tag) != 0;
+}
+
+static gboolean dsmesock_sendqueue_dispatch(GSource*    base,
+                                            GSourceFunc callback,
+                                            gpointer    user_data)
+{
+  dsmesock_sendqueue_source_t* src   = (dsmesock_sendqueue_source_t*)base;
+  dsmesock_sendqueue_t*        queue = src->queue;
+  dsmesock_submission_t*       item;
+  uint64_t                     count;
+  unsigned                     sent  = 0;
+
+  (void)callback;
+  (void)user_data;
+
+  /* producers signal again for frames pushed from now on */
+  if (read(queue->eventfd, &count, sizeof count) == -1) count = 0;
+  __atomic_store_n(&queue->signaled, 0, __ATOMIC_SEQ_CST);
+
+  while (sent < DSMESOCK_SUBMIT_BATCH &&
+         (item = dsmesock_sendqueue_pop(queue)) != 0)
+    {
+      dsmesock_sendqueue_deliver(item);
+      free(item);
+      ++sent;
+    }
+
+  /* leave the rest for the next round, and retry soon if a producer
+   * was caught in the middle of pushing */
+  g_source_set_ready_time(base, dsmesock_sendqueue_pending(queue) ? 0 : -1);
+  return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs dsmesock_sendqueue_funcs = {
+  .check    = dsmesock_sendqueue_check,
+  .dispatch = dsmesock_sendqueue_dispatch,
+};
+
+dsmesock_sendqueue_t* dsmesock_sendqueue_new(struct _GMainContext* context)
+{
+  dsmesock_sendqueue_t*        queue;
+  dsmesock_sendqueue_source_t* src;
+
+  if ((queue = calloc(1, sizeof *queue)) == 0) return 0;
+
+  queue->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->eventfd == -1) {
+      free(queue);
+      return 0;
+  }
+  queue->head = queue->tail = &queue->stub;
+
+  src = (dsmesock_sendqueue_source_t*)
+    g_source_new(&dsmesock_sendqueue_funcs, sizeof *src);
+  src->queue = queue;
+  src->tag   = g_source_add_unix_fd(&src->base, queue->eventfd, G_IO_IN);
+  g_source_set_name(&src->base, "dsmesock-sendqueue");
+  g_source_attach(&src->base, context);
+  queue->source = src;
+
+  return queue;
+}
+
+void dsmesock_sendqueue_free(dsmesock_sendqueue_t* queue)
+{
+  dsmesock_submission_t* item;
+
+  if (queue == 0) return;
+
+  g_source_destroy(&queue->source->base);
+  g_source_unref(&queue->source->base);
+
+  while (dsmesock_sendqueue_pending(queue)) {
+      if ((item = dsmesock_sendqueue_pop(queue)) != 0) free(item);
+  }
+  close(queue->eventfd);
+  free(queue);
+}
+
+bool dsmesock_sendqueue_submit(dsmesock_sendqueue_t*  queue,
+                               dsmesock_connection_t* conn,
+                               const void*            msg,
+                               size_t                 extra_size,
+                               const void*            extra)
+{
+  const dsmemsg_generic_t* m    = msg;
+  dsmesock_submission_t*   item;
+  uint64_t                 one  = 1;
+
+  item = malloc(offsetof(dsmesock_submission_t, frame) + m->line_size_ +
+                extra_size);
+  if (item == 0) return false;
+
+  item->conn   = conn;
+  item->serial = conn ? __atomic_load_n(&dsmesock_private(conn)->serial,
+                                        __ATOMIC_RELAXED)
+                      : 0;
+  memcpy(item->frame.data, msg, m->line_size_);
+  if (extra_size > 0) {
+      memcpy(item->frame.data + m->line_size_, extra, extra_size);
+      item->frame.header.line_size_ += extra_size;
+  }
+
+  dsmesock_sendqueue_push(queue, item);
+
+  if (!__atomic_exchange_n(&queue->signaled, 1, __ATOMIC_SEQ_CST) &&
+      write(queue->eventfd, &one, sizeof one) == -1)
+    {
+      /* can not overflow; the counter is cleared on every dispatch */
+    }
+  return true;
+}
+
+
+/* ------------------------------------------------------------------------- *
+ * Statistics
+ * ------------------------------------------------------------------------- */
+
+bool dsmesock_get_stats(dsmesock_connection_t* conn, dsmesock_stats_t* stats)
+{
+  if (!dsmesock_valid(conn)) return false;
+
+  *stats = dsmesock_private(conn)->cold->stats;
+  return true;
+}
+
+/* Read counters that other threads may be adding to */
+static void dsmesock_stats_load(dsmesock_stats_t*       stats,
+                                const dsmesock_stats_t* from)
+{
+  const uint64_t* src   = (const uint64_t*)from;
+  uint64_t*       dst   = (uint64_t*)stats;
+  size_t          words = sizeof *stats / sizeof *dst;
+  size_t          i;
+
+  /* counters are all uint64_t */
+  for (i = 0; i < words; ++i) {
+      dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+void dsmesock_get_total_stats(dsmesock_stats_t* stats)
+{
+  dsmesock_domain_t* own;
+  dsmesock_stats_t   add;
+
+  G_LOCK(dsmesock_domains);
+  dsmesock_stats_load(stats, &retired_stats);
+  dsmesock_stats_load(&add, &shared_domain.totals);
+  dsmesock_stats_add(stats, &add);
+  for (own = own_domains; own != 0; own = own->next) {
+      dsmesock_stats_load(&add, &own->totals);
+      dsmesock_stats_add(stats, &add);
+  }
+  G_UNLOCK(dsmesock_domains);
+}
@@ -0,0 +1,444 @@
+/**
+   @file server.c
+
+   Serving dsmesock clients from several worker threads.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/server.h"
+#include "dsme_internal.h"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <semaphore.h>
+
+#include <glib.h>
+
+/** Pause before retrying accept() after running out of resources */
+#define SERVER_ACCEPT_BACKOFF_MS 100
+
+/* ------------------------------------------------------------------------- *
+ * Types
+ * ------------------------------------------------------------------------- */
+
+typedef struct server_worker_t server_worker_t;
+
+/** Main loop source receiving descriptors from the acceptor */
+typedef struct
+{
+    GSource          base;
+    server_worker_t *worker;
+    gpointer         tag;
+} server_source_t;
+
+struct server_worker_t
+{
+    dsmesock_server_t    *server;
+    GThread              *thread;
+    GMainContext         *context;
+    dsmesock_sendqueue_t *queue;
+    server_source_t      *source;
+
+    /** Pipe carrying accepted descriptors from the acceptor */
+    int                   handoff[2];
+
+    /** Connections handed over and not closed yet */
+    unsigned              load;
+
+    /** Posted by the worker once it has set up its connection domain */
+    sem_t                 started;
+    bool                  started_init;
+
+    /** errno of a failed start, or 0 */
+    int                   error;
+
+    bool                  stopping;
+};
+
+struct dsmesock_server_t
+{
+    dsmesock_server_config_t config;
+    int                      listen_fd;
+
+    /** Readable once the acceptor should exit */
+    int                      stop_fd;
+    GThread                 *acceptor;
+
+    unsigned                 count;
+    server_worker_t         *workers;
+};
+
+/* ------------------------------------------------------------------------- *
+ * Worker threads
+ * ------------------------------------------------------------------------- */
+
+static bool
+server_handler(dsmesock_connection_t *conn, const dsmemsg_generic_t *msg,
+               void *user_data)
+{
+    server_worker_t         *worker = user_data;
+    const dsmesock_server_t *server = worker->server;
+    bool                     keep;
+
+    keep = server->config.handler(conn, msg, server->config.user_data);
+
+    if( !keep || DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+        dsmesock_close(conn);
+        __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/** Take over connections passed by the acceptor */
+static void
+server_adopt(server_worker_t *worker)
+{
+    dsmesock_connection_t *conn;
+    int                    fd;
+
+    while( read(worker->handoff[0], &fd, sizeof fd) == sizeof fd ) {
+        /* Created in this thread, so it belongs to this worker */
+        if( !(conn = dsmesock_init(fd)) ) {
+            close(fd);
+            __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if( !dsmesock_attach(conn, worker->context, server_handler, worker) ) {
+            dsmesock_close(conn);
+            __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static gboolean
+server_source_check(GSource *base)
+{
+    server_source_t *src = (server_source_t *)base;
+
+    return g_source_query_unix_fd(base, src->tag) != 0;
+}
+
+static gboolean
+server_source_dispatch(GSource *base, GSourceFunc callback, gpointer data)
+{
+    server_source_t *src = (server_source_t *)base;
+
+    (void)callback;
+    (void)data;
+
+    server_adopt(src->worker);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs server_source_funcs = {
+    .check    = server_source_check,
+    .dispatch = server_source_dispatch,
+};
+
+static gpointer
+server_worker_main(gpointer data)
+{
+    server_worker_t *worker = data;
+
+    /* Own connection set; otherwise threads would share one list */
+    if( !dsmesock_domain_enter() ) {
+        __atomic_store_n(&worker->error, errno ? errno : ENOMEM,
+                         __ATOMIC_RELAXED);
+        sem_post(&worker->started);
+        return 0;
+    }
+    sem_post(&worker->started);
+
+    g_main_context_push_thread_default(worker->context);
+    while( !__atomic_load_n(&worker->stopping, __ATOMIC_ACQUIRE) )
+        g_main_context_iteration(worker->context, TRUE);
+    g_main_context_pop_thread_default(worker->context);
+
+    /* Outside the main loop nothing is being dispatched, so this
+     * does not fail */
+    dsmesock_domain_leave();
+    return 0;
+}
+
+static bool
+server_worker_init(dsmesock_server_t *server, server_worker_t *worker)
+{
+    server_source_t *src;
+
+    worker->server     = server;
+    worker->handoff[0] = worker->handoff[1] = -1;
+    worker->context    = g_main_context_new();
+
+    if( pipe2(worker->handoff, O_NONBLOCK | O_CLOEXEC) == -1 )
+        return false;
+
+    if( !(worker->queue = dsmesock_sendqueue_new(worker->context)) )
+        return false;
+
+    if( sem_init(&worker->started, 0, 0) == -1 )
+        return false;
+    worker->started_init = true;
+
+    src = (server_source_t *)g_source_new(&server_source_funcs, sizeof *src);
+    src->worker = worker;
+    src->tag    = g_source_add_unix_fd(&src->base, worker->handoff[0],
+                                       G_IO_IN);
+    g_source_set_name(&src->base, "dsmesock-server");
+    g_source_attach(&src->base, worker->context);
+    worker->source = src;
+
+    worker->thread = g_thread_new("dsmesock-worker", server_worker_main,
+                                  worker);
+    if( !worker->thread )
+        return false;
+
+    /* A worker without its own domain would share connections with
+     * the calling thread, so wait for it to get that far */
+    while( sem_wait(&worker->started) == -1 && errno == EINTR )
+        ;
+    if( (errno = __atomic_load_n(&worker->error, __ATOMIC_RELAXED)) )
+        return false;
+    return true;
+}
+
+static void
+server_worker_quit(server_worker_t *worker)
+{
+    int fd;
+
+    if( worker->thread ) {
+        __atomic_store_n(&worker->stopping, true, __ATOMIC_RELEASE);
+        g_main_context_wakeup(worker->context);
+        g_thread_join(worker->thread);
+    }
+
+    dsmesock_sendqueue_free(worker->queue);
+    if( worker->source ) {
+        g_source_destroy(&worker->source->base);
+        g_source_unref(&worker->source->base);
+    }
+
+    /* Clients that were never taken over */
+    if( worker->handoff[0] != -1 ) {
+        while( read(worker->handoff[0], &fd, sizeof fd) == sizeof fd )
+            close(fd);
+        close(worker->handoff[0]);
+        close(worker->handoff[1]);
+    }
+
+    if( worker->started_init )
+        sem_destroy(&worker->started);
+
+    if( worker->context )
+        g_main_context_unref(worker->context);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Acceptor thread
+ * ------------------------------------------------------------------------- */
+
+static server_worker_t *
+server_pick_worker(dsmesock_server_t *server, int fd)
+{
+    server_worker_t *best = &server->workers[0];
+    struct ucred     cred;
+    socklen_t        len  = sizeof cred;
+
+    if( server->config.balance == DSMESOCK_SERVER_PEER_PID &&
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 )
+        return &server->workers[(unsigned)cred.pid % server->count];
+
+    for( unsigned i = 1; i < server->count; ++i ) {
+        server_worker_t *worker = &server->workers[i];
+
+        if( __atomic_load_n(&worker->load, __ATOMIC_RELAXED) <
+            __atomic_load_n(&best->load, __ATOMIC_RELAXED) )
+            best = worker;
+    }
+    return best;
+}
+
+static gpointer
+server_acceptor_main(gpointer data)
+{
+    dsmesock_server_t *server = data;
+    struct pollfd      pfd[2] = {
+        { .fd = server->listen_fd, .events = POLLIN },
+        { .fd = server->stop_fd,   .events = POLLIN },
+    };
+    server_worker_t   *worker;
+    int                fd;
+
+    for( ;; ) {
+        if( poll(pfd, 2, -1) == -1 ) {
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+        if( pfd[1].revents )
+            break;
+        if( !pfd[0].revents )
+            continue;
+
+        if( (fd = accept4(server->listen_fd, 0, 0, SOCK_CLOEXEC)) == -1 ) {
+            if( errno == EINTR || errno == ECONNABORTED ||
+                errno == EAGAIN || errno == EWOULDBLOCK )
+                continue;
+            /* Out of descriptors or memory; the client stays pending
+             * and the listen socket readable, so wait a while instead
+             * of spinning on it */
+            if( poll(&pfd[1], 1, SERVER_ACCEPT_BACKOFF_MS) > 0 )
+                break;
+            continue;
+        }
+
+        /* Count the client right away, so that a burst of connections
+         * is spread before workers have taken any over */
+        worker = server_pick_worker(server, fd);
+        __atomic_add_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+        if( write(worker->handoff[1], &fd, sizeof fd) != sizeof fd ) {
+            close(fd);
+            __atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Public interface
+ * ------------------------------------------------------------------------- */
+
+dsmesock_server_t *
+dsmesock_server_start(int listen_fd, const dsmesock_server_config_t *config)
+{
+    dsmesock_server_t *server;
+    long               cpus;
+    int                flags;
+    int                error;
+
+    if( !config || !config->handler ) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    if( (flags = fcntl(listen_fd, F_GETFL)) == -1 ||
+        fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+        return 0;
+
+    if( !(server = calloc(1, sizeof *server)) )
+        return 0;
+
+    server->config    = *config;
+    server->listen_fd = listen_fd;
+    server->count     = config->workers;
+    if( server->count == 0 ) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        server->count = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    server->workers = calloc(server->count, sizeof *server->workers);
+    if( server->stop_fd == -1 || !server->workers )
+        goto FAIL;
+
+    for( unsigned i = 0; i < server->count; ++i ) {
+        if( !server_worker_init(server, &server->workers[i]) )
+            goto FAIL;
+    }
+
+    server->acceptor = g_thread_new("dsmesock-acceptor",
+                                    server_acceptor_main, server);
+    if( !server->acceptor )
+        goto FAIL;
+
+    return server;
+
+FAIL:
+    error = errno;
+    dsmesock_server_stop(server);
+    errno = error;
+    return 0;
+}
+
+void
+dsmesock_server_stop(dsmesock_server_t *server)
+{
+    uint64_t one = 1;
+
+    if( !server )
+        return;
+
+    if( server->acceptor ) {
+        if( write(server->stop_fd, &one, sizeof one) == sizeof one )
+            g_thread_join(server->acceptor);
+    }
+
+    if( server->workers ) {
+        for( unsigned i = 0; i < server->count; ++i ) {
+            /* Workers after a failed one were never set up */
+            if( !server->workers[i].server )
+                break;
+            server_worker_quit(&server->workers[i]);
+        }
+        free(server->workers);
+    }
+
+    if( server->stop_fd != -1 )
+        close(server->stop_fd);
+    free(server);
+}
+
+bool
+dsmesock_server_broadcast(dsmesock_server_t *server, const void *msg,
+                          size_t extra_size, const void *extra)
+{
+    bool ok = true;
+
+    for( unsigned i = 0; i < server->count; ++i ) {
+        if( !dsmesock_sendqueue_submit(server->workers[i].queue, 0, msg,
+                                       extra_size, extra) )
+            ok = false;
+    }
+    return ok;
+}
+
+unsigned
+dsmesock_server_workers(const dsmesock_server_t *server)
+{
+    return server->count;
+}
+
+unsigned
+dsmesock_server_load(const dsmesock_server_t *server, unsigned worker)
+{
+    if( worker >= server->count )
+        return 0;
+
+    return __atomic_load_n(&server->workers[worker].load, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,355 @@
+/**
+   @file statuspage.c
+
+   Shared memory page with current dsme status values.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/statuspage.h"
+#include "include/dsme/alarm_limit.h"
+#include "dsme_internal.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* ------------------------------------------------------------------------- *
+ * State data
+ * ------------------------------------------------------------------------- */
+
+/** Status page descriptor and writable mapping of the publisher */
+static int                statuspage_fd  = -1;
+static dsme_statuspage_t *statuspage_map = 0;
+
+/** Read only descriptor of the same page, handed out to clients */
+static int                statuspage_ro_fd = -1;
+
+/* ------------------------------------------------------------------------- *
+ * Seqlock
+ *
+ * There is a single writer: the setters below must all be called from
+ * the same thread, or be serialized by the caller.
+ * ------------------------------------------------------------------------- */
+
+/** Attempts dsme_statuspage_read() makes before giving up */
+#define STATUSPAGE_READ_RETRIES 10000
+
+static dsme_status_t *
+statuspage_begin(void)
+{
+    if( !statuspage_map )
+        return 0;
+
+    __atomic_store_n(&statuspage_map->seq, statuspage_map->seq + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return &statuspage_map->status;
+}
+
+static void
+statuspage_commit(void)
+{
+    statuspage_map->status.snooze_timeout = dsme_snooze_timeout_in_seconds();
+    __atomic_store_n(&statuspage_map->seq, statuspage_map->seq + 1,
+                     __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Publisher side
+ * ------------------------------------------------------------------------- */
+
+bool
+dsme_statuspage_create(void)
+{
+    size_t size = sizeof *statuspage_map;
+    int    seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    char   path[64];
+    void  *map;
+
+    if( statuspage_map )
+        return true;
+
+    statuspage_fd = memfd_create("dsme-status",
+                                 MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if( statuspage_fd == -1 )
+        goto FAIL;
+
+    if( ftruncate(statuspage_fd, size) == -1 )
+        goto FAIL;
+
+    /* Clients get a descriptor opened for reading only, so that they
+     * can not make writable mappings whatever seals the kernel knows;
+     * without write permission they can not reopen it for writing */
+    if( fchmod(statuspage_fd, 0444) == -1 )
+        goto FAIL;
+    snprintf(path, sizeof path, "/proc/self/fd/%d", statuspage_fd);
+    statuspage_ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if( statuspage_ro_fd == -1 )
+        goto FAIL;
+
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, statuspage_fd, 0);
+    if( map == MAP_FAILED )
+        goto FAIL;
+
+    /* Keep writing through the existing mapping; where supported,
+     * also seal the page against any new writable mappings */
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if( fcntl(statuspage_fd, F_ADD_SEALS, seals) == -1 ) {
+        munmap(map, size);
+        goto FAIL;
+    }
+
+    statuspage_map          = map;
+    statuspage_map->magic   = DSME_STATUSPAGE_MAGIC;
+    statuspage_map->version = DSME_STATUSPAGE_VERSION;
+    statuspage_map->size    = size;
+
+    statuspage_begin();
+    statuspage_map->status.state         = DSME_STATE_NOT_SET;
+    statuspage_map->status.battery_level = DSME_BATTERY_LEVEL_UNKNOWN;
+    statuspage_commit();
+    return true;
+
+FAIL:
+    if( statuspage_ro_fd != -1 )
+        close(statuspage_ro_fd), statuspage_ro_fd = -1;
+    if( statuspage_fd != -1 )
+        close(statuspage_fd), statuspage_fd = -1;
+    return false;
+}
+
+void
+dsme_statuspage_destroy(void)
+{
+    if( statuspage_map )
+        munmap(statuspage_map, sizeof *statuspage_map);
+    if( statuspage_fd != -1 )
+        close(statuspage_fd);
+    if( statuspage_ro_fd != -1 )
+        close(statuspage_ro_fd);
+
+    statuspage_map   = 0;
+    statuspage_fd    = -1;
+    statuspage_ro_fd = -1;
+}
+
+void
+dsme_statuspage_set_state(dsme_state_t state)
+{
+    dsme_status_t *status = statuspage_begin();
+
+    if( status ) {
+        status->state = state;
+        statuspage_commit();
+    }
+}
+
+void
+dsme_statuspage_set_battery_level(dsme_battery_level_t level)
+{
+    dsme_status_t *status = statuspage_begin();
+
+    if( status ) {
+        status->battery_level = level;
+        statuspage_commit();
+    }
+}
+
+void
+dsme_statuspage_set_charger(bool connected)
+{
+    dsme_status_t *status = statuspage_begin();
+
+    if( status ) {
+        status->charger = connected;
+        statuspage_commit();
+    }
+}
+
+void
+dsme_statuspage_set_emergency_call(bool ongoing)
+{
+    dsme_status_t *status = statuspage_begin();
+
+    if( status ) {
+        status->emergency_call = ongoing;
+        statuspage_commit();
+    }
+}
+
+bool
+dsme_statuspage_set_thermal(const char *sensor,
+                            dsme_thermal_status_t thermal,
+                            int temperature)
+{
+    dsme_statuspage_sensor_t *slot   = 0;
+    dsme_status_t            *status;
+    uint32_t                  i;
+
+    if( !statuspage_map )
+        return false;
+
+    /* Lookup does not change the page; no need to lock yet */
+    status = &statuspage_map->status;
+    for( i = 0; i < status->sensor_count; ++i ) {
+        if( !strncmp(status->sensors[i].name, sensor,
+                     sizeof status->sensors[i].name - 1) ) {
+            slot = &status->sensors[i];
+            break;
+        }
+    }
+    if( !slot && status->sensor_count == DSME_STATUSPAGE_SENSORS_MAX )
+        return false;
+
+    statuspage_begin();
+    if( !slot ) {
+        slot = &status->sensors[status->sensor_count++];
+        memset(slot->name, 0, sizeof slot->name);
+        strncpy(slot->name, sensor, sizeof slot->name - 1);
+    }
+    slot->status      = thermal;
+    slot->temperature = temperature;
+    statuspage_commit();
+    return true;
+}
+
+int
+dsme_statuspage_send(dsmesock_connection_t *conn)
+{
+    DSM_MSGTYPE_STATUSPAGE msg = DSME_MSG_INIT(DSM_MSGTYPE_STATUSPAGE);
+
+    if( statuspage_ro_fd == -1 ) {
+        errno = ENOENT;
+        return -1;
+    }
+    return dsmesock_send_with_fd(conn, &msg, statuspage_ro_fd) == -1 ? -1 : 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Client side
+ * ------------------------------------------------------------------------- */
+
+const dsme_statuspage_t *
+dsme_statuspage_map(int fd)
+{
+    const dsme_statuspage_t *page;
+    struct stat              st;
+
+    if( fstat(fd, &st) == -1 )
+        return 0;
+
+    if( (size_t)st.st_size < sizeof *page ) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    page = mmap(0, sizeof *page, PROT_READ, MAP_SHARED, fd, 0);
+    if( page == MAP_FAILED )
+        return 0;
+
+    if( page->magic   != DSME_STATUSPAGE_MAGIC   ||
+        page->version != DSME_STATUSPAGE_VERSION ||
+        page->size    <  sizeof *page ) {
+        munmap((void *)page, sizeof *page);
+        errno = EINVAL;
+        return 0;
+    }
+    return page;
+}
+
+const dsme_statuspage_t *
+dsme_statuspage_open(dsmesock_connection_t *conn, int timeout_ms)
+{
+    DSM_MSGTYPE_GET_STATUSPAGE req = DSME_MSG_INIT(DSM_MSGTYPE_GET_STATUSPAGE);
+    const dsme_statuspage_t   *page = 0;
+    dsmemsg_generic_t         *msg;
+    int                        fd;
+    int                        passing;
+
+    /* Accept the page descriptor for the duration of the request */
+    if( (passing = dsmesock_set_fd_passing(conn, true)) == -1 )
+        return 0;
+
+    if( dsmesock_send(conn, &req) == -1 )
+        msg = 0;
+    else
+        msg = dsmesock_receive_id(conn,
+                                  DSME_MSG_ID_(DSM_MSGTYPE_STATUSPAGE),
+                                  dsme_monotonic_ns() +
+                                  timeout_ms * INT64_C(1000000));
+    if( !msg ) {
+        dsmesock_set_fd_passing(conn, passing);
+        return 0;
+    }
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATUSPAGE, msg) ) {
+        if( (fd = dsmesock_take_fd(conn)) != -1 ) {
+            page = dsme_statuspage_map(fd);
+            close(fd);
+        }
+        else
+            errno = EPROTO;
+    }
+    else
+        errno = ENOTCONN;
+
+    dsmesock_set_fd_passing(conn, passing);
+    free(msg);
+    return page;
+}
+
+void
+dsme_statuspage_unmap(const dsme_statuspage_t *page)
+{
+    if( page )
+        munmap((void *)page, sizeof *page);
+}
+
+bool
+dsme_statuspage_read(const dsme_statuspage_t *page, dsme_status_t *status)
+{
+    uint32_t seq;
+
+    for( int i = 0; i < STATUSPAGE_READ_RETRIES; ++i ) {
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if( seq & 1 )
+            continue;
+
+        memcpy(status, &page->status, sizeof *status);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq )
+            return true;
+    }
+
+    /* Publisher died or stalled in the middle of an update */
+    errno = EAGAIN;
+    return false;
+}
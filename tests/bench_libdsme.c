@@ -0,0 +1,605 @@
+/**
+   @file bench_libdsme.c
+
+   Performance benchmarks for libdsme.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * some glibc versions seems to mistakenly define ucred behind __USE_GNU;
+ * work around by #defining _GNU_SOURCE
+ */
+#define _GNU_SOURCE
+
+#include "../include/dsme/messages.h"
+#include "../include/dsme/protocol.h"
+#include "../include/dsme/state.h"
+
+#include "common.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#ifndef LIBDSME_VERSION
+# define LIBDSME_VERSION "unknown"
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+/** Scale factor for iteration counts, see --quick */
+static int bench_scale = 10;
+
+/** Results of micro benchmark loops are stored here to keep them alive */
+static volatile size_t bench_sink;
+
+/** Emit one result as a line of JSON on stdout */
+static void emit_result(const char *bench, const char *fmt, ...)
+{
+    va_list va;
+    printf("{\"bench\":\"%s\",\"version\":\"%s\",", bench, LIBDSME_VERSION);
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Mock Daemon
+ * ------------------------------------------------------------------------- */
+
+static const char mock_socket[] = "/tmp/bench_libdsme.sock";
+
+static void daemon_echo_message(dsmesock_connection_t *connection,
+                                const dsmemsg_generic_t *msg)
+{
+    /* Echo everything back as is */
+    dsmesock_send(connection, msg);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Benchmarks
+ * ------------------------------------------------------------------------- */
+
+/** Payload sizes used for round trip and throughput measurements */
+static const size_t payload_sizes[] = { 0, 64, 1024, 16384, 65000 };
+
+static void *make_payload(size_t size)
+{
+    unsigned char *data = malloc(size ? size : 1);
+    for( size_t i = 0; i < size; ++i )
+        data[i] = (unsigned char)i;
+    return data;
+}
+
+/** Round trip latency using blocking style send / poll / receive */
+static bool bench_roundtrip(size_t payload)
+{
+    bool                   ok      = false;
+    size_t                 samples = 200 * bench_scale;
+    int64_t               *lat     = calloc(samples, sizeof *lat);
+    void                  *extra   = make_payload(payload);
+    dsmesock_connection_t *conn    = dsmesock_connect();
+    DSM_MSGTYPE_STATE_QUERY msg    = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+
+    if( !conn ) {
+        log_error("connect failed");
+        goto bailout;
+    }
+
+    for( size_t i = 0; i < samples; ++i ) {
+        int64_t t0 = now_ns();
+        if( dsmesock_send_with_extra(conn, &msg, payload, extra) == -1 ) {
+            log_error("send failed: %m");
+            goto bailout;
+        }
+        dsmemsg_generic_t *reply = NULL;
+        while( !reply ) {
+            if( wait_input(conn->fd) != 1 )
+                goto bailout;
+            reply = dsmesock_receive(conn);
+        }
+        lat[i] = now_ns() - t0;
+        bool closed = DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, reply) != NULL;
+        free(reply);
+        if( closed ) {
+            log_error("daemon closed connection");
+            goto bailout;
+        }
+    }
+
+    int64_t sum = 0;
+    for( size_t i = 0; i < samples; ++i )
+        sum += lat[i];
+    qsort(lat, samples, sizeof *lat, compare_int64);
+
+    emit_result("roundtrip",
+                "\"payload\":%zu,\"samples\":%zu,\"mean_ns\":%lld,"
+                "\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld",
+                payload, samples, (long long)(sum / (int64_t)samples),
+                (long long)percentile(lat, samples, 500),
+                (long long)percentile(lat, samples, 990),
+                (long long)percentile(lat, samples, 999));
+    ok = true;
+
+bailout:
+    if( conn )
+        dsmesock_close(conn);
+    free(extra);
+    free(lat);
+    return ok;
+}
+
+typedef struct
+{
+    DSM_MSGTYPE_STATE_QUERY msg;
+    const void *extra;
+    size_t      payload;
+    size_t      to_send;
+    size_t      to_receive;
+    bool        failed;
+} throughput_t;
+
+static bool throughput_cb(dsmesock_connection_t *connection,
+                          const dsmemsg_generic_t *msg,
+                          void *user_data)
+{
+    throughput_t *self = user_data;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+        self->failed = true;
+        return false;
+    }
+
+    --self->to_receive;
+    if( self->to_send > 0 ) {
+        --self->to_send;
+        dsmesock_send_with_extra(connection, &self->msg,
+                                 self->payload, self->extra);
+    }
+    return true;
+}
+
+/** Pipelined throughput using main loop integration */
+static bool bench_throughput(size_t payload)
+{
+    const size_t  window  = 64;
+    bool          ok      = false;
+    size_t        count   = 2000 * bench_scale;
+    GMainContext *context = g_main_context_new();
+    void         *extra   = make_payload(payload);
+    throughput_t  self    = {
+        .msg        = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY),
+        .extra      = extra,
+        .payload    = payload,
+        .to_send    = count,
+        .to_receive = count,
+    };
+
+    if( payload >= 16384 )
+        count = self.to_send = self.to_receive = count / 10;
+
+    dsmesock_connection_t *conn = dsmesock_connect();
+    if( !conn || !dsmesock_attach(conn, context, throughput_cb, &self) ) {
+        log_error("connect failed");
+        goto bailout;
+    }
+
+    int64_t t0 = now_ns();
+    for( size_t i = 0; i < window && self.to_send > 0; ++i ) {
+        --self.to_send;
+        dsmesock_send_with_extra(conn, &self.msg, payload, extra);
+    }
+    while( self.to_receive > 0 && !self.failed )
+        g_main_context_iteration(context, TRUE);
+    int64_t t1 = now_ns();
+
+    if( self.failed ) {
+        log_error("daemon closed connection");
+        goto bailout;
+    }
+
+    double seconds = (t1 - t0) / 1e9;
+    size_t frame   = sizeof self.msg + payload;
+    emit_result("throughput",
+                "\"payload\":%zu,\"messages\":%zu,\"window\":%zu,"
+                "\"seconds\":%.6f,\"msgs_per_sec\":%.0f,"
+                "\"bytes_per_sec\":%.0f",
+                payload, count, window, seconds, count / seconds,
+                count * frame * 2 / seconds);
+    ok = true;
+
+bailout:
+    if( conn )
+        dsmesock_close(conn);
+    g_main_context_unref(context);
+    free(extra);
+    return ok;
+}
+
+static bool loopback_echo_cb(dsmesock_connection_t *connection,
+                             const dsmemsg_generic_t *msg,
+                             void *user_data)
+{
+    (void)user_data;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) )
+        return false;
+
+    dsmesock_send(connection, msg);
+    return true;
+}
+
+/** Pipelined throughput over an in-process connection pair
+ *
+ * Same traffic as bench_throughput(), without kernel or daemon costs,
+ * so that it shows the overhead of the library itself.
+ */
+static bool bench_loopback(size_t payload)
+{
+    const size_t           window  = 64;
+    bool                   ok      = false;
+    size_t                 count   = 20000 * bench_scale;
+    GMainContext          *context = g_main_context_new();
+    void                  *extra   = make_payload(payload);
+    dsmesock_connection_t *conn    = 0;
+    dsmesock_connection_t *echo    = 0;
+    throughput_t           self    = {
+        .msg        = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY),
+        .extra      = extra,
+        .payload    = payload,
+    };
+
+    if( payload >= 16384 )
+        count /= 10;
+    self.to_send = self.to_receive = count;
+
+    if( !dsmesock_loopback_pair(&conn, &echo) ) {
+        log_error("loopback pair failed: %m");
+        goto bailout;
+    }
+    if( !dsmesock_attach(conn, context, throughput_cb, &self) ||
+        !dsmesock_attach(echo, context, loopback_echo_cb, 0) ) {
+        log_error("attach failed");
+        goto bailout;
+    }
+
+    int64_t t0 = now_ns();
+    for( size_t i = 0; i < window && self.to_send > 0; ++i ) {
+        --self.to_send;
+        dsmesock_send_with_extra(conn, &self.msg, payload, extra);
+    }
+    while( self.to_receive > 0 && !self.failed )
+        g_main_context_iteration(context, TRUE);
+    int64_t t1 = now_ns();
+
+    if( self.failed ) {
+        log_error("loopback peer closed connection");
+        goto bailout;
+    }
+
+    double seconds = (t1 - t0) / 1e9;
+    size_t frame   = sizeof self.msg + payload;
+    emit_result("loopback_throughput",
+                "\"payload\":%zu,\"messages\":%zu,\"window\":%zu,"
+                "\"seconds\":%.6f,\"msgs_per_sec\":%.0f,"
+                "\"bytes_per_sec\":%.0f",
+                payload, count, window, seconds, count / seconds,
+                count * frame * 2 / seconds);
+    ok = true;
+
+bailout:
+    if( echo )
+        dsmesock_close(echo);
+    if( conn )
+        dsmesock_close(conn);
+    g_main_context_unref(context);
+    free(extra);
+    return ok;
+}
+
+/** Make sure enough file descriptors are available */
+static size_t raise_fd_limit(size_t wanted)
+{
+    struct rlimit rl;
+
+    if( getrlimit(RLIMIT_NOFILE, &rl) == -1 )
+        return 0;
+    if( rl.rlim_cur < wanted ) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > wanted)
+            ? wanted : rl.rlim_max;
+        if( setrlimit(RLIMIT_NOFILE, &rl) == -1 )
+            log_warning("setrlimit failed: %m");
+        if( getrlimit(RLIMIT_NOFILE, &rl) == -1 )
+            return 0;
+    }
+    return rl.rlim_cur;
+}
+
+/** Broadcast cost as a function of connected clients */
+static bool bench_broadcast(size_t clients)
+{
+    bool                    ok     = false;
+    size_t                  rounds = (clients >= 1000 ? 2 : 20) * bench_scale;
+    size_t                  opened = 0;
+    int                    *peer   = calloc(clients, sizeof *peer);
+    dsmesock_connection_t **conn   = calloc(clients, sizeof *conn);
+    DSM_MSGTYPE_STATE_CHANGE_IND msg =
+        DSME_MSG_INIT(DSM_MSGTYPE_STATE_CHANGE_IND);
+    char                    sink[256];
+
+    if( raise_fd_limit(clients * 2 + 64) < clients * 2 + 64 ) {
+        emit_result("broadcast", "\"clients\":%zu,\"skipped\":\"fd limit\"",
+                    clients);
+        ok = true;
+        goto bailout;
+    }
+
+    for( ; opened < clients; ++opened ) {
+        int fds[2];
+        if( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1 ) {
+            log_error("socketpair failed: %m");
+            goto bailout;
+        }
+        peer[opened] = fds[1];
+        if( !(conn[opened] = dsmesock_init(fds[0])) ) {
+            close(fds[0]);
+            close(fds[1]);
+            goto bailout;
+        }
+    }
+
+    int64_t total = 0;
+    int64_t worst = 0;
+    for( size_t r = 0; r < rounds; ++r ) {
+        msg.state = (dsme_state_t)r;
+        int64_t t0 = now_ns();
+        dsmesock_broadcast(&msg);
+        int64_t t = now_ns() - t0;
+        total += t;
+        if( worst < t )
+            worst = t;
+
+        /* Keep client side socket buffers from filling up */
+        for( size_t i = 0; i < clients; ++i ) {
+            if( read(peer[i], sink, sizeof sink) == -1 )
+                log_warning("read failed: %m");
+        }
+    }
+
+    emit_result("broadcast",
+                "\"clients\":%zu,\"rounds\":%zu,\"mean_ns\":%lld,"
+                "\"max_ns\":%lld,\"ns_per_client\":%.1f",
+                clients, rounds, (long long)(total / (int64_t)rounds),
+                (long long)worst, (double)total / rounds / clients);
+    ok = true;
+
+bailout:
+    for( size_t i = 0; i < opened; ++i ) {
+        dsmesock_close(conn[i]);
+        close(peer[i]);
+    }
+    free(conn);
+    free(peer);
+    return ok;
+}
+
+/** Cost of allocating messages */
+static bool bench_msg_new(size_t extra)
+{
+    size_t iterations = 100000 * bench_scale;
+
+    int64_t t0 = now_ns();
+    for( size_t i = 0; i < iterations; ++i ) {
+        DSM_MSGTYPE_STATE_CHANGE_IND *msg =
+            DSME_MSG_NEW_WITH_EXTRA(DSM_MSGTYPE_STATE_CHANGE_IND, extra);
+        msg->state = DSME_STATE_USER;
+        bench_sink += msg->state;
+        free(msg);
+    }
+    int64_t t1 = now_ns();
+
+    emit_result("dsmemsg_new",
+                "\"extra\":%zu,\"iterations\":%zu,\"ns_per_op\":%.1f",
+                extra, iterations, (double)(t1 - t0) / iterations);
+    return true;
+}
+
+/** Cost of building messages in a reused arena */
+static bool bench_msg_arena(size_t extra)
+{
+    size_t iterations = 100000 * bench_scale;
+    dsmemsg_arena_t arena;
+
+    dsmemsg_arena_init(&arena, 0, 0);
+
+    int64_t t0 = now_ns();
+    for( size_t i = 0; i < iterations; ++i ) {
+        dsmemsg_arena_reset(&arena);
+        DSM_MSGTYPE_STATE_CHANGE_IND *msg =
+            DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_STATE_CHANGE_IND, extra);
+        msg->state = DSME_STATE_USER;
+        bench_sink += msg->state;
+    }
+    int64_t t1 = now_ns();
+
+    dsmemsg_arena_release(&arena);
+    emit_result("dsmemsg_arena_reserve",
+                "\"extra\":%zu,\"iterations\":%zu,\"ns_per_op\":%.1f",
+                extra, iterations, (double)(t1 - t0) / iterations);
+    return true;
+}
+
+/** Cost of looking up message names */
+static bool bench_id_name(uint32_t id)
+{
+    size_t iterations = 100000 * bench_scale;
+    size_t sum = 0;
+
+    int64_t t0 = now_ns();
+    for( size_t i = 0; i < iterations; ++i )
+        sum += *dsmemsg_id_name(id);
+    int64_t t1 = now_ns();
+    bench_sink += sum;
+
+    emit_result("dsmemsg_id_name",
+                "\"id\":\"0x%08x\",\"name\":\"%s\",\"iterations\":%zu,"
+                "\"ns_per_op\":%.1f",
+                (unsigned)id, dsmemsg_id_name(id), iterations,
+                (double)(t1 - t0) / iterations);
+    return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Benchmark Application
+ * ------------------------------------------------------------------------- */
+
+int main(int argc, char **argv)
+{
+    int exit_code = EXIT_FAILURE;
+    size_t max_clients = 10000;
+
+    /* Handle command line options */
+    static const struct option optL[] = {
+        {"help",        no_argument,       0,  'h' },
+        {"verbose",     no_argument,       0,  'v' },
+        {"quiet",       no_argument,       0,  'q' },
+        {"quick",       no_argument,       0,  'Q' },
+        {"max-clients", required_argument, 0,  'c' },
+        {0,             0,                 0,   0  }
+    };
+    static const char optS[] = "hvqQc:";
+
+    for( ;; ) {
+        int opt = getopt_long(argc, argv, optS, optL, 0);
+        if( opt == -1 )
+            break;
+
+        switch( opt ) {
+        case 'h':
+            printf("Usage:\n"
+                   "    %s [options]\n"
+                   "\n"
+                   "Results are written to stdout, one JSON object per line.\n"
+                   "\n"
+                   "Options:\n"
+                   "  -h/--help            Print this help text\n"
+                   "  -v/--verbose         Make output one step more verbose\n"
+                   "  -q/--quiet           Make output one step less verbose\n"
+                   "  -Q/--quick           Use 1/10 of the default iterations\n"
+                   "  -c/--max-clients=<n> Largest broadcast fan-out (default: %zu)\n"
+                   "\n",
+                   *argv, max_clients);
+            exit(EXIT_SUCCESS);
+
+        case 'v':
+            ++log_level;
+            break;
+
+        case 'q':
+            --log_level;
+            break;
+
+        case 'Q':
+            bench_scale = 1;
+            break;
+
+        case 'c':
+            max_clients = strtoul(optarg, 0, 0);
+            break;
+
+        case '?':
+            /* getopt has already written a diagnostic message */
+            goto bailout;
+
+        default:
+            fprintf(stderr, "Unhandled option %d '-%c'\n",
+                    opt, isalnum(opt) ? opt : '?');
+            goto bailout;
+        }
+    }
+
+    /* Broken pipe must not kill the benchmark */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Pipelined throughput keeps more than the default backlog cap in
+     * flight; measure raw throughput rather than congestion handling.
+     * Set before forking so that the mock daemon inherits it too. */
+    dsmesock_set_default_backlog_limits(NULL, NULL, NULL);
+
+    /* Start mock daemon child process */
+    if( !mock_daemon_start(mock_socket, daemon_echo_message) )
+        goto bailout;
+
+    for( size_t i = 0; i < G_N_ELEMENTS(payload_sizes); ++i ) {
+        if( !bench_roundtrip(payload_sizes[i]) )
+            goto bailout;
+    }
+
+    for( size_t i = 0; i < G_N_ELEMENTS(payload_sizes); ++i ) {
+        if( !bench_throughput(payload_sizes[i]) )
+            goto bailout;
+    }
+
+    for( size_t i = 0; i < G_N_ELEMENTS(payload_sizes); ++i ) {
+        if( !bench_loopback(payload_sizes[i]) )
+            goto bailout;
+    }
+
+    for( size_t clients = 1; clients <= max_clients; clients *= 10 ) {
+        if( !bench_broadcast(clients) )
+            goto bailout;
+    }
+
+    static const size_t extra_sizes[] = { 0, 256, 4096 };
+    for( size_t i = 0; i < G_N_ELEMENTS(extra_sizes); ++i )
+        bench_msg_new(extra_sizes[i]);
+    for( size_t i = 0; i < G_N_ELEMENTS(extra_sizes); ++i )
+        bench_msg_arena(extra_sizes[i]);
+
+    bench_id_name(DSME_MSG_ID_(DSM_MSGTYPE_CLOSE));
+    bench_id_name(DSME_MSG_ID_(DSM_MSGTYPE_SET_THERMAL_STATUS));
+    bench_id_name(0xdeadbeef);
+
+    exit_code = EXIT_SUCCESS;
+
+bailout:
+    /* Terminate mock daemon child process */
+    mock_daemon_stop();
+
+    return exit_code;
+}
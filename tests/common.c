@@ -0,0 +1,266 @@
+/**
+   @file common.c
+
+   Helpers shared by the libdsme test and benchmark programs.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * some glibc versions seems to mistakenly define ucred behind __USE_GNU;
+ * work around by #defining _GNU_SOURCE
+ */
+#define _GNU_SOURCE
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+/* ------------------------------------------------------------------------- *
+ * Diagnostic Logging
+ * ------------------------------------------------------------------------- */
+
+int log_level = LOG_WARNING;
+
+static const char * const log_tag[] = {
+    [LOG_EMERG]   = "X: ",
+    [LOG_ALERT]   = "A: ",
+    [LOG_CRIT]    = "C: ",
+    [LOG_ERR]     = "E: ",
+    [LOG_WARNING] = "W: ",
+    [LOG_NOTICE]  = "N: ",
+    [LOG_INFO]    = "I: ",
+    [LOG_DEBUG]   = "D: ",
+};
+
+void log_emit_(const char *file, int line, const char *func,
+               int level, const char *fmt, ...)
+{
+    int saved = errno;
+    char *msg = NULL;
+    va_list va;
+    va_start(va, fmt);
+    if( vasprintf(&msg, fmt, va) < 0 )
+        msg = NULL;
+    va_end(va);
+    fprintf(stderr, "%s:%d: %s: %s%s\n",
+            file, line, func,
+            log_tag[level], msg ?: fmt);
+    fflush(stderr);
+    free(msg);
+    errno = saved;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+int64_t now_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+int wait_input(int fd)
+{
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN,
+    };
+    int rc = poll(&pfd, 1, 5000);
+    if( rc == 0 )
+        log_warning("wait_input() timeout");
+    else if( rc == -1 )
+        log_warning("wait_input() failed: %m");
+    return rc;
+}
+
+int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int64_t percentile(const int64_t *sorted, size_t count, int permille)
+{
+    size_t index = (count * permille + 999) / 1000;
+    return count ? sorted[index ? index - 1 : 0] : 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Mock Daemon
+ * ------------------------------------------------------------------------- */
+
+static char *daemon_socket = NULL;
+static int daemon_pid = -1;
+
+static bool daemon_message_cb(dsmesock_connection_t *connection,
+                              const dsmemsg_generic_t *msg,
+                              void *user_data)
+{
+    mock_daemon_handler_t handler = user_data;
+
+    log_notice("MOCK: recv(%s)", dsmemsg_name(msg));
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+        /* Client disconnected */
+        dsmesock_close(connection);
+        return false;
+    }
+
+    handler(connection, msg);
+    return true;
+}
+
+static gboolean daemon_accept_cb(gint fd, GIOCondition cond, gpointer data)
+{
+    (void)cond;
+
+    int client_fd = accept(fd, NULL, 0);
+    if( client_fd == -1 ) {
+        log_error("MOCK: accept() failed: %m");
+        return G_SOURCE_CONTINUE;
+    }
+
+    dsmesock_connection_t *connection = dsmesock_init(client_fd);
+    if( !connection ) {
+        log_error("MOCK: dsmesock_init() failed");
+        close(client_fd);
+    }
+    else if( !dsmesock_attach(connection, NULL, daemon_message_cb, data) ) {
+        log_error("MOCK: dsmesock_attach() failed");
+        dsmesock_close(connection);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void daemon_main(int listen_fd, mock_daemon_handler_t handler)
+{
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_unix_fd_add(listen_fd, G_IO_IN, daemon_accept_cb, handler);
+    log_debug("MOCK: daemon running");
+    g_main_loop_run(loop);
+    log_error("MOCK: daemon stopped");
+}
+
+bool mock_daemon_start(const char *socket_path,
+                       mock_daemon_handler_t handler)
+{
+    bool success = false;
+    int listen_fd = -1;
+
+    if( unlink(socket_path) == -1 && errno != ENOENT ) {
+        log_error("MOCK: unlink(%s) failed: %m", socket_path);
+        goto bailout;
+    }
+
+    if( (listen_fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1 ) {
+        log_error("MOCK: socket() failed: %m");
+        goto bailout;
+    }
+
+    struct sockaddr_un sa = {
+        .sun_family = AF_UNIX,
+    };
+    strncat(sa.sun_path, socket_path, sizeof sa.sun_path - 1);
+    if( bind(listen_fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_error("MOCK: bind(%s) failed: %m", socket_path);
+        goto bailout;
+    }
+
+    if( chmod(socket_path, 0666) == -1 ) {
+        log_error("MOCK: chmod(%s) failed: %m", socket_path);
+        goto bailout;
+    }
+
+    if( listen(listen_fd, SOMAXCONN) == -1 ) {
+        log_error("MOCK: listen(%s) failed: %m", socket_path);
+        goto bailout;
+    }
+
+    if( (daemon_pid = fork()) == -1 ) {
+        log_error("MOCK: fork() failed: %m");
+        goto bailout;
+    }
+
+    if( daemon_pid == 0 ) {
+        /* Child proces = mock daemon */
+        daemon_main(listen_fd, handler);
+        /* Expected: daemon process gets killed with SIGTERM
+         *           and control does not return here. */
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Make dsmesock_connect() talk to mock daemon */
+    daemon_socket = strdup(socket_path);
+    setenv("DSME_SOCKFILE", socket_path, 1);
+
+    success = true;
+
+bailout:
+    /* Only the daemon process needs the listening socket; closing it
+     * here also keeps it out of any later child processes */
+    if( listen_fd != -1 )
+        close(listen_fd);
+
+    return success;
+}
+
+void mock_daemon_stop(void)
+{
+    if( daemon_socket ) {
+        if( unlink(daemon_socket) == -1 && errno != ENOENT )
+            log_warning("MOCK: unlink(%s) failed: %m", daemon_socket);
+        free(daemon_socket);
+        daemon_socket = NULL;
+    }
+
+    if( daemon_pid != -1 ) {
+        if( kill(daemon_pid, SIGTERM) == -1 )
+            log_warning("MOCK: daemon terminate failed: %m");
+
+        int status = 0;
+        if( waitpid(daemon_pid, &status, 0) == -1 )
+            log_warning("MOCK: daemon wait failed: %m");
+        else if( WIFEXITED(status) )
+            log_warning("MOCK: daemon terminated by exit(%d)",
+                        WEXITSTATUS(status));
+        else if( WIFSIGNALED(status) )
+            log_debug("MOCK: daemon terminated by signal(%s)",
+                      strsignal(WTERMSIG(status)));
+        else
+            log_warning("MOCK: daemon not terminated?");
+        daemon_pid = -1;
+    }
+}
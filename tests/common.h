@@ -0,0 +1,101 @@
+/**
+   @file common.h
+
+   Helpers shared by the libdsme test and benchmark programs.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DSME_TESTS_COMMON_H
+#define DSME_TESTS_COMMON_H
+
+#include "../include/dsme/messages.h"
+#include "../include/dsme/protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <syslog.h>
+
+/* ------------------------------------------------------------------------- *
+ * Diagnostic Logging
+ * ------------------------------------------------------------------------- */
+
+extern int log_level;
+
+void log_emit_(const char *file, int line, const char *func,
+               int level, const char *fmt, ...);
+
+#define log_p(LEV) ((LEV)<=log_level)
+
+#define log_emit(LEV, FMT,ARGS...)\
+     do {\
+         if( log_p(LEV) )\
+             log_emit_(__FILE__, __LINE__, __func__, LEV, FMT, ##ARGS);\
+     } while( false )
+
+#define log_error(  FMT, ARGS...) log_emit(LOG_ERR,     FMT, ##ARGS)
+#define log_warning(FMT, ARGS...) log_emit(LOG_WARNING, FMT, ##ARGS)
+#define log_notice( FMT, ARGS...) log_emit(LOG_NOTICE,  FMT, ##ARGS)
+#define log_info(   FMT, ARGS...) log_emit(LOG_INFO,    FMT, ##ARGS)
+#define log_debug(  FMT, ARGS...) log_emit(LOG_DEBUG,   FMT, ##ARGS)
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+/** Get CLOCK_MONOTONIC time in nanoseconds */
+int64_t now_ns(void);
+
+/** Wait up to 5 seconds for input on fd
+ *
+ * @return 1 if input is available, 0 on timeout, -1 on error
+ */
+int wait_input(int fd);
+
+/** qsort() comparator for int64_t arrays */
+int compare_int64(const void *a, const void *b);
+
+/** Get nearest rank percentile, in permille, from a sorted array */
+int64_t percentile(const int64_t *sorted, size_t count, int permille);
+
+/* ------------------------------------------------------------------------- *
+ * Mock Daemon
+ * ------------------------------------------------------------------------- */
+
+/** Mock daemon handler for messages other than DSM_MSGTYPE_CLOSE
+ */
+typedef void (*mock_daemon_handler_t)(dsmesock_connection_t *connection,
+                                      const dsmemsg_generic_t *msg);
+
+/** Start mock daemon child process listening at socket_path
+ *
+ * The daemon serves all clients concurrently from a glib main loop
+ * and passes each received message to handler. Also points
+ * $DSME_SOCKFILE at socket_path so that dsmesock_connect() talks
+ * to the mock daemon.
+ *
+ * @return true if the daemon was started, false otherwise
+ */
+bool mock_daemon_start(const char *socket_path,
+                       mock_daemon_handler_t handler);
+
+/** Terminate mock daemon started with mock_daemon_start()
+ */
+void mock_daemon_stop(void);
+
+#endif /* DSME_TESTS_COMMON_H */
@@ -0,0 +1,642 @@
+/**
+   @file loadgen_libdsme.c
+
+   Synthetic multi-client load generator for dsme sockets.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * some glibc versions seems to mistakenly define ucred behind __USE_GNU;
+ * work around by #defining _GNU_SOURCE
+ */
+#define _GNU_SOURCE
+
+#include "../include/dsme/messages.h"
+#include "../include/dsme/protocol.h"
+#include "../include/dsme/processwd.h"
+#include "../include/dsme/state.h"
+
+#include "common.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+/* ------------------------------------------------------------------------- *
+ * Configuration
+ * ------------------------------------------------------------------------- */
+
+/** Message kinds the generator can send */
+typedef enum
+{
+    MIX_QUERY,
+    MIX_CHARGER,
+    MIX_BATTERY,
+    MIX_ALARM,
+    MIX_THERMAL,
+    MIX_PONG,
+    MIX_COUNT
+} mix_kind_t;
+
+static const char * const mix_name[MIX_COUNT] = {
+    [MIX_QUERY]   = "query",
+    [MIX_CHARGER] = "charger",
+    [MIX_BATTERY] = "battery",
+    [MIX_ALARM]   = "alarm",
+    [MIX_THERMAL] = "thermal",
+    [MIX_PONG]    = "pong",
+};
+
+static int     cfg_clients    = 100;
+static int     cfg_workers    = 4;
+static double  cfg_rate       = 10.0;   /* messages per second per client */
+static int     cfg_burst      = 1;      /* messages sent back to back */
+static double  cfg_duration   = 5.0;    /* seconds */
+static bool    cfg_mock       = false;
+static bool    cfg_per_client = false;
+static int     cfg_mix[MIX_COUNT] = { [MIX_QUERY] = 1 };
+
+static bool parse_mix(const char *spec)
+{
+    char *work = strdup(spec);
+    char *pos  = work;
+    bool  ok   = true;
+
+    memset(cfg_mix, 0, sizeof cfg_mix);
+
+    for( char *item; ok && (item = strsep(&pos, ",")); ) {
+        char *weight = strchr(item, '=');
+        int   kind;
+
+        if( weight )
+            *weight++ = 0;
+
+        for( kind = 0; kind < MIX_COUNT; ++kind ) {
+            if( !strcmp(mix_name[kind], item) )
+                break;
+        }
+        if( kind == MIX_COUNT ) {
+            fprintf(stderr, "unknown message kind: %s\n", item);
+            ok = false;
+        }
+        else {
+            cfg_mix[kind] = weight ? atoi(weight) : 1;
+        }
+    }
+
+    free(work);
+    return ok;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Utilities
+ * ------------------------------------------------------------------------- */
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *pos = data;
+    while( size > 0 ) {
+        ssize_t rc = write(fd, pos, size);
+        if( rc == -1 && errno == EINTR )
+            continue;
+        if( rc <= 0 )
+            return false;
+        pos += rc, size -= rc;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    char *pos = data;
+    while( size > 0 ) {
+        ssize_t rc = read(fd, pos, size);
+        if( rc == -1 && errno == EINTR )
+            continue;
+        if( rc <= 0 )
+            return false;
+        pos += rc, size -= rc;
+    }
+    return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Mock Daemon
+ * ------------------------------------------------------------------------- */
+
+static const char mock_socket[] = "/tmp/loadgen_libdsme.sock";
+
+static void daemon_reply_message(dsmesock_connection_t *connection,
+                                 const dsmemsg_generic_t *msg)
+{
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) ) {
+        DSM_MSGTYPE_STATE_CHANGE_IND reply =
+            DSME_MSG_INIT(DSM_MSGTYPE_STATE_CHANGE_IND);
+        reply.state = DSME_STATE_TEST;
+        dsmesock_send(connection, &reply);
+    }
+}
+
+/* ------------------------------------------------------------------------- *
+ * Client Worker
+ * ------------------------------------------------------------------------- */
+
+/** Per-client results sent from worker processes to the parent */
+typedef struct
+{
+    int     client;
+    int     connected;
+    int64_t connect_ns;
+    int64_t sent;
+    int64_t replies;
+    int64_t lat_mean_ns;
+    int64_t lat_p50_ns;
+    int64_t lat_p99_ns;
+    int64_t lat_max_ns;
+} client_result_t;
+
+typedef struct
+{
+    dsmesock_connection_t *conn;
+    int64_t                next_send_ns;
+    GQueue                 pending;     /* send times of STATE_QUERYs */
+    int64_t               *latency;
+    size_t                 latency_count;
+    size_t                 latency_alloc;
+    client_result_t        result;
+} client_t;
+
+static mix_kind_t pick_kind(unsigned *seed)
+{
+    int total = 0;
+    for( int i = 0; i < MIX_COUNT; ++i )
+        total += cfg_mix[i];
+
+    int pick = total ? rand_r(seed) % total : 0;
+    for( int i = 0; i < MIX_COUNT; ++i ) {
+        if( pick < cfg_mix[i] )
+            return i;
+        pick -= cfg_mix[i];
+    }
+    return MIX_QUERY;
+}
+
+static bool client_send(client_t *client, mix_kind_t kind, unsigned *seed)
+{
+    int rc = -1;
+
+    switch( kind ) {
+    case MIX_QUERY: {
+        DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+        int64_t *t = g_new(int64_t, 1);
+        *t = now_ns();
+        g_queue_push_tail(&client->pending, t);
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    case MIX_CHARGER: {
+        DSM_MSGTYPE_SET_CHARGER_STATE msg =
+            DSME_MSG_INIT(DSM_MSGTYPE_SET_CHARGER_STATE);
+        msg.connected = rand_r(seed) & 1;
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    case MIX_BATTERY: {
+        DSM_MSGTYPE_SET_BATTERY_LEVEL msg =
+            DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_LEVEL);
+        msg.level = rand_r(seed) % (DSME_BATTERY_LEVEL_MAXIMUM + 1);
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    case MIX_ALARM: {
+        DSM_MSGTYPE_SET_ALARM_STATE msg =
+            DSME_MSG_INIT(DSM_MSGTYPE_SET_ALARM_STATE);
+        msg.alarm_set = rand_r(seed) & 1;
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    case MIX_THERMAL: {
+        DSM_MSGTYPE_SET_THERMAL_STATUS msg =
+            DSME_MSG_INIT(DSM_MSGTYPE_SET_THERMAL_STATUS);
+        msg.status      = DSM_THERMAL_STATUS_NORMAL;
+        msg.temperature = 30 + rand_r(seed) % 20;
+        snprintf(msg.sensor_name, sizeof msg.sensor_name, "loadgen%d",
+                 client->result.client);
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    case MIX_PONG:
+    default: {
+        DSM_MSGTYPE_PROCESSWD_PONG msg =
+            DSME_MSG_INIT(DSM_MSGTYPE_PROCESSWD_PONG);
+        msg.pid = getpid();
+        rc = dsmesock_send(client->conn, &msg);
+        break;
+    }
+    }
+
+    if( rc == -1 )
+        return false;
+    ++client->result.sent;
+    return true;
+}
+
+static bool client_receive(client_t *client)
+{
+    dsmemsg_generic_t *msg;
+    bool               alive = true;
+
+    while( alive && (msg = dsmesock_receive(client->conn)) ) {
+        DSM_MSGTYPE_PROCESSWD_PING *ping;
+
+        if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+            alive = false;
+        }
+        else if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_CHANGE_IND, msg) ) {
+            int64_t *t = g_queue_pop_head(&client->pending);
+            if( t ) {
+                if( client->latency_count == client->latency_alloc ) {
+                    client->latency_alloc = client->latency_alloc * 2 ?: 256;
+                    client->latency = realloc(client->latency,
+                                              client->latency_alloc *
+                                              sizeof *client->latency);
+                }
+                client->latency[client->latency_count++] = now_ns() - *t;
+                ++client->result.replies;
+                g_free(t);
+            }
+        }
+        else if( (ping = DSMEMSG_CAST(DSM_MSGTYPE_PROCESSWD_PING, msg)) ) {
+            DSM_MSGTYPE_PROCESSWD_PONG pong =
+                DSME_MSG_INIT(DSM_MSGTYPE_PROCESSWD_PONG);
+            pong.pid = ping->pid;
+            dsmesock_send(client->conn, &pong);
+        }
+        free(msg);
+    }
+    return alive;
+}
+
+static void client_summarize(client_t *client)
+{
+    client_result_t *res   = &client->result;
+    int64_t         *lat   = client->latency;
+    size_t           count = client->latency_count;
+    int64_t          sum   = 0;
+
+    if( !count )
+        return;
+
+    qsort(lat, count, sizeof *lat, compare_int64);
+    for( size_t i = 0; i < count; ++i )
+        sum += lat[i];
+    res->lat_mean_ns = sum / (int64_t)count;
+    res->lat_p50_ns  = percentile(lat, count, 500);
+    res->lat_p99_ns  = percentile(lat, count, 990);
+    res->lat_max_ns  = lat[count - 1];
+}
+
+/** Run a subset of clients; results are written to out_fd */
+static void worker_main(int first, int count, int start_fd, int out_fd)
+{
+    client_t      *client = calloc(count, sizeof *client);
+    struct pollfd *pfd    = calloc(count, sizeof *pfd);
+    unsigned       seed   = getpid();
+    int64_t        interval = cfg_burst * 1e9 / cfg_rate;
+    char           go;
+
+    /* Wait for the parent to close the start pipe, so that all
+     * workers begin connecting at the same time */
+    while( read(start_fd, &go, 1) == -1 && errno == EINTR )
+        ;
+    close(start_fd);
+
+    for( int i = 0; i < count; ++i ) {
+        client[i].result.client = first + i;
+        g_queue_init(&client[i].pending);
+
+        int64_t t0 = now_ns();
+        client[i].conn = dsmesock_connect();
+        client[i].result.connect_ns = now_ns() - t0;
+        client[i].result.connected  = client[i].conn != NULL;
+        if( !client[i].conn )
+            log_warning("client %d: connect failed: %m", first + i);
+
+        /* Spread the first sends over one interval */
+        client[i].next_send_ns = now_ns() + rand_r(&seed) % (interval + 1);
+    }
+
+    int64_t end = now_ns() + (int64_t)(cfg_duration * 1e9);
+    for( int64_t now; (now = now_ns()) < end; ) {
+        int64_t wake = end;
+
+        for( int i = 0; i < count; ++i ) {
+            client_t *c = &client[i];
+
+            pfd[i].fd      = c->conn ? c->conn->fd : -1;
+            pfd[i].events  = POLLIN;
+            pfd[i].revents = 0;
+            if( !c->conn )
+                continue;
+
+            if( c->next_send_ns <= now ) {
+                for( int b = 0; b < cfg_burst; ++b )
+                    client_send(c, pick_kind(&seed), &seed);
+                c->next_send_ns += interval;
+                if( c->next_send_ns < now )
+                    c->next_send_ns = now + interval;
+            }
+            if( wake > c->next_send_ns )
+                wake = c->next_send_ns;
+        }
+
+        int timeout = (int)((wake - now_ns()) / 1000000);
+        if( poll(pfd, count, timeout > 0 ? timeout : 0) == -1 &&
+            errno != EINTR )
+            break;
+
+        for( int i = 0; i < count; ++i ) {
+            if( !pfd[i].revents || !client[i].conn )
+                continue;
+            if( !client_receive(&client[i]) ) {
+                log_warning("client %d: disconnected", first + i);
+                dsmesock_close(client[i].conn);
+                client[i].conn = NULL;
+            }
+        }
+    }
+
+    for( int i = 0; i < count; ++i ) {
+        client_summarize(&client[i]);
+        if( !write_all(out_fd, &client[i].result, sizeof client[i].result) )
+            _exit(EXIT_FAILURE);
+        if( client[i].conn )
+            dsmesock_close(client[i].conn);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Reporting
+ * ------------------------------------------------------------------------- */
+
+static void report_distribution(const char *what, int64_t *values, size_t count)
+{
+    int64_t sum = 0;
+
+    if( !count ) {
+        printf("{\"loadgen\":\"%s\",\"samples\":0}\n", what);
+        return;
+    }
+
+    qsort(values, count, sizeof *values, compare_int64);
+    for( size_t i = 0; i < count; ++i )
+        sum += values[i];
+
+    printf("{\"loadgen\":\"%s\",\"samples\":%zu,\"mean_ns\":%lld,"
+           "\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,\"max_ns\":%lld}\n",
+           what, count, (long long)(sum / (int64_t)count),
+           (long long)percentile(values, count, 500),
+           (long long)percentile(values, count, 900),
+           (long long)percentile(values, count, 990),
+           (long long)values[count - 1]);
+}
+
+static void report(const client_result_t *res, int count)
+{
+    int64_t *connect = calloc(count, sizeof *connect);
+    int64_t *p50     = calloc(count, sizeof *p50);
+    int64_t *p99     = calloc(count, sizeof *p99);
+    size_t   nc = 0, nl = 0;
+    int64_t  sent = 0, replies = 0;
+
+    for( int i = 0; i < count; ++i ) {
+        if( res[i].connected )
+            connect[nc++] = res[i].connect_ns;
+        if( res[i].replies ) {
+            p50[nl]   = res[i].lat_p50_ns;
+            p99[nl++] = res[i].lat_p99_ns;
+        }
+        sent    += res[i].sent;
+        replies += res[i].replies;
+
+        if( cfg_per_client )
+            printf("{\"loadgen\":\"client\",\"client\":%d,\"connected\":%s,"
+                   "\"connect_ns\":%lld,\"sent\":%lld,\"replies\":%lld,"
+                   "\"mean_ns\":%lld,\"p50_ns\":%lld,\"p99_ns\":%lld,"
+                   "\"max_ns\":%lld}\n",
+                   res[i].client, res[i].connected ? "true" : "false",
+                   (long long)res[i].connect_ns, (long long)res[i].sent,
+                   (long long)res[i].replies, (long long)res[i].lat_mean_ns,
+                   (long long)res[i].lat_p50_ns, (long long)res[i].lat_p99_ns,
+                   (long long)res[i].lat_max_ns);
+    }
+
+    printf("{\"loadgen\":\"summary\",\"clients\":%d,\"connected\":%zu,"
+           "\"seconds\":%.3f,\"sent\":%lld,\"replies\":%lld,"
+           "\"msgs_per_sec\":%.0f}\n",
+           count, nc, cfg_duration, (long long)sent, (long long)replies,
+           sent / cfg_duration);
+    report_distribution("connect_time", connect, nc);
+    report_distribution("client_latency_p50", p50, nl);
+    report_distribution("client_latency_p99", p99, nl);
+
+    free(connect);
+    free(p50);
+    free(p99);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Load Generator Application
+ * ------------------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+    printf("Usage:\n"
+           "    %s [options]\n"
+           "\n"
+           "Connects many clients to dsme socket at once and sends a mix of\n"
+           "messages. Results are written to stdout as JSON objects, one per\n"
+           "line. The socket used is $DSME_SOCKFILE, or %s by default.\n"
+           "\n"
+           "Options:\n"
+           "  -h/--help             Print this help text\n"
+           "  -v/--verbose          Make output one step more verbose\n"
+           "  -q/--quiet            Make output one step less verbose\n"
+           "  -m/--mock             Run against a forked mock daemon\n"
+           "  -n/--clients=<n>      Number of clients (default: %d)\n"
+           "  -w/--workers=<n>      Number of worker processes (default: %d)\n"
+           "  -r/--rate=<hz>        Messages per second per client (default: %g)\n"
+           "  -b/--burst=<n>        Messages sent back to back (default: %d)\n"
+           "  -d/--duration=<s>     Test duration in seconds (default: %g)\n"
+           "  -x/--mix=<spec>       Message mix as kind=weight,... (default: query)\n"
+           "                        kinds: query charger battery alarm thermal pong\n"
+           "  -p/--per-client       Report results for each client\n"
+           "\n"
+           "Note: SET_* messages change device state when sent to a live dsme.\n"
+           "\n",
+           prog, dsmesock_default_location, cfg_clients, cfg_workers,
+           cfg_rate, cfg_burst, cfg_duration);
+}
+
+int main(int argc, char **argv)
+{
+    int exit_code = EXIT_FAILURE;
+    client_result_t *results = NULL;
+    int start_pipe[2] = { -1, -1 };
+    int result_pipe[2] = { -1, -1 };
+    pid_t *worker = NULL;
+
+    static const struct option optL[] = {
+        {"help",       no_argument,       0, 'h' },
+        {"verbose",    no_argument,       0, 'v' },
+        {"quiet",      no_argument,       0, 'q' },
+        {"mock",       no_argument,       0, 'm' },
+        {"clients",    required_argument, 0, 'n' },
+        {"workers",    required_argument, 0, 'w' },
+        {"rate",       required_argument, 0, 'r' },
+        {"burst",      required_argument, 0, 'b' },
+        {"duration",   required_argument, 0, 'd' },
+        {"mix",        required_argument, 0, 'x' },
+        {"per-client", no_argument,       0, 'p' },
+        {0,            0,                 0,  0  }
+    };
+    static const char optS[] = "hvqmn:w:r:b:d:x:p";
+
+    for( ;; ) {
+        int opt = getopt_long(argc, argv, optS, optL, 0);
+        if( opt == -1 )
+            break;
+
+        switch( opt ) {
+        case 'h': usage(*argv); exit(EXIT_SUCCESS);
+        case 'v': ++log_level; break;
+        case 'q': --log_level; break;
+        case 'm': cfg_mock = true; break;
+        case 'n': cfg_clients = atoi(optarg); break;
+        case 'w': cfg_workers = atoi(optarg); break;
+        case 'r': cfg_rate = strtod(optarg, 0); break;
+        case 'b': cfg_burst = atoi(optarg); break;
+        case 'd': cfg_duration = strtod(optarg, 0); break;
+        case 'x': if( !parse_mix(optarg) ) goto bailout; break;
+        case 'p': cfg_per_client = true; break;
+        case '?':
+            /* getopt has already written a diagnostic message */
+            goto bailout;
+        default:
+            fprintf(stderr, "Unhandled option %d '-%c'\n",
+                    opt, isalnum(opt) ? opt : '?');
+            goto bailout;
+        }
+    }
+
+    if( cfg_clients < 1 || cfg_workers < 1 || cfg_rate <= 0 ||
+        cfg_burst < 1 || cfg_duration <= 0 ) {
+        fprintf(stderr, "invalid arguments\n");
+        goto bailout;
+    }
+    if( cfg_workers > cfg_clients )
+        cfg_workers = cfg_clients;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Each client needs one descriptor in a worker, the mock daemon
+     * needs one per client too */
+    struct rlimit rl;
+    if( getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+        rl.rlim_cur < (rlim_t)cfg_clients + 64 ) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if( cfg_mock && !mock_daemon_start(mock_socket, daemon_reply_message) )
+        goto bailout;
+
+    if( pipe(start_pipe) == -1 || pipe(result_pipe) == -1 ) {
+        log_error("pipe() failed: %m");
+        goto bailout;
+    }
+
+    worker = calloc(cfg_workers, sizeof *worker);
+    for( int w = 0, first = 0; w < cfg_workers; ++w ) {
+        int count = cfg_clients / cfg_workers + (w < cfg_clients % cfg_workers);
+
+        if( (worker[w] = fork()) == -1 ) {
+            log_error("fork() failed: %m");
+            goto bailout;
+        }
+        if( worker[w] == 0 ) {
+            close(start_pipe[1]);
+            close(result_pipe[0]);
+            worker_main(first, count, start_pipe[0], result_pipe[1]);
+        }
+        first += count;
+    }
+    close(start_pipe[0]), start_pipe[0] = -1;
+    close(result_pipe[1]), result_pipe[1] = -1;
+
+    /* Release all workers at once */
+    close(start_pipe[1]), start_pipe[1] = -1;
+
+    results = calloc(cfg_clients, sizeof *results);
+    for( int i = 0; i < cfg_clients; ++i ) {
+        client_result_t res;
+        if( !read_all(result_pipe[0], &res, sizeof res) ) {
+            log_error("worker results missing");
+            goto bailout;
+        }
+        if( res.client >= 0 && res.client < cfg_clients )
+            results[res.client] = res;
+    }
+
+    report(results, cfg_clients);
+    exit_code = EXIT_SUCCESS;
+
+bailout:
+    if( worker ) {
+        for( int w = 0; w < cfg_workers; ++w ) {
+            if( worker[w] > 0 )
+                waitpid(worker[w], NULL, 0);
+        }
+        free(worker);
+    }
+    for( int i = 0; i < 2; ++i ) {
+        if( start_pipe[i] != -1 )
+            close(start_pipe[i]);
+        if( result_pipe[i] != -1 )
+            close(result_pipe[i]);
+    }
+    free(results);
+    mock_daemon_stop();
+    return exit_code;
+}
@@ -0,0 +1,312 @@
+/**
+   @file replay_libdsme.c
+
+   Replays dsme socket traffic recorded with dsmesock_capture_start().
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * some glibc versions seems to mistakenly define ucred behind __USE_GNU;
+ * work around by #defining _GNU_SOURCE
+ */
+#define _GNU_SOURCE
+
+#include "../include/dsme/capture.h"
+#include "../include/dsme/messages.h"
+#include "../include/dsme/protocol.h"
+
+#include "common.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <glib.h>
+
+/* ------------------------------------------------------------------------- *
+ * Configuration
+ * ------------------------------------------------------------------------- */
+
+static double                 cfg_speed     = 1.0;
+static dsmesock_capture_dir_t cfg_direction = DSMESOCK_CAPTURE_RX;
+static bool                   cfg_verbose   = false;
+
+/* ------------------------------------------------------------------------- *
+ * Replay Connections
+ * ------------------------------------------------------------------------- */
+
+/** Connections opened for captured connection serial numbers */
+static GHashTable *replay_lut = NULL;
+
+/** Descriptors of all replay connections, for draining replies */
+static struct pollfd         *replay_pfd  = NULL;
+static dsmesock_connection_t **replay_conn = NULL;
+static size_t                 replay_count = 0;
+
+static dsmesock_connection_t *replay_connection(uint32_t serial)
+{
+    dsmesock_connection_t *conn =
+        g_hash_table_lookup(replay_lut, GUINT_TO_POINTER(serial));
+
+    if( conn )
+        return conn;
+
+    if( !(conn = dsmesock_connect()) ) {
+        fprintf(stderr, "connection %u: connect failed: %m\n",
+                (unsigned)serial);
+        exit(EXIT_FAILURE);
+    }
+
+    replay_pfd  = realloc(replay_pfd, (replay_count + 1) * sizeof *replay_pfd);
+    replay_conn = realloc(replay_conn,
+                          (replay_count + 1) * sizeof *replay_conn);
+    replay_pfd[replay_count].fd     = conn->fd;
+    replay_pfd[replay_count].events = POLLIN;
+    replay_conn[replay_count]       = conn;
+    ++replay_count;
+
+    g_hash_table_insert(replay_lut, GUINT_TO_POINTER(serial), conn);
+    return conn;
+}
+
+/** Read and discard whatever the peer has sent, until timeout */
+static void replay_drain(int timeout_ms)
+{
+    do {
+        if( poll(replay_pfd, replay_count, timeout_ms) <= 0 )
+            break;
+
+        for( size_t i = 0; i < replay_count; ++i ) {
+            if( !replay_pfd[i].revents )
+                continue;
+
+            dsmemsg_generic_t *msg = dsmesock_receive(replay_conn[i]);
+            if( msg && DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) )
+                replay_pfd[i].fd = -1;
+            free(msg);
+        }
+        timeout_ms = 0;
+    } while( 1 );
+}
+
+/* ------------------------------------------------------------------------- *
+ * Replay Application
+ * ------------------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+    printf("Usage:\n"
+           "    %s [options] <capture-file>\n"
+           "\n"
+           "Sends frames from a capture file made with DSME_CAPTURE=<path>\n"
+           "to $DSME_SOCKFILE, or %s by default. Each captured connection\n"
+           "is replayed via a connection of its own.\n"
+           "\n"
+           "Options:\n"
+           "  -h/--help             Print this help text\n"
+           "  -v/--verbose          Print replayed frames\n"
+           "  -s/--speed=<factor>   Playback speed, 0 for no delays (default: %g)\n"
+           "  -d/--direction=<dir>  Frames to replay (default: rx)\n"
+           "                        rx: received, i.e. capture made by daemon\n"
+           "                        tx: sent, i.e. capture made by a client\n"
+           "\n",
+           prog, dsmesock_default_location, cfg_speed);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option optL[] = {
+        {"help",      no_argument,       0, 'h' },
+        {"verbose",   no_argument,       0, 'v' },
+        {"speed",     required_argument, 0, 's' },
+        {"direction", required_argument, 0, 'd' },
+        {0,           0,                 0,  0  }
+    };
+    static const char optS[] = "hvs:d:";
+
+    for( ;; ) {
+        int opt = getopt_long(argc, argv, optS, optL, 0);
+        if( opt == -1 )
+            break;
+
+        switch( opt ) {
+        case 'h':
+            usage(*argv);
+            exit(EXIT_SUCCESS);
+
+        case 'v':
+            cfg_verbose = true;
+            break;
+
+        case 's':
+            cfg_speed = strtod(optarg, 0);
+            break;
+
+        case 'd':
+            if( !strcmp(optarg, "rx") )
+                cfg_direction = DSMESOCK_CAPTURE_RX;
+            else if( !strcmp(optarg, "tx") )
+                cfg_direction = DSMESOCK_CAPTURE_TX;
+            else {
+                fprintf(stderr, "invalid direction: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case '?':
+            /* getopt has already written a diagnostic message */
+            exit(EXIT_FAILURE);
+
+        default:
+            fprintf(stderr, "Unhandled option %d '-%c'\n",
+                    opt, isalnum(opt) ? opt : '?');
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if( optind + 1 != argc || cfg_speed < 0 ) {
+        usage(*argv);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Map the capture file */
+    const char *path = argv[optind];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if( fd == -1 || fstat(fd, &st) == -1 ) {
+        fprintf(stderr, "%s: %m\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    const unsigned char *data = 0;
+    size_t size = st.st_size;
+    if( size > 0 ) {
+        data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if( data == MAP_FAILED ) {
+            fprintf(stderr, "%s: mmap: %m\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(fd);
+
+    replay_lut = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    /* Walk through the records */
+    int64_t  first_ns  = -1;
+    int64_t  last_ns   = 0;
+    int64_t  start_ns  = now_ns();
+    uint64_t frames    = 0;
+    uint64_t bytes     = 0;
+    size_t   offset    = 0;
+
+    while( offset + sizeof(DSM_MSGTYPE_CAPTURE_FRAME) <= size ) {
+        const DSM_MSGTYPE_CAPTURE_FRAME *rec =
+            (const DSM_MSGTYPE_CAPTURE_FRAME *)(data + offset);
+
+        if( rec->line_size_ == 0 )
+            break; /* unused tail of an unfinished capture */
+
+        if( !DSMEMSG_CAST(DSM_MSGTYPE_CAPTURE_FRAME, rec) ||
+            rec->line_size_ > size - offset ||
+            DSMEMSG_EXTRA_SIZE(rec) < sizeof(dsmemsg_generic_t) ) {
+            fprintf(stderr, "%s: offset %zu: invalid record\n", path, offset);
+            exit(EXIT_FAILURE);
+        }
+        offset += rec->line_size_;
+
+        const dsmemsg_generic_t *msg = DSMEMSG_EXTRA(rec);
+        if( msg->line_size_ > DSMEMSG_EXTRA_SIZE(rec) ||
+            msg->size_ < sizeof *msg || msg->size_ > msg->line_size_ ) {
+            fprintf(stderr, "%s: offset %zu: invalid frame\n", path, offset);
+            exit(EXIT_FAILURE);
+        }
+
+        if( rec->direction != cfg_direction )
+            continue;
+
+        /* Keep original pacing, scaled by speed factor */
+        if( first_ns < 0 )
+            first_ns = rec->timestamp_ns;
+        last_ns = rec->timestamp_ns;
+        if( cfg_speed > 0 ) {
+            int64_t due = start_ns +
+                (int64_t)((rec->timestamp_ns - first_ns) / cfg_speed);
+            int64_t now;
+            while( (now = now_ns()) < due )
+                replay_drain((int)((due - now + 999999) / 1000000));
+        }
+
+        dsmesock_connection_t *conn = replay_connection(rec->connection);
+
+        if( cfg_verbose )
+            printf("%u: %s %u bytes\n", (unsigned)rec->connection,
+                   dsmemsg_name(msg), (unsigned)msg->line_size_);
+
+        /* Header and body are sent as message, the rest as extra data */
+        dsmemsg_generic_t *body = malloc(msg->size_);
+        memcpy(body, msg, msg->size_);
+        body->line_size_ = msg->size_;
+        if( dsmesock_send_with_extra(conn, body,
+                                     msg->line_size_ - msg->size_,
+                                     (const char *)msg + msg->size_) == -1 )
+            fprintf(stderr, "connection %u: send failed: %m\n",
+                    (unsigned)rec->connection);
+        free(body);
+
+        ++frames;
+        bytes += msg->line_size_;
+        replay_drain(0);
+    }
+
+    double elapsed  = (now_ns() - start_ns) / 1e9;
+
+    /* Give the peer a moment to respond before disconnecting */
+    replay_drain(100);
+
+    double original = first_ns < 0 ? 0 : (last_ns - first_ns) / 1e9;
+    printf("{\"replay\":\"%s\",\"connections\":%zu,\"frames\":%llu,"
+           "\"bytes\":%llu,\"original_seconds\":%.3f,\"seconds\":%.3f,"
+           "\"frames_per_sec\":%.0f}\n",
+           cfg_direction == DSMESOCK_CAPTURE_RX ? "rx" : "tx",
+           replay_count, (unsigned long long)frames,
+           (unsigned long long)bytes, original, elapsed,
+           elapsed > 0 ? frames / elapsed : 0);
+
+    for( size_t i = 0; i < replay_count; ++i )
+        dsmesock_close(replay_conn[i]);
+    free(replay_conn);
+    free(replay_pfd);
+    g_hash_table_unref(replay_lut);
+    if( data )
+        munmap((void *)data, size);
+
+    return EXIT_SUCCESS;
+}
@@ -29,327 +29,2142 @@
  */
 #define _GNU_SOURCE
 
+#include "../include/dsme/alarm_limit.h"
+#include "../include/dsme/battery.h"
+#include "../include/dsme/capture.h"
+#include "../include/dsme/flightrec.h"
 #include "../include/dsme/messages.h"
+#include "../include/dsme/msgstats.h"
 #include "../include/dsme/protocol.h"
+#include "../include/dsme/server.h"
 #include "../include/dsme/state.h"
+#include "../include/dsme/statuspage.h"
+#include "../include/dsme/thermal.h"
+#include "../include/dsme/wakeup.h"
 
+#include "common.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <syslog.h>
 #include <ctype.h>
+#include <signal.h>
 #include <getopt.h>
 
 #include <check.h>
+#include <glib.h>
 
 /* ------------------------------------------------------------------------- *
- * Diagnostic Logging
+ * Mock Daemon
  * ------------------------------------------------------------------------- */
 
-static int log_level = LOG_WARNING;
-
-static const char * const log_tag[] = {
-    [LOG_EMERG]   = "X: ",
-    [LOG_ALERT]   = "A: ",
-    [LOG_CRIT]    = "C: ",
-    [LOG_ERR]     = "E: ",
-    [LOG_WARNING] = "W: ",
-    [LOG_NOTICE]  = "N: ",
-    [LOG_INFO]    = "I: ",
-    [LOG_DEBUG]   = "D: ",
-};
-
-static void log_emit_(const char *file, int line, const char *func,
-                      int level, const char *fmt, ...)
-{
-    int saved = errno;
-    char *msg = NULL;
-    va_list va;
-    va_start(va, fmt);
-    if( vasprintf(&msg, fmt, va) < 0 )
-        msg = NULL;
-    va_end(va);
-    fprintf(stderr, "%s:%d: %s: %s%s\n",
-            file, line, func,
-            log_tag[level], msg ?: fmt);
-    fflush(stderr);
+static const char mock_socket[] = "/tmp/ut_libdsme.sock";
+static const char mock_extra[] = "a-reason";
+
+static void daemon_handle_message(dsmesock_connection_t *connection,
+                                  const dsmemsg_generic_t *msg)
+{
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) ) {
+        /* Dummy query from test_send_receive() */
+        DSM_MSGTYPE_STATE_REQ_DENIED_IND reply =
+            DSME_MSG_INIT(DSM_MSGTYPE_STATE_REQ_DENIED_IND);
+        reply.state = DSME_STATE_TEST;
+        log_notice("MOCK: send(%s)",
+                   dsmemsg_name((dsmemsg_generic_t *)&reply));
+        dsmesock_send_with_extra(connection, &reply,
+                                 sizeof mock_extra, mock_extra);
+    }
+    else if( DSMEMSG_CAST(DSM_MSGTYPE_GET_STATUSPAGE, msg) ) {
+        /* Page with fixed values, for test_statuspage() */
+        dsme_statuspage_create();
+        dsme_statuspage_set_state(DSME_STATE_USER);
+        dsme_statuspage_set_battery_level(42);
+        dsme_statuspage_set_thermal("cpu", DSM_THERMAL_STATUS_OVERHEATED, 90);
+        log_notice("MOCK: send(STATUSPAGE)");
+        dsme_statuspage_send(connection);
+    }
+    else if( DSMEMSG_CAST(DSM_MSGTYPE_GET_VERSION, msg) ) {
+        /* Echo request extra data, for test_call_async() */
+        DSM_MSGTYPE_DSME_VERSION reply =
+            DSME_MSG_INIT(DSM_MSGTYPE_DSME_VERSION);
+        log_notice("MOCK: send(%s)",
+                   dsmemsg_name((dsmemsg_generic_t *)&reply));
+        dsmesock_send_with_extra(connection, &reply,
+                                 dsmemsg_extra_size(msg),
+                                 dsmemsg_extra_data(msg));
+    }
+}
+
+/* ------------------------------------------------------------------------- *
+ * Test Cases
+ * ------------------------------------------------------------------------- */
+
+START_TEST(test_message)
+{
+    const uint32_t id = 42;
+    const int extra = 0;
+
+    dsmemsg_generic_t *msg = dsmemsg_new(id, sizeof *msg, sizeof extra);
+
+    ck_assert(msg != NULL);
+    ck_assert_int_eq(id, dsmemsg_id(msg));
+    ck_assert_int_eq(dsmemsg_size(msg), sizeof *msg);
+    ck_assert_int_eq(dsmemsg_extra_size(msg), sizeof extra);
+    ck_assert_int_eq(dsmemsg_line_size(msg), sizeof *msg + sizeof extra);
+
     free(msg);
-    errno = saved;
 }
+END_TEST
 
-#define log_p(LEV) ((LEV)<=log_level)
+START_TEST(test_send_receive)
+{
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
 
-#define log_emit(LEV, FMT,ARGS...)\
-     do {\
-         if( log_p(LEV) )\
-             log_emit_(__FILE__, __LINE__, __func__, LEV, FMT, ##ARGS);\
-     } while( false )
+    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    log_notice("TEST: send(%s)", dsmemsg_name((dsmemsg_generic_t *)&msg));
+    dsmesock_broadcast(&msg);
 
-#define log_error(  FMT, ARGS...) log_emit(LOG_ERR,     FMT, ##ARGS)
-#define log_warning(FMT, ARGS...) log_emit(LOG_WARNING, FMT, ##ARGS)
-#define log_notice( FMT, ARGS...) log_emit(LOG_NOTICE,  FMT, ##ARGS)
-#define log_info(   FMT, ARGS...) log_emit(LOG_INFO,    FMT, ##ARGS)
-#define log_debug(  FMT, ARGS...) log_emit(LOG_DEBUG,   FMT, ##ARGS)
+    ck_assert(wait_input(connection->fd) == 1);
 
-/* ------------------------------------------------------------------------- *
- * Utilities
- * ------------------------------------------------------------------------- */
+    dsmemsg_generic_t *reply = dsmesock_receive(connection);
+    ck_assert(reply != NULL);
+    log_notice("TEST: recv(%s)", dsmemsg_name(reply));
+    ck_assert_int_eq(dsmemsg_id(reply),
+                     DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND));
+    ck_assert_int_eq(dsmemsg_extra_size(reply), sizeof mock_extra);
+    DSM_MSGTYPE_STATE_REQ_DENIED_IND *state_reply =
+        DSMEMSG_CAST(DSM_MSGTYPE_STATE_REQ_DENIED_IND, reply);
+    ck_assert(state_reply != NULL);
+    ck_assert_int_eq(state_reply->state, DSME_STATE_TEST);
+    const char *extra = DSMEMSG_EXTRA(state_reply);
+    ck_assert(extra != NULL);
+    size_t length = strnlen(extra, sizeof mock_extra);
+    ck_assert(length < sizeof mock_extra);
+    ck_assert(strcmp(extra, mock_extra) == 0);
 
-static int wait_input(int fd)
+    free(reply);
+
+    dsmesock_close(connection);
+}
+END_TEST
+
+static gpointer msgstats_thread(gpointer data)
 {
-    struct pollfd pfd = {
-        .fd = fd,
-        .events = POLLIN,
-    };
-    int rc = poll(&pfd, 1, 5000);
-    if( rc == 0 )
-        log_warning("wait_input() timeout");
-    else if( rc == -1 )
-        log_warning("wait_input() failed: %m");
-    return rc;
+    (void)data;
+
+    dsmemsg_stats_record(DSME_MSG_ID_(DSM_MSGTYPE_SAVE_DATA_IND),
+                         DSMEMSG_STATS_TX, 16, -1);
+    return NULL;
 }
 
-/* ------------------------------------------------------------------------- *
- * Mock Daemon
- * ------------------------------------------------------------------------- */
+START_TEST(test_msgstats)
+{
+    dsmemsg_stats_enable(true);
 
-static const char mock_socket[] = "/tmp/ut_libdsme.sock";
-static const char mock_extra[] = "a-reason";
+    /* Counters of exited threads are kept */
+    g_thread_join(g_thread_new("msgstats", msgstats_thread, NULL));
+
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
 
-static int daemon_fd = -1;
-static int daemon_pid = -1;
+    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert_int_eq(dsmesock_send(connection, &msg), sizeof msg);
+    ck_assert(wait_input(connection->fd) == 1);
+    free(dsmesock_receive(connection));
+    dsmesock_close(connection);
 
-static bool daemon_handle_message(dsmesock_connection_t *connection)
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    ck_assert(out != NULL);
+    dsmemsg_stats_dump(out);
+    fclose(out);
+    log_notice("TEST: stats\n%s", text);
+    ck_assert(strstr(text, "TX  STATE_QUERY") != NULL);
+    ck_assert(strstr(text, "RX  STATE_REQ_DENIED_IND") != NULL);
+    ck_assert(strstr(text, "TX  SAVE_DATA_IND") != NULL);
+    free(text);
+
+    dsmemsg_stats_enable(false);
+}
+END_TEST
+
+START_TEST(test_capture)
 {
-    bool stay_connected = true;
-    dsmemsg_generic_t *msg = dsmesock_receive(connection);
+    const char path[] = "/tmp/ut_libdsme.capture";
 
-    log_notice("MOCK: recv(%s)", dsmemsg_name(msg));
+    ck_assert(dsmesock_capture_start(path));
 
-    DSM_MSGTYPE_CLOSE *close_msg;
-    DSM_MSGTYPE_STATE_QUERY *state_query_msg;
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
 
-    if( !msg ) {
-        /* Allocation failure / similar
-         * Real daemon might retry later */
-        log_error("MOCK: null message received");
-        stay_connected = false;
-    }
-    else if( (close_msg = DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg)) ) {
-        /* Client disconnected */
-        stay_connected = false;
-    }
-    else if( (state_query_msg = DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg)) ) {
-        /* Dummy query from test_send_receive() */
-        DSM_MSGTYPE_STATE_REQ_DENIED_IND reply =
-            DSME_MSG_INIT(DSM_MSGTYPE_STATE_REQ_DENIED_IND);
-        reply.state = DSME_STATE_TEST;
-        log_notice("MOCK: send(%s)",
-                   dsmemsg_name((dsmemsg_generic_t *)&reply));
-        dsmesock_send_with_extra(connection, &reply,
-                                 sizeof mock_extra, mock_extra);
+    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert_int_eq(dsmesock_send(connection, &msg), sizeof msg);
+    ck_assert(wait_input(connection->fd) == 1);
+    free(dsmesock_receive(connection));
+    dsmesock_close(connection);
+
+    /* Frames that fail to go out are not captured */
+    int fd[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    connection = dsmesock_init(fd[0]);
+    close(fd[1]);
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    ck_assert_int_eq(dsmesock_send(connection, &msg), -1);
+    signal(SIGPIPE, old_handler);
+    dsmesock_close(connection);
+
+    dsmesock_capture_stop();
+
+    gchar *data = NULL;
+    gsize size = 0;
+    ck_assert(g_file_get_contents(path, &data, &size, NULL));
+    unlink(path);
+
+    /* Expect: sent query, received reply with extra data */
+    const DSM_MSGTYPE_CAPTURE_FRAME *rec[2];
+    size_t offset = 0;
+    for( int i = 0; i < 2; ++i ) {
+        ck_assert(offset + sizeof *rec[i] <= size);
+        rec[i] = DSMEMSG_CAST(DSM_MSGTYPE_CAPTURE_FRAME, data + offset);
+        ck_assert(rec[i] != NULL);
+        ck_assert_int_eq(rec[i]->line_size_ % 8, 0);
+        offset += rec[i]->line_size_;
     }
+    ck_assert_int_eq(offset, size);
+
+    const dsmemsg_generic_t *sent = DSMEMSG_EXTRA(rec[0]);
+    ck_assert_int_eq(rec[0]->direction, DSMESOCK_CAPTURE_TX);
+    ck_assert_int_eq(dsmemsg_id(sent), DSME_MSG_ID_(DSM_MSGTYPE_STATE_QUERY));
+
+    const dsmemsg_generic_t *received = DSMEMSG_EXTRA(rec[1]);
+    ck_assert_int_eq(rec[1]->direction, DSMESOCK_CAPTURE_RX);
+    ck_assert_int_eq(rec[1]->connection, rec[0]->connection);
+    ck_assert(rec[1]->timestamp_ns >= rec[0]->timestamp_ns);
+    ck_assert_int_eq(dsmemsg_id(received),
+                     DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND));
+    ck_assert(strcmp(dsmemsg_extra_data(received), mock_extra) == 0);
+
+    g_free(data);
+}
+END_TEST
+
+/** Check that the frame being handled is already recorded */
+static bool flightrec_handler(dsmesock_connection_t *connection,
+                              const dsmemsg_generic_t *msg, void *user_data)
+{
+    dsmesock_flightrec_entry_t last;
+    int *handled = user_data;
+
+    ck_assert_int_eq(dsmesock_flightrec_snapshot(&last, 1), 1);
+    ck_assert_int_eq(last.event, DSMESOCK_FLIGHTREC_RX);
+    ck_assert_int_eq(last.fd, connection->fd);
+    ck_assert_int_eq(last.id, msg->type_);
+    ++*handled;
+    return true;
+}
 
+START_TEST(test_flightrec)
+{
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+    int fd = connection->fd;
+
+    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert_int_eq(dsmesock_send(connection, &msg), sizeof msg);
+    ck_assert(wait_input(connection->fd) == 1);
+    free(dsmesock_receive(connection));
+    dsmesock_close(connection);
+
+    /* Last two events are the query and the reply */
+    dsmesock_flightrec_entry_t ent[DSMESOCK_FLIGHTREC_SIZE];
+    size_t count = dsmesock_flightrec_snapshot(ent, G_N_ELEMENTS(ent));
+    ck_assert(count >= 2);
+    ck_assert_int_eq(ent[count - 1].seq, ent[count - 2].seq + 1);
+
+    ck_assert_int_eq(ent[count - 2].event, DSMESOCK_FLIGHTREC_TX);
+    ck_assert_int_eq(ent[count - 2].fd, fd);
+    ck_assert_int_eq(ent[count - 2].id, DSME_MSG_ID_(DSM_MSGTYPE_STATE_QUERY));
+    ck_assert_int_eq(ent[count - 2].line_size, sizeof msg);
+
+    ck_assert_int_eq(ent[count - 1].event, DSMESOCK_FLIGHTREC_RX);
+    ck_assert_int_eq(ent[count - 1].fd, fd);
+    ck_assert_int_eq(ent[count - 1].id,
+                     DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND));
+    ck_assert_int_eq(ent[count - 1].line_size,
+                     ent[count - 1].size + sizeof mock_extra);
+
+    /* Requesting fewer entries gives the most recent ones */
+    dsmesock_flightrec_entry_t last;
+    ck_assert_int_eq(dsmesock_flightrec_snapshot(&last, 1), 1);
+    ck_assert_int_eq(last.seq, ent[count - 1].seq);
+
+    /* Text dump */
+    FILE *out = tmpfile();
+    ck_assert(out != NULL);
+    dsmesock_flightrec_dump(fileno(out));
+    rewind(out);
+    char text[64 * 1024];
+    size_t size = fread(text, 1, sizeof text - 1, out);
+    text[size] = 0;
+    fclose(out);
+    log_debug("TEST: flightrec\n%s", text);
+    ck_assert(strstr(text, "libdsme flight recorder") == text);
+    ck_assert(strstr(text, " TX ") != NULL);
+    ck_assert(strstr(text, " STATE_REQ_DENIED_IND\n") != NULL);
+
+    /* A frame is recorded before its handler runs, so that one whose
+     * handler never returns is in the ring */
+    int pair[2];
+    int handled = 0;
+    GMainContext *context = g_main_context_new();
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+    dsmesock_connection_t *tx = dsmesock_init(pair[0]);
+    dsmesock_connection_t *rx = dsmesock_init(pair[1]);
+    ck_assert(dsmesock_attach(rx, context, flightrec_handler, &handled));
+    ck_assert_int_eq(dsmesock_send(tx, &msg), sizeof msg);
+    for( int i = 0; i < 100 && !handled; ++i )
+        g_main_context_iteration(context, FALSE);
+    ck_assert_int_eq(handled, 1);
+    dsmesock_close(rx);
+
+    /* A failed send leaves no trace */
+    ck_assert_int_eq(dsmesock_flightrec_snapshot(&last, 1), 1);
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    ck_assert_int_eq(dsmesock_send(tx, &msg), -1);
+    signal(SIGPIPE, old_handler);
+    dsmesock_flightrec_entry_t after;
+    ck_assert_int_eq(dsmesock_flightrec_snapshot(&after, 1), 1);
+    ck_assert_int_eq(after.seq, last.seq);
+
+    dsmesock_close(tx);
+    g_main_context_unref(context);
+}
+END_TEST
+
+START_TEST(test_receive_timeout)
+{
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+
+    /* Nothing to receive */
+    int64_t start = now_ns();
+    errno = 0;
+    ck_assert(dsmesock_receive_timeout(connection, start + 20000000) == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert(now_ns() - start >= 20000000);
+
+    /* Wait for the second reply; the first one is set aside */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    DSM_MSGTYPE_GET_VERSION get = DSME_MSG_INIT(DSM_MSGTYPE_GET_VERSION);
+    ck_assert_int_eq(dsmesock_send(connection, &query), sizeof query);
+    ck_assert_int_eq(dsmesock_send(connection, &get), sizeof get);
+
+    int64_t deadline = now_ns() + 5000000000;
+    dsmemsg_generic_t *msg =
+        dsmesock_receive_id(connection,
+                            DSME_MSG_ID_(DSM_MSGTYPE_DSME_VERSION), deadline);
+    ck_assert(msg != NULL);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_DSME_VERSION, msg) != NULL);
+    free(msg);
+
+    msg = dsmesock_receive_timeout(connection, deadline);
+    ck_assert(msg != NULL);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_REQ_DENIED_IND, msg) != NULL);
     free(msg);
 
-    return stay_connected;
+    /* Already expired deadline does not block */
+    ck_assert(dsmesock_receive_id(connection,
+                                  DSME_MSG_ID_(DSM_MSGTYPE_DSME_VERSION),
+                                  0) == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+
+    dsmesock_close(connection);
 }
+END_TEST
+
+typedef struct {
+    int replies;
+    int closes;
+} attach_state_t;
 
-static bool daemon_handle_client(void)
+static bool attach_handler(dsmesock_connection_t *connection,
+                           const dsmemsg_generic_t *msg,
+                           void *user_data)
 {
-    bool client_handled = false;
-    int client_fd = -1;
-    dsmesock_connection_t *connection = NULL;
+    attach_state_t *state = user_data;
 
-    if( (client_fd = accept(daemon_fd, NULL, 0)) == -1 ) {
-        log_error("MOCK: accept() failed: %m");
-        goto bailout;
+    (void)connection;
+
+    log_notice("TEST: recv(%s)", dsmemsg_name(msg));
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+        ++state->closes;
+        return false;
     }
 
-    if( !(connection = dsmesock_init(client_fd)) ) {
-        log_error("MOCK: dsmesock_init() failed");
-        goto bailout;
+    ck_assert_int_eq(dsmemsg_id(msg),
+                     DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND));
+    ck_assert_int_eq(dsmemsg_extra_size(msg), sizeof mock_extra);
+    ck_assert(strcmp(dsmemsg_extra_data(msg), mock_extra) == 0);
+    ++state->replies;
+    return true;
+}
+
+START_TEST(test_attach)
+{
+    const int queries = 3;
+    attach_state_t state = { 0, 0 };
+    GMainContext *context = g_main_context_new();
+
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+    ck_assert(dsmesock_attach(connection, context, attach_handler, &state));
+    ck_assert(connection->channel != NULL);
+
+    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    for( int i = 0; i < queries; ++i )
+        ck_assert_int_eq(dsmesock_send(connection, &msg), sizeof msg);
+
+    /* All replies must arrive even if they are read in one go */
+    gint64 deadline = g_get_monotonic_time() + 5 * 1000 * 1000;
+    while( state.replies < queries && g_get_monotonic_time() < deadline )
+        g_main_context_iteration(context, TRUE);
+    ck_assert_int_eq(state.replies, queries);
+    ck_assert_int_eq(state.closes, 0);
+
+    dsmesock_stats_t stats;
+    ck_assert(dsmesock_get_stats(connection, &stats));
+    ck_assert_uint_eq(stats.msgs_out, queries);
+    ck_assert_uint_eq(stats.bytes_out, queries * sizeof msg);
+    ck_assert_uint_eq(stats.msgs_in, queries);
+    ck_assert_uint_ge(stats.syscalls, 1 + queries);
+
+    dsmesock_stats_t total;
+    dsmesock_get_total_stats(&total);
+    ck_assert_uint_ge(total.msgs_in, stats.msgs_in);
+
+    dsmesock_detach(connection);
+    ck_assert(connection->channel == NULL);
+    dsmesock_close(connection);
+    g_main_context_unref(context);
+}
+END_TEST
+
+typedef struct {
+    int      replies;
+    int      timeouts;
+    uint64_t tokens[4];
+    int      unsolicited;
+} call_state_t;
+
+static void call_reply_cb(dsmesock_connection_t *connection,
+                          const dsmemsg_generic_t *reply,
+                          void *user_data)
+{
+    call_state_t *state = user_data;
+
+    (void)connection;
+
+    if( !reply ) {
+        ++state->timeouts;
+        return;
     }
-    /* Ownership of client_fd has been transferred to connection */
-    client_fd = -1;
 
-    bool stay_connected = true;
-    while( stay_connected ) {
-        if( wait_input(connection->fd) != 1 ) {
-            log_error("MOCK: no data from client");
-            goto bailout;
-        }
+    log_notice("TEST: reply(%s)", dsmemsg_name(reply));
+    if( DSMEMSG_CAST(DSM_MSGTYPE_DSME_VERSION, reply) ) {
+        uint64_t token;
+        ck_assert_int_ge(dsmemsg_extra_size(reply), sizeof token);
+        memcpy(&token, dsmemsg_extra_data(reply), sizeof token);
+        state->tokens[state->replies] = token;
+    }
+    ++state->replies;
+}
+
+static bool call_handler(dsmesock_connection_t *connection,
+                         const dsmemsg_generic_t *msg,
+                         void *user_data)
+{
+    call_state_t *state = user_data;
+
+    (void)connection;
+
+    log_notice("TEST: recv(%s)", dsmemsg_name(msg));
+    if( !DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) )
+        ++state->unsolicited;
+    return true;
+}
+
+START_TEST(test_call_async)
+{
+    call_state_t state = { .replies = 0 };
+    GMainContext *context = g_main_context_new();
+    const uint32_t denied = DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND);
+    const uint32_t version = DSME_MSG_ID_(DSM_MSGTYPE_DSME_VERSION);
 
-        stay_connected = daemon_handle_message(connection);
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    DSM_MSGTYPE_GET_VERSION get = DSME_MSG_INIT(DSM_MSGTYPE_GET_VERSION);
+    DSM_MSGTYPE_SET_TA_TEST_MODE ignored =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_TA_TEST_MODE);
+
+    /* Calls need an attached connection */
+    ck_assert_int_eq(dsmesock_call_async(connection, &query, 0, NULL, denied,
+                                         0, -1, call_reply_cb, &state), 0);
+    ck_assert(dsmesock_attach(connection, context, call_handler, &state));
+
+    /* Pipelined calls, matched by type and by token */
+    ck_assert(dsmesock_call_async(connection, &query, 0, NULL, denied,
+                                  0, 5000, call_reply_cb, &state));
+    ck_assert(dsmesock_call_async(connection, &get, 0, NULL, version,
+                                  1111, 5000, call_reply_cb, &state));
+    ck_assert(dsmesock_call_async(connection, &get, 4, "abc", version,
+                                  2222, 5000, call_reply_cb, &state));
+
+    /* Reply to a cancelled call goes to the handler */
+    unsigned id = dsmesock_call_async(connection, &query, 0, NULL, denied,
+                                      0, 5000, call_reply_cb, &state);
+    ck_assert(id != 0);
+    ck_assert(dsmesock_call_cancel(connection, id));
+    ck_assert(!dsmesock_call_cancel(connection, id));
+
+    /* No reply for this one */
+    ck_assert(dsmesock_call_async(connection, &ignored, 0, NULL, version,
+                                  3333, 50, call_reply_cb, &state));
+
+    gint64 deadline = g_get_monotonic_time() + 5 * 1000 * 1000;
+    while( (state.replies < 3 || state.timeouts < 1 || state.unsolicited < 1) &&
+           g_get_monotonic_time() < deadline )
+        g_main_context_iteration(context, TRUE);
+
+    ck_assert_int_eq(state.replies, 3);
+    ck_assert_int_eq(state.timeouts, 1);
+    ck_assert_int_eq(state.unsolicited, 1);
+    ck_assert_uint_eq(state.tokens[1], 1111);
+    ck_assert_uint_eq(state.tokens[2], 2222);
+
+    /* Outstanding calls fail on detach */
+    ck_assert(dsmesock_call_async(connection, &ignored, 0, NULL, version,
+                                  0, -1, call_reply_cb, &state));
+    dsmesock_detach(connection);
+    ck_assert_int_eq(state.timeouts, 2);
+
+    dsmesock_close(connection);
+    g_main_context_unref(context);
+}
+END_TEST
+
+static bool limit_handler(dsmesock_connection_t *connection,
+                          const dsmemsg_generic_t *msg, void *user_data)
+{
+    int64_t *stamps = user_data;
+
+    (void)connection;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_REQ_DENIED_IND, msg) ) {
+        for( int i = 0; i < 3; ++i ) {
+            if( !stamps[i] ) {
+                stamps[i] = now_ns();
+                break;
+            }
+        }
     }
+    return true;
+}
 
-    client_handled = true;
+START_TEST(test_rate_limit)
+{
+    int64_t stamps[3] = { 0, 0, 0 };
+    GMainContext *context = g_main_context_new();
 
-bailout:
-    if( connection )
-        dsmesock_close(connection);
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+
+    /* One message per 100 ms */
+    dsmesock_set_rate_limit(connection, 1, 0, 100);
+    ck_assert(dsmesock_attach(connection, context, limit_handler, stamps));
+
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    for( int i = 0; i < 3; ++i )
+        ck_assert_int_eq(dsmesock_send(connection, &query), sizeof query);
 
-    if( client_fd != -1 )
-        close(client_fd);
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( !stamps[2] && now_ns() < deadline )
+        g_main_context_iteration(context, TRUE);
 
-    log_debug("MOCK: client handled = %d", client_handled);
+    ck_assert(stamps[2] != 0);
+    ck_assert(stamps[1] - stamps[0] >= INT64_C(50000000));
+    ck_assert(stamps[2] - stamps[1] >= INT64_C(50000000));
 
-    return client_handled;
+    dsmesock_stats_t stats;
+    ck_assert(dsmesock_get_stats(connection, &stats));
+    ck_assert(stats.throttles >= 2);
+    ck_assert(stats.throttled_ns > 0);
+
+    dsmesock_detach(connection);
+    dsmesock_close(connection);
+    g_main_context_unref(context);
 }
+END_TEST
 
-static void daemon_main(void)
+typedef struct
 {
-    log_debug("MOCK: daemon running");
-    for( ;; ) {
-        log_info("MOCK: waiting client...");
-        if( wait_input(daemon_fd) != 1 )
+    dsmesock_connection_t *quiet;
+    int                    chatty_msgs;
+    int                    chatty_before_quiet;
+} fairness_state_t;
+
+static bool fairness_handler(dsmesock_connection_t *connection,
+                             const dsmemsg_generic_t *msg, void *user_data)
+{
+    fairness_state_t *state = user_data;
+
+    if( !DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) )
+        return true;
+
+    if( connection != state->quiet )
+        ++state->chatty_msgs;
+    else if( state->chatty_before_quiet < 0 )
+        state->chatty_before_quiet = state->chatty_msgs;
+    return true;
+}
+
+START_TEST(test_dispatch_fairness)
+{
+    enum { CHATTY_MSGS = 200, QUANTUM = 4 };
+    fairness_state_t state = { .chatty_before_quiet = -1 };
+    GMainContext *context = g_main_context_new();
+    int chatty_fd[2], quiet_fd[2];
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, chatty_fd), 0);
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, quiet_fd), 0);
+
+    dsmesock_connection_t *chatty_tx = dsmesock_init(chatty_fd[0]);
+    dsmesock_connection_t *chatty_rx = dsmesock_init(chatty_fd[1]);
+    dsmesock_connection_t *quiet_tx  = dsmesock_init(quiet_fd[0]);
+    dsmesock_connection_t *quiet_rx  = dsmesock_init(quiet_fd[1]);
+    state.quiet = quiet_rx;
+
+    dsmesock_set_dispatch_quantum(QUANTUM, 0);
+    ck_assert(dsmesock_attach(chatty_rx, context, fairness_handler, &state));
+    ck_assert(dsmesock_attach(quiet_rx, context, fairness_handler, &state));
+
+    /* Bulk sender is ahead of the quiet one */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    for( int i = 0; i < CHATTY_MSGS; ++i )
+        ck_assert_int_eq(dsmesock_send(chatty_tx, &query), sizeof query);
+    ck_assert_int_eq(dsmesock_send(quiet_tx, &query), sizeof query);
+
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( (state.chatty_msgs < CHATTY_MSGS || state.chatty_before_quiet < 0) &&
+           now_ns() < deadline )
+        g_main_context_iteration(context, TRUE);
+
+    /* Quiet connection got its turn within the first rounds */
+    ck_assert_int_eq(state.chatty_msgs, CHATTY_MSGS);
+    ck_assert(state.chatty_before_quiet >= 0);
+    ck_assert(state.chatty_before_quiet <= 2 * QUANTUM);
+
+    dsmesock_stats_t stats;
+    ck_assert(dsmesock_get_stats(chatty_rx, &stats));
+    ck_assert(stats.yields >= CHATTY_MSGS / QUANTUM - 1);
+
+    dsmesock_set_dispatch_quantum(32, 16384);
+    dsmesock_close(quiet_rx);
+    dsmesock_close(quiet_tx);
+    dsmesock_close(chatty_rx);
+    dsmesock_close(chatty_tx);
+    g_main_context_unref(context);
+}
+END_TEST
+
+typedef struct
+{
+    int congested;
+    int relieved;
+} backlog_state_t;
+
+static void backlog_cb(dsmesock_connection_t *connection, bool congested,
+                       void *user_data)
+{
+    backlog_state_t *state = user_data;
+
+    (void)connection;
+
+    if( congested )
+        ++state->congested;
+    else
+        ++state->relieved;
+}
+
+START_TEST(test_backlog_limits)
+{
+    static char payload[4096];
+    backlog_state_t state = { 0, 0 };
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    dsmesock_backlog_limits_t limits = {
+        .high_bytes = 64 * 1024,
+        .low_bytes  = 0,
+    };
+    dsmesock_stats_t stats;
+    int fd[2];
+    int i;
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *connection = dsmesock_init(fd[0]);
+    ck_assert(dsmesock_set_backlog_limits(connection, &limits,
+                                          backlog_cb, &state));
+
+    /* Peer that does not read makes the connection congested */
+    for( i = 0; i < 1000 && !state.congested; ++i )
+        ck_assert(dsmesock_send_with_extra(connection, &query,
+                                           sizeof payload, payload) > 0);
+    ck_assert_int_eq(state.congested, 1);
+
+    /* ... and relieved once it has caught up */
+    char sink[8192];
+    while( recv(fd[1], sink, sizeof sink, MSG_DONTWAIT) > 0 )
+        ;
+    ck_assert_int_eq(dsmesock_send(connection, &query), sizeof query);
+    ck_assert_int_eq(state.relieved, 1);
+
+    /* With disconnect, congestion closes the connection */
+    limits.disconnect = true;
+    ck_assert(dsmesock_set_backlog_limits(connection, &limits,
+                                          backlog_cb, &state));
+    for( i = 0; i < 1000; ++i ) {
+        if( dsmesock_send_with_extra(connection, &query,
+                                     sizeof payload, payload) == -1 )
             break;
-        log_info("MOCK: handling client...");
-        if( !daemon_handle_client() )
+    }
+    ck_assert_int_eq(errno, EPIPE);
+    ck_assert_int_eq(state.congested, 2);
+    ck_assert_int_eq(dsmesock_send(connection, &query), -1);
+    ck_assert_int_eq(errno, ENOTCONN);
+
+    DSM_MSGTYPE_CLOSE *close_msg = dsmesock_receive(connection);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, close_msg) != NULL);
+    ck_assert_int_eq(close_msg->reason, TSMSG_CLOSE_REASON_SLOW);
+    free(close_msg);
+
+    ck_assert(dsmesock_get_stats(connection, &stats));
+    ck_assert_uint_eq(stats.congestions, 2);
+    ck_assert_uint_eq(stats.closes[TSMSG_CLOSE_REASON_SLOW], 1);
+
+    dsmesock_close(connection);
+    close(fd[1]);
+
+    /* Without limits of its own, a connection still does not queue
+     * output without bound */
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    connection = dsmesock_init(fd[0]);
+    for( i = 0; i < 1000; ++i ) {
+        if( dsmesock_send_with_extra(connection, &query,
+                                     sizeof payload, payload) == -1 )
             break;
     }
-    log_error("MOCK: daemon stopped");
+    ck_assert_int_lt(i, 1000);
+    ck_assert_int_eq(errno, EPIPE);
+    ck_assert(dsmesock_get_stats(connection, &stats));
+    ck_assert_uint_le(stats.queue_peak_bytes, 1024 * 1024 + sizeof payload +
+                      sizeof query);
+
+    dsmesock_close(connection);
+    close(fd[1]);
 }
+END_TEST
 
-static bool daemon_start(void)
+typedef struct
 {
-    bool success = false;
+    int    done;
+    size_t count;
+    int    acked;
+    int64_t latency_ns;
+} acked_state_t;
+
+static bool acked_handler(dsmesock_connection_t *connection,
+                          const dsmemsg_generic_t *msg, void *user_data)
+{
+    (void)connection;
+    (void)msg;
+    (void)user_data;
+    return true;
+}
 
-    if( unlink(mock_socket) == -1 && errno != ENOENT ) {
-        log_error("MOCK: unlink(%s) failed: %m", mock_socket);
-        goto bailout;
+static void acked_cb(const dsmesock_ack_result_t *results, size_t count,
+                     void *user_data)
+{
+    acked_state_t *state = user_data;
+
+    state->done  += 1;
+    state->count  = count;
+    state->acked  = 0;
+    state->latency_ns = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        ck_assert_int_eq(results[i].pid, getpid());
+        if( results[i].acked )
+            ++state->acked;
+        if( state->latency_ns < results[i].latency_ns )
+            state->latency_ns = results[i].latency_ns;
     }
+}
 
-    if( (daemon_fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1 ) {
-        log_error("MOCK: socket() failed: %m");
-        goto bailout;
+static void acked_run(GMainContext *context, acked_state_t *state)
+{
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( !state->done && now_ns() < deadline )
+        g_main_context_iteration(context, TRUE);
+}
+
+static dsmesock_connection_t *acked_silent = NULL;
+
+static bool acked_filter(dsmesock_connection_t *connection, void *user_data)
+{
+    (void)user_data;
+    return connection != acked_silent;
+}
+
+/** Read SAVE_DATA_IND on client side and acknowledge it */
+static void acked_client_ack(dsmesock_connection_t *client)
+{
+    DSM_MSGTYPE_SAVE_DATA_ACK ack = DSME_MSG_INIT(DSM_MSGTYPE_SAVE_DATA_ACK);
+    void *msg = dsmesock_receive_id(client,
+                                    DSME_MSG_ID_(DSM_MSGTYPE_SAVE_DATA_IND),
+                                    now_ns() + INT64_C(1000000000));
+
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_SAVE_DATA_IND, msg) != NULL);
+    free(msg);
+    ck_assert_int_eq(dsmesock_send(client, &ack), sizeof ack);
+}
+
+START_TEST(test_broadcast_acked)
+{
+    enum { CLIENTS = 3 };
+    const uint32_t ack_id = DSME_MSG_ID_(DSM_MSGTYPE_SAVE_DATA_ACK);
+    DSM_MSGTYPE_SAVE_DATA_IND ind = DSME_MSG_INIT(DSM_MSGTYPE_SAVE_DATA_IND);
+    GMainContext *context = g_main_context_new();
+    dsmesock_connection_t *client[CLIENTS];
+    dsmesock_connection_t *server[CLIENTS];
+    acked_state_t state = { 0 };
+
+    for( int i = 0; i < CLIENTS; ++i ) {
+        int fd[2];
+        ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+        client[i] = dsmesock_init(fd[0]);
+        server[i] = dsmesock_init(fd[1]);
+        ck_assert(dsmesock_attach(server[i], context, acked_handler, NULL));
     }
+    acked_silent = server[CLIENTS - 1];
+
+    /* Completes as soon as everyone has acknowledged */
+    ck_assert_uint_eq(dsmesock_broadcast_acked(&ind, 0, NULL, ack_id, 5000,
+                                               acked_filter, acked_cb,
+                                               &state), CLIENTS - 1);
+    for( int i = 0; i < CLIENTS - 1; ++i )
+        acked_client_ack(client[i]);
+    acked_run(context, &state);
+    ck_assert_int_eq(state.done, 1);
+    ck_assert_uint_eq(state.count, CLIENTS - 1);
+    ck_assert_int_eq(state.acked, CLIENTS - 1);
+    ck_assert(state.latency_ns < INT64_C(1000000000));
+
+    /* ... or when the rest have timed out */
+    memset(&state, 0, sizeof state);
+    ck_assert_uint_eq(dsmesock_broadcast_acked(&ind, 0, NULL, ack_id, 100,
+                                               NULL, acked_cb, &state),
+                      CLIENTS);
+    for( int i = 0; i < CLIENTS - 1; ++i )
+        acked_client_ack(client[i]);
+    acked_run(context, &state);
+    ck_assert_int_eq(state.done, 1);
+    ck_assert_uint_eq(state.count, CLIENTS);
+    ck_assert_int_eq(state.acked, CLIENTS - 1);
+    ck_assert(state.latency_ns >= INT64_C(100000000));
+
+    for( int i = 0; i < CLIENTS; ++i ) {
+        dsmesock_close(server[i]);
+        dsmesock_close(client[i]);
+    }
+    acked_silent = NULL;
+    g_main_context_unref(context);
+}
+END_TEST
 
-    struct sockaddr_un sa = {
-        .sun_family = AF_UNIX,
+START_TEST(test_statuspage)
+{
+    dsme_status_t status;
+    int fd[2];
+
+    /* Publisher in this process, page passed over a socket pair */
+    ck_assert(dsme_statuspage_create());
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *publisher  = dsmesock_init(fd[0]);
+    dsmesock_connection_t *subscriber = dsmesock_init(fd[1]);
+
+    /* Descriptors are dropped unless the receiver asks for them */
+    ck_assert_int_eq(dsme_statuspage_send(publisher), 0);
+    ck_assert(wait_input(subscriber->fd) == 1);
+    void *msg = dsmesock_receive(subscriber);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATUSPAGE, msg) != NULL);
+    free(msg);
+    ck_assert_int_eq(dsmesock_take_fd(subscriber), -1);
+
+    ck_assert_int_eq(dsmesock_set_fd_passing(subscriber, true), 0);
+    ck_assert_int_eq(dsme_statuspage_send(publisher), 0);
+    ck_assert(wait_input(subscriber->fd) == 1);
+    msg = dsmesock_receive(subscriber);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATUSPAGE, msg) != NULL);
+    free(msg);
+
+    int page_fd = dsmesock_take_fd(subscriber);
+    ck_assert(page_fd != -1);
+    ck_assert_int_eq(dsmesock_take_fd(subscriber), -1);
+    ck_assert_int_eq(fcntl(page_fd, F_GETFL) & O_ACCMODE, O_RDONLY);
+    void *writable = mmap(0, sizeof(dsme_statuspage_t), PROT_WRITE,
+                          MAP_SHARED, page_fd, 0);
+    ck_assert(writable == MAP_FAILED);
+    const dsme_statuspage_t *page = dsme_statuspage_map(page_fd);
+    close(page_fd);
+    ck_assert(page != NULL);
+
+    ck_assert(dsme_statuspage_read(page, &status));
+    ck_assert_int_eq(status.state, DSME_STATE_NOT_SET);
+    ck_assert_int_eq(status.battery_level, DSME_BATTERY_LEVEL_UNKNOWN);
+    ck_assert_int_eq(status.snooze_timeout, dsme_snooze_timeout_in_seconds());
+
+    /* Updates are visible without further messages */
+    dsme_statuspage_set_state(DSME_STATE_ACTDEAD);
+    dsme_statuspage_set_battery_level(DSME_BATTERY_LEVEL_MAXIMUM);
+    dsme_statuspage_set_charger(true);
+    dsme_statuspage_set_emergency_call(true);
+    ck_assert(dsme_statuspage_set_thermal("battery",
+                                          DSM_THERMAL_STATUS_LOWTEMP, -5));
+    ck_assert(dsme_statuspage_set_thermal("cpu",
+                                          DSM_THERMAL_STATUS_NORMAL, 40));
+    ck_assert(dsme_statuspage_set_thermal("battery",
+                                          DSM_THERMAL_STATUS_NORMAL, 20));
+
+    ck_assert(dsme_statuspage_read(page, &status));
+    ck_assert_int_eq(status.state, DSME_STATE_ACTDEAD);
+    ck_assert_int_eq(status.battery_level, DSME_BATTERY_LEVEL_MAXIMUM);
+    ck_assert(status.charger && status.emergency_call);
+    ck_assert_uint_eq(status.sensor_count, 2);
+    ck_assert_str_eq(status.sensors[0].name, "battery");
+    ck_assert_int_eq(status.sensors[0].status, DSM_THERMAL_STATUS_NORMAL);
+    ck_assert_int_eq(status.sensors[0].temperature, 20);
+    ck_assert_str_eq(status.sensors[1].name, "cpu");
+
+    dsme_statuspage_unmap(page);
+    dsme_statuspage_destroy();
+    dsmesock_close(subscriber);
+    dsmesock_close(publisher);
+
+    /* Page requested from the daemon */
+    dsmesock_connection_t *connection = dsmesock_connect();
+    ck_assert(connection != NULL);
+    page = dsme_statuspage_open(connection, 5000);
+    ck_assert(page != NULL);
+    ck_assert(dsme_statuspage_read(page, &status));
+    ck_assert_int_eq(status.state, DSME_STATE_USER);
+    ck_assert_int_eq(status.battery_level, 42);
+    ck_assert_uint_eq(status.sensor_count, 1);
+    ck_assert_int_eq(status.sensors[0].status, DSM_THERMAL_STATUS_OVERHEATED);
+    dsme_statuspage_unmap(page);
+    dsmesock_close(connection);
+
+    /* Page left in the middle of an update does not hang readers */
+    dsme_statuspage_t *stuck = calloc(1, sizeof *stuck);
+    ck_assert(stuck != NULL);
+    stuck->seq = 1;
+    ck_assert(!dsme_statuspage_read(stuck, &status));
+    ck_assert_int_eq(errno, EAGAIN);
+    free(stuck);
+}
+END_TEST
+
+START_TEST(test_thermal_registry)
+{
+    dsme_thermal_registry_t *tx = dsme_thermal_registry_new();
+    dsme_thermal_registry_t *rx = dsme_thermal_registry_new();
+    const dsme_thermal_sensor_t *sensor;
+    dsmemsg_generic_t *msg;
+    int fd[2];
+
+    ck_assert(sizeof(DSM_MSGTYPE_THERMAL_SENSOR_STATUS) <
+              sizeof(DSM_MSGTYPE_SET_THERMAL_STATUS));
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *publisher  = dsmesock_init(fd[0]);
+    dsmesock_connection_t *subscriber = dsmesock_init(fd[1]);
+
+    /* Names are announced once */
+    ck_assert_int_eq(dsme_thermal_send_status(publisher, tx, "cpu",
+                                              DSM_THERMAL_STATUS_NORMAL,
+                                              40), 0);
+    ck_assert_int_eq(dsme_thermal_send_status(publisher, tx, "battery",
+                                              DSM_THERMAL_STATUS_LOWTEMP,
+                                              -5), 0);
+    ck_assert_int_eq(dsme_thermal_send_status(publisher, tx, "cpu",
+                                              DSM_THERMAL_STATUS_OVERHEATED,
+                                              95), 0);
+
+    static const struct {
+        uint32_t    type;
+        const char *sensor;
+        int         temperature;
+    } expect[] = {
+        { DSME_MSG_ID_(DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE), NULL,      0 },
+        { DSME_MSG_ID_(DSM_MSGTYPE_THERMAL_SENSOR_STATUS),   "cpu",     40 },
+        { DSME_MSG_ID_(DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE), NULL,      0 },
+        { DSME_MSG_ID_(DSM_MSGTYPE_THERMAL_SENSOR_STATUS),   "battery", -5 },
+        { DSME_MSG_ID_(DSM_MSGTYPE_THERMAL_SENSOR_STATUS),   "cpu",     95 },
     };
-    strncat(sa.sun_path, mock_socket, sizeof sa.sun_path - 1);
-    if( bind(daemon_fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
-        log_error("MOCK: bind(%s) failed: %m", mock_socket);
-        goto bailout;
+    for( size_t i = 0; i < G_N_ELEMENTS(expect); ++i ) {
+        msg = dsmesock_receive_id(subscriber, expect[i].type,
+                                  now_ns() + INT64_C(1000000000));
+        ck_assert(msg != NULL);
+        ck_assert_uint_eq(dsmemsg_id(msg), expect[i].type);
+        sensor = dsme_thermal_registry_handle(rx, msg);
+        if( expect[i].sensor ) {
+            ck_assert(sensor != NULL);
+            ck_assert_str_eq(sensor->name, expect[i].sensor);
+            ck_assert_int_eq(sensor->temperature, expect[i].temperature);
+        }
+        else
+            ck_assert(sensor == NULL);
+        free(msg);
     }
 
-    if( chmod(mock_socket, 0666) == -1 ) {
-        log_error("MOCK: chmod(%s) failed: %m", mock_socket);
-        goto bailout;
+    sensor = dsme_thermal_registry_find(rx, "cpu");
+    ck_assert(sensor != NULL);
+    ck_assert(dsme_thermal_registry_sensor(rx, sensor->id) == sensor);
+    ck_assert_int_eq(sensor->status, DSM_THERMAL_STATUS_OVERHEATED);
+
+    /* Legacy messages update the same sensors */
+    DSM_MSGTYPE_SET_THERMAL_STATUS legacy =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_THERMAL_STATUS);
+    legacy.status      = DSM_THERMAL_STATUS_NORMAL;
+    legacy.temperature = 60;
+    strcpy(legacy.sensor_name, "cpu");
+    ck_assert(dsme_thermal_registry_handle(rx, (dsmemsg_generic_t *)&legacy)
+              == sensor);
+    ck_assert_int_eq(sensor->temperature, 60);
+
+    strcpy(legacy.sensor_name, "modem");
+    sensor = dsme_thermal_registry_handle(rx, (dsmemsg_generic_t *)&legacy);
+    ck_assert(sensor != NULL);
+    ck_assert_str_eq(sensor->name, "modem");
+    ck_assert(dsme_thermal_registry_find(rx, "battery") != NULL);
+
+    dsmesock_close(subscriber);
+    dsmesock_close(publisher);
+    dsme_thermal_registry_free(rx);
+    dsme_thermal_registry_free(tx);
+}
+END_TEST
+
+static unsigned thermal_published;
+static dsme_thermal_stats_t thermal_last;
+
+static void
+thermal_publish_cb(const char *sensor, const dsme_thermal_stats_t *stats,
+                   void *user_data)
+{
+    (void)sensor;
+    (void)user_data;
+
+    ++thermal_published;
+    thermal_last = *stats;
+}
+
+START_TEST(test_thermal_aggregator)
+{
+    static const dsme_thermal_aggregator_config_t config = {
+        .window_ms       = 10000,
+        .min_interval_ms = 1000,
+        .delta           = 2,
+    };
+    const int64_t ms = INT64_C(1000000);
+    dsme_thermal_aggregator_t *agg =
+        dsme_thermal_aggregator_new(&config, thermal_publish_cb, 0);
+    dsme_thermal_stats_t stats;
+
+    /* First sample, small change, large change too soon, then a large
+     * change after the interval and a status change before it */
+    ck_assert(dsme_thermal_aggregator_feed(agg, "cpu", DSM_THERMAL_STATUS_NORMAL,
+                                           40, 0));
+    ck_assert(!dsme_thermal_aggregator_feed(agg, "cpu", DSM_THERMAL_STATUS_NORMAL,
+                                            41, 500 * ms));
+    ck_assert(!dsme_thermal_aggregator_feed(agg, "cpu", DSM_THERMAL_STATUS_NORMAL,
+                                            43, 600 * ms));
+    ck_assert(dsme_thermal_aggregator_feed(agg, "cpu", DSM_THERMAL_STATUS_NORMAL,
+                                           43, 1200 * ms));
+    ck_assert(dsme_thermal_aggregator_feed(agg, "cpu", DSM_THERMAL_STATUS_OVERHEATED,
+                                           43, 1300 * ms));
+    ck_assert_uint_eq(thermal_published, 3);
+    ck_assert_int_eq(thermal_last.status, DSM_THERMAL_STATUS_OVERHEATED);
+    ck_assert_uint_eq(thermal_last.samples, 5);
+    ck_assert_int_eq(thermal_last.min, 40);
+    ck_assert_int_eq(thermal_last.max, 43);
+    ck_assert(thermal_last.mean > 41.99 && thermal_last.mean < 42.01);
+    ck_assert(thermal_last.slope > 0);
+
+    /* Linear rise of 2 degrees per second */
+    for( int i = 0; i < 4; ++i )
+        dsme_thermal_aggregator_feed(agg, "gpu", DSM_THERMAL_STATUS_NORMAL,
+                                     30 + 2 * i, i * 1000 * ms);
+    ck_assert_uint_eq(thermal_published, 7);
+    ck_assert(dsme_thermal_aggregator_stats(agg, "gpu", 3000 * ms, &stats));
+    ck_assert_uint_eq(stats.samples, 4);
+    ck_assert(stats.mean > 32.99 && stats.mean < 33.01);
+    ck_assert(stats.slope > 1.99 && stats.slope < 2.01);
+
+    /* Samples age out of the window */
+    ck_assert(dsme_thermal_aggregator_stats(agg, "gpu", 12500 * ms, &stats));
+    ck_assert_uint_eq(stats.samples, 1);
+    ck_assert_int_eq(stats.min, 36);
+    ck_assert(stats.slope == 0);
+    ck_assert(!dsme_thermal_aggregator_stats(agg, "modem", 0, &stats));
+
+    /* Ring keeps the latest samples only */
+    for( int i = 0; i < 2 * DSME_THERMAL_WINDOW_SAMPLES; ++i )
+        dsme_thermal_aggregator_feed(agg, "gpu", DSM_THERMAL_STATUS_NORMAL,
+                                     i, (4000 + i) * ms);
+    ck_assert(dsme_thermal_aggregator_stats(agg, "gpu", 5000 * ms, &stats));
+    ck_assert_uint_eq(stats.samples, DSME_THERMAL_WINDOW_SAMPLES);
+    ck_assert_int_eq(stats.min, DSME_THERMAL_WINDOW_SAMPLES);
+
+    dsme_thermal_aggregator_free(agg);
+}
+END_TEST
+
+START_TEST(test_battery_filter)
+{
+    static const dsme_battery_filter_config_t config = {
+        .hysteresis      = 3,
+        .min_interval_ms = 60000,
+        .low_level       = 10,
+    };
+    const int64_t s = INT64_C(1000000000);
+    dsme_battery_filter_t *filter = dsme_battery_filter_new(&config);
+
+    /* First level, jitter, then a change held back by the interval */
+    ck_assert(dsme_battery_filter_update(filter, 50, 0));
+    ck_assert(!dsme_battery_filter_update(filter, 49, 1 * s));
+    ck_assert(!dsme_battery_filter_update(filter, 51, 2 * s));
+    ck_assert_int_eq(dsme_battery_filter_due_ns(filter), 0);
+    ck_assert(!dsme_battery_filter_update(filter, 46, 3 * s));
+    ck_assert_int_eq(dsme_battery_filter_due_ns(filter), 60 * s);
+    ck_assert(dsme_battery_filter_update(filter, 46, 60 * s));
+    ck_assert_int_eq(dsme_battery_filter_level(filter), 46);
+    ck_assert_int_eq(dsme_battery_filter_due_ns(filter), 0);
+
+    /* Crossing the low level is passed on at once, both ways */
+    ck_assert(!dsme_battery_filter_update(filter, 12, 61 * s));
+    ck_assert(dsme_battery_filter_update(filter, 10, 62 * s));
+    ck_assert(!dsme_battery_filter_update(filter, 9, 63 * s));
+    ck_assert(dsme_battery_filter_update(filter, 11, 64 * s));
+
+    /* So are the ends of the range and unknown level */
+    ck_assert(dsme_battery_filter_update(filter, DSME_BATTERY_LEVEL_MINIMUM,
+                                         65 * s));
+    ck_assert(dsme_battery_filter_update(filter, DSME_BATTERY_LEVEL_UNKNOWN,
+                                         66 * s));
+    ck_assert(dsme_battery_filter_update(filter, 98, 67 * s));
+    ck_assert(dsme_battery_filter_update(filter, DSME_BATTERY_LEVEL_MAXIMUM,
+                                         68 * s));
+    ck_assert(!dsme_battery_filter_update(filter, DSME_BATTERY_LEVEL_MAXIMUM,
+                                          69 * s));
+
+    /* ... also when leaving them */
+    ck_assert(dsme_battery_filter_update(filter, 99, 70 * s));
+    ck_assert(dsme_battery_filter_update(filter, DSME_BATTERY_LEVEL_MINIMUM,
+                                         71 * s));
+    ck_assert(dsme_battery_filter_update(filter, 1, 72 * s));
+
+    /* Level that could not be sent is passed on again */
+    int fd[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *conn = dsmesock_init(fd[0]);
+    close(fd[1]);
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    ck_assert_int_eq(dsme_battery_filter_send(conn, filter,
+                                              DSME_BATTERY_LEVEL_MINIMUM), -1);
+    signal(SIGPIPE, old_handler);
+    ck_assert_int_eq(dsme_battery_filter_level(filter), 1);
+    dsmesock_close(conn);
+
+    dsme_battery_filter_free(filter);
+}
+END_TEST
+
+typedef struct
+{
+    unsigned runs;
+    bool     repeat;
+} wakeup_task_state_t;
+
+static bool
+wakeup_task_cb(void *user_data)
+{
+    wakeup_task_state_t *state = user_data;
+
+    ++state->runs;
+    return state->repeat;
+}
+
+START_TEST(test_wakeup_scheduler)
+{
+    GMainContext *context = g_main_context_new();
+    dsme_wakeup_scheduler_t *sched = dsme_wakeup_scheduler_new(context);
+    wakeup_task_state_t once   = { 0, false };
+    wakeup_task_state_t repeat = { 0, true };
+    wakeup_task_state_t local  = { 0, true };
+    dsmemsg_generic_t *msg;
+    DSM_MSGTYPE_WAKEUP_REQ *wait;
+    int fd[2];
+
+    ck_assert(sched != NULL);
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *client = dsmesock_init(fd[0]);
+    dsmesock_connection_t *daemon = dsmesock_init(fd[1]);
+    dsme_wakeup_scheduler_set_connection(sched, client);
+
+    /* Tasks added in one go are covered by one request */
+    ck_assert(dsme_wakeup_add(sched, 0, 5000, wakeup_task_cb, &once) != 0);
+    ck_assert(dsme_wakeup_add(sched, 0, 10000, wakeup_task_cb, &repeat) != 0);
+    while( g_main_context_iteration(context, FALSE) )
+        ;
+    msg = dsmesock_receive_id(daemon, DSME_MSG_ID_(DSM_MSGTYPE_WAKEUP_REQ),
+                              now_ns() + INT64_C(1000000000));
+    ck_assert((wait = DSMEMSG_CAST(DSM_MSGTYPE_WAKEUP_REQ, msg)) != NULL);
+    ck_assert_uint_eq(wait->mintime_ms, 0);
+    ck_assert(wait->maxtime_ms > 4000 && wait->maxtime_ms <= 5000);
+    free(msg);
+    ck_assert_int_lt(recv(fd[1], &(char){0}, 1, MSG_DONTWAIT), 0);
+
+    /* Wakeup runs both tasks and the next window is requested */
+    DSM_MSGTYPE_WAKEUP_IND wakeup = DSME_MSG_INIT(DSM_MSGTYPE_WAKEUP_IND);
+    ck_assert_int_eq(dsmesock_send(daemon, &wakeup), sizeof wakeup);
+    msg = dsmesock_receive_id(client, DSME_MSG_ID_(DSM_MSGTYPE_WAKEUP_IND),
+                              now_ns() + INT64_C(1000000000));
+    ck_assert(msg != NULL);
+    ck_assert(dsme_wakeup_handle(sched, msg));
+    free(msg);
+    ck_assert_uint_eq(once.runs, 1);
+    ck_assert_uint_eq(repeat.runs, 1);
+    while( g_main_context_iteration(context, FALSE) )
+        ;
+    msg = dsmesock_receive_id(daemon, DSME_MSG_ID_(DSM_MSGTYPE_WAKEUP_REQ),
+                              now_ns() + INT64_C(1000000000));
+    ck_assert((wait = DSMEMSG_CAST(DSM_MSGTYPE_WAKEUP_REQ, msg)) != NULL);
+    ck_assert(wait->maxtime_ms > 9000 && wait->maxtime_ms <= 10000);
+    free(msg);
+
+    /* The daemon's own wakeup messages are not taken for replies */
+    dsmemsg_generic_t daemon_wakeup = {
+        .line_size_ = sizeof daemon_wakeup,
+        .size_      = sizeof daemon_wakeup,
+        .type_      = 0x00000601,
+    };
+    ck_assert(!dsme_wakeup_handle(sched, &daemon_wakeup));
+    ck_assert_uint_eq(repeat.runs, 1);
+
+    /* Without the daemon the local timer takes over */
+    dsme_wakeup_scheduler_set_connection(sched, NULL);
+    dsmesock_close(daemon);
+    dsmesock_close(client);
+
+    int64_t start = now_ns();
+    ck_assert(dsme_wakeup_add(sched, 20, 50, wakeup_task_cb, &local) != 0);
+    while( local.runs == 0 &&
+           now_ns() - start < INT64_C(5000000000) )
+        g_main_context_iteration(context, TRUE);
+    ck_assert_uint_eq(local.runs, 1);
+    ck_assert(now_ns() - start >= INT64_C(20000000));
+    ck_assert_uint_eq(repeat.runs, 2);
+
+    dsme_wakeup_scheduler_free(sched);
+    g_main_context_unref(context);
+}
+END_TEST
+
+START_TEST(test_wakeup_coalescing)
+{
+    GMainContext *context = g_main_context_new();
+    dsme_wakeup_scheduler_t *sched = dsme_wakeup_scheduler_new(context);
+    wakeup_task_state_t first  = { 0, false };
+    wakeup_task_state_t second = { 0, false };
+    dsmemsg_generic_t *msg;
+    DSM_MSGTYPE_WAKEUP_REQ *wait;
+    int fd[2];
+
+    ck_assert(sched != NULL);
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *client = dsmesock_init(fd[0]);
+    dsmesock_connection_t *daemon = dsmesock_init(fd[1]);
+    dsme_wakeup_scheduler_set_connection(sched, client);
+
+    /* Overlapping windows: wake up where both are open */
+    int64_t start = now_ns();
+    ck_assert(dsme_wakeup_add(sched, 100, 500, wakeup_task_cb, &first) != 0);
+    ck_assert(dsme_wakeup_add(sched, 200, 800, wakeup_task_cb, &second) != 0);
+    while( g_main_context_iteration(context, FALSE) )
+        ;
+    msg = dsmesock_receive_id(daemon, DSME_MSG_ID_(DSM_MSGTYPE_WAKEUP_REQ),
+                              now_ns() + INT64_C(1000000000));
+    ck_assert((wait = DSMEMSG_CAST(DSM_MSGTYPE_WAKEUP_REQ, msg)) != NULL);
+    ck_assert(wait->mintime_ms > 150 && wait->mintime_ms <= 200);
+    ck_assert(wait->maxtime_ms > 400 && wait->maxtime_ms <= 500);
+    free(msg);
+
+    /* One wakeup within the window runs both */
+    while( now_ns() - start < INT64_C(210000000) )
+        usleep(10000);
+    DSM_MSGTYPE_WAKEUP_IND wakeup = DSME_MSG_INIT(DSM_MSGTYPE_WAKEUP_IND);
+    ck_assert(dsme_wakeup_handle(sched, &wakeup));
+    ck_assert_uint_eq(first.runs, 1);
+    ck_assert_uint_eq(second.runs, 1);
+
+    dsme_wakeup_scheduler_set_connection(sched, NULL);
+    dsmesock_close(daemon);
+    dsmesock_close(client);
+    dsme_wakeup_scheduler_free(sched);
+    g_main_context_unref(context);
+}
+END_TEST
+
+typedef struct
+{
+    int      next;
+    unsigned closes;
+} loopback_state_t;
+
+static bool
+loopback_handler(dsmesock_connection_t *conn, const dsmemsg_generic_t *msg,
+                 void *user_data)
+{
+    loopback_state_t *state = user_data;
+    const DSM_MSGTYPE_SET_BATTERY_LEVEL *level;
+
+    (void)conn;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) ) {
+        ++state->closes;
+        return false;
     }
+    ck_assert((level = DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, msg)) != NULL);
+    ck_assert_int_eq(level->level, state->next);
+    ++state->next;
+    return true;
+}
 
-    if( listen(daemon_fd, 5) == -1 ) {
-        log_error("MOCK: listen(%s) failed: %m", mock_socket);
-        goto bailout;
+START_TEST(test_loopback)
+{
+    const int frames = 200;
+    GMainContext *context = g_main_context_new();
+    dsmesock_connection_t *a, *b;
+    loopback_state_t state = { 0, 0 };
+    char payload[1000] = { 0 };
+    dsmesock_stats_t stats;
+    dsmemsg_generic_t *msg;
+
+    ck_assert(dsmesock_loopback_pair(&a, &b));
+    ck_assert_int_eq(a->ucred.pid, getpid());
+    ck_assert_int_eq(b->ucred.pid, getpid());
+
+    /* Simple exchange without a main loop */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert_int_eq(dsmesock_send(a, &query), sizeof query);
+    msg = dsmesock_receive_timeout(b, now_ns() + INT64_C(1000000000));
+    ck_assert(msg != NULL);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+    free(msg);
+
+    /* Descriptors travel with frames, if the receiver accepts them */
+    DSM_MSGTYPE_STATUSPAGE page = DSME_MSG_INIT(DSM_MSGTYPE_STATUSPAGE);
+    ck_assert_int_eq(dsmesock_send_with_fd(b, &page, STDIN_FILENO),
+                     sizeof page);
+    msg = dsmesock_receive_timeout(a, now_ns() + INT64_C(1000000000));
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATUSPAGE, msg) != NULL);
+    free(msg);
+    ck_assert_int_eq(dsmesock_take_fd(a), -1);
+
+    ck_assert_int_eq(dsmesock_set_fd_passing(a, true), 0);
+    ck_assert_int_eq(dsmesock_send_with_fd(b, &page, STDIN_FILENO),
+                     sizeof page);
+    msg = dsmesock_receive_timeout(a, now_ns() + INT64_C(1000000000));
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATUSPAGE, msg) != NULL);
+    free(msg);
+    int fd = dsmesock_take_fd(a);
+    ck_assert(fd != -1 && fd != STDIN_FILENO);
+    close(fd);
+
+    /* More than fits in the ring; the rest is queued and written out
+     * as the attached receiver makes room */
+    ck_assert(dsmesock_attach(a, context, loopback_handler, &state));
+    ck_assert(dsmesock_attach(b, context, loopback_handler, &state));
+    DSM_MSGTYPE_SET_BATTERY_LEVEL level =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_LEVEL);
+    for( int i = 0; i < frames; ++i ) {
+        level.level = i;
+        ck_assert_int_eq(dsmesock_send_with_extra(a, &level, sizeof payload,
+                                                  payload),
+                         sizeof level + sizeof payload);
     }
+    ck_assert(dsmesock_get_stats(a, &stats));
+    ck_assert(stats.queue_peak_frames > 0);
+
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( state.next < frames && now_ns() < deadline )
+        g_main_context_iteration(context, TRUE);
+    ck_assert_int_eq(state.next, frames);
+
+    /* Closing one side is seen as end of file on the other */
+    dsmesock_close(a);
+    deadline = now_ns() + INT64_C(5000000000);
+    while( state.closes == 0 && now_ns() < deadline )
+        g_main_context_iteration(context, TRUE);
+    ck_assert_uint_eq(state.closes, 1);
+    ck_assert(dsmesock_get_stats(b, &stats));
+    ck_assert_uint_eq(stats.closes[TSMSG_CLOSE_REASON_EOF], 1);
+
+    dsmesock_close(b);
+    g_main_context_unref(context);
+}
+END_TEST
 
-    if( (daemon_pid = fork()) == -1 ) {
-        log_error("MOCK: fork() failed: %m");
-        goto bailout;
+#define SENDQUEUE_THREADS 4
+#define SENDQUEUE_FRAMES  2000
+
+typedef struct
+{
+    dsmesock_sendqueue_t  *queue;
+    dsmesock_connection_t *conn;
+    int                    thread;
+} sendqueue_producer_t;
+
+static gpointer
+sendqueue_producer(gpointer data)
+{
+    sendqueue_producer_t *self = data;
+    DSM_MSGTYPE_SET_BATTERY_LEVEL msg =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_LEVEL);
+
+    for( int i = 0; i < SENDQUEUE_FRAMES; ++i ) {
+        msg.level = self->thread * SENDQUEUE_FRAMES + i;
+        ck_assert(dsmesock_sendqueue_submit(self->queue, self->conn, &msg,
+                                            sizeof self->thread,
+                                            &self->thread));
     }
+    return 0;
+}
 
-    if( daemon_pid == 0 ) {
-        /* Child proces = mock daemon */
-        daemon_main();
-        /* Expected: daemon process gets killed with SIGTERM
-         *           and control does not return here. */
-        _exit(EXIT_FAILURE);
+START_TEST(test_sendqueue)
+{
+    GMainContext *context = g_main_context_new();
+    dsmesock_sendqueue_t *queue = dsmesock_sendqueue_new(context);
+    sendqueue_producer_t producer[SENDQUEUE_THREADS];
+    GThread *thread[SENDQUEUE_THREADS];
+    int next[SENDQUEUE_THREADS] = { 0 };
+    int received = 0;
+    dsmesock_connection_t *a, *b;
+    dsmemsg_generic_t *msg;
+
+    ck_assert(queue != NULL);
+    ck_assert(dsmesock_loopback_pair(&a, &b));
+
+    for( int i = 0; i < SENDQUEUE_THREADS; ++i ) {
+        producer[i].queue  = queue;
+        producer[i].conn   = a;
+        producer[i].thread = i;
+        thread[i] = g_thread_new("producer", sendqueue_producer, &producer[i]);
     }
 
-    success = true;
+    /* Frames of each thread arrive in submission order */
+    int64_t deadline = now_ns() + INT64_C(10000000000);
+    while( received < SENDQUEUE_THREADS * SENDQUEUE_FRAMES &&
+           now_ns() < deadline ) {
+        g_main_context_iteration(context, FALSE);
+        while( (msg = dsmesock_receive(b)) != NULL ) {
+            const DSM_MSGTYPE_SET_BATTERY_LEVEL *level =
+                DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, msg);
+            ck_assert(level != NULL);
+            ck_assert_uint_eq(dsmemsg_extra_size(msg), sizeof(int));
+            int t = *(const int *)dsmemsg_extra_data(msg);
+            ck_assert(t >= 0 && t < SENDQUEUE_THREADS);
+            ck_assert_int_eq(level->level, t * SENDQUEUE_FRAMES + next[t]);
+            ++next[t];
+            ++received;
+            free(msg);
+        }
+    }
+    for( int i = 0; i < SENDQUEUE_THREADS; ++i )
+        g_thread_join(thread[i]);
+    ck_assert_int_eq(received, SENDQUEUE_THREADS * SENDQUEUE_FRAMES);
+
+    /* Frames for connections closed in the meantime are dropped */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert(dsmesock_sendqueue_submit(queue, a, &query, 0, 0));
+    dsmesock_close(a);
+    while( g_main_context_iteration(context, FALSE) )
+        ;
+    msg = dsmesock_receive(b);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) != NULL);
+    free(msg);
 
-bailout:
-    return success;
+    /* Unsent frames are released with the queue */
+    ck_assert(dsmesock_sendqueue_submit(queue, b, &query, 0, 0));
+    dsmesock_sendqueue_free(queue);
+    dsmesock_close(b);
+    g_main_context_unref(context);
+}
+END_TEST
+
+/* ------------------------------------------------------------------------- *
+ * Server workers
+ * ------------------------------------------------------------------------- */
+
+#define SERVER_WORKERS 3
+#define SERVER_CLIENTS 6
+#define SERVER_FRAMES  200
+
+static GThread *server_test_thread;
+
+static bool server_echo(dsmesock_connection_t *conn,
+                        const dsmemsg_generic_t *msg, void *user_data)
+{
+    (void)user_data;
+
+    /* Handlers run in worker threads only */
+    if( g_thread_self() == server_test_thread )
+        return false;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, msg) )
+        dsmesock_send(conn, msg);
+    return true;
 }
 
-static void daemon_stop(void)
+static unsigned server_total_load(const dsmesock_server_t *server)
 {
-    if( unlink(mock_socket) == -1 && errno != ENOENT )
-        log_warning("MOCK: unlink(%s) failed: %m", mock_socket);
+    unsigned total = 0;
 
-    if( daemon_pid != -1 ) {
-        if( kill(daemon_pid, SIGTERM) == -1 )
-            log_warning("MOCK: daemon terminate failed: %m");
+    for( unsigned i = 0; i < dsmesock_server_workers(server); ++i )
+        total += dsmesock_server_load(server, i);
+    return total;
+}
 
-        int status = 0;
-        int options = 0;
-        if( waitpid(daemon_pid, &status, options) == -1 )
-            log_warning("MOCK: daemon wait failed: %m");
-        else if( WIFEXITED(status) )
-            log_warning("MOCK: daemon terminated by exit(%d)",
-                        WEXITSTATUS(status));
-        else if( WIFSIGNALED(status) )
-            log_debug("MOCK: daemon terminated by signal(%s)",
-                      strsignal(WTERMSIG(status)));
-        else
-            log_warning("MOCK: daemon not terminated?");
-        daemon_pid = -1;
+static bool server_wait_load(const dsmesock_server_t *server, unsigned load)
+{
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+
+    while( server_total_load(server) != load ) {
+        if( now_ns() > deadline )
+            return false;
+        usleep(1000);
     }
+    return true;
+}
 
-    if( daemon_fd != -1 ) {
-        close(daemon_fd);
-        daemon_fd = -1;
+START_TEST(test_server)
+{
+    char path[64];
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    dsmesock_server_config_t config = {
+        .workers = SERVER_WORKERS,
+        .balance = DSMESOCK_SERVER_LEAST_LOADED,
+        .handler = server_echo,
+    };
+    dsmesock_connection_t *client[SERVER_CLIENTS];
+    dsmesock_server_t *server;
+    dsmemsg_generic_t *msg;
+    dsmesock_stats_t before, after;
+    int listen_fd, fd;
+
+    server_test_thread = g_thread_self();
+    dsmesock_get_total_stats(&before);
+
+    snprintf(path, sizeof path, "/tmp/ut_libdsme-server-%d", (int)getpid());
+    unlink(path);
+    strncat(sa.sun_path, path, sizeof sa.sun_path - 1);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ck_assert_int_ne(listen_fd, -1);
+    ck_assert_int_eq(bind(listen_fd, (struct sockaddr *)&sa, sizeof sa), 0);
+    ck_assert_int_eq(listen(listen_fd, SERVER_CLIENTS), 0);
+
+    server = dsmesock_server_start(listen_fd, &config);
+    ck_assert(server != NULL);
+    ck_assert_uint_eq(dsmesock_server_workers(server), SERVER_WORKERS);
+
+    /* Clients are spread evenly over the workers */
+    for( int i = 0; i < SERVER_CLIENTS; ++i ) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ck_assert_int_eq(connect(fd, (struct sockaddr *)&sa, sizeof sa), 0);
+        client[i] = dsmesock_init(fd);
+        ck_assert(client[i] != NULL);
+        ck_assert(server_wait_load(server, i + 1));
+    }
+    for( unsigned i = 0; i < SERVER_WORKERS; ++i )
+        ck_assert_uint_eq(dsmesock_server_load(server, i),
+                          SERVER_CLIENTS / SERVER_WORKERS);
+
+    /* Each client gets its frames back in order */
+    DSM_MSGTYPE_SET_BATTERY_LEVEL level =
+        DSME_MSG_INIT(DSM_MSGTYPE_SET_BATTERY_LEVEL);
+    for( int n = 0; n < SERVER_FRAMES; ++n ) {
+        for( int i = 0; i < SERVER_CLIENTS; ++i ) {
+            level.level = i * SERVER_FRAMES + n;
+            ck_assert_int_eq(dsmesock_send(client[i], &level), sizeof level);
+        }
+    }
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    for( int i = 0; i < SERVER_CLIENTS; ++i ) {
+        for( int n = 0; n < SERVER_FRAMES; ++n ) {
+            msg = dsmesock_receive_timeout(client[i], deadline);
+            const DSM_MSGTYPE_SET_BATTERY_LEVEL *echo =
+                DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, msg);
+            ck_assert(echo != NULL);
+            ck_assert_int_eq(echo->level, i * SERVER_FRAMES + n);
+            free(msg);
+        }
     }
+
+    /* Totals include traffic of connections the workers still have
+     * open; a worker counts a frame once its handler has returned */
+    uint64_t expect = before.msgs_in + 2 * SERVER_CLIENTS * SERVER_FRAMES;
+    for( ;; ) {
+        dsmesock_get_total_stats(&after);
+        if( after.msgs_in >= expect || now_ns() >= deadline )
+            break;
+        usleep(1000);
+    }
+    ck_assert_uint_ge(after.msgs_in, expect);
+
+    /* Broadcasts reach the clients of every worker */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    ck_assert(dsmesock_server_broadcast(server, &query, 0, 0));
+    for( int i = 0; i < SERVER_CLIENTS; ++i ) {
+        msg = dsmesock_receive_timeout(client[i], deadline);
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+        free(msg);
+    }
+
+    /* Workers release connections closed by clients */
+    for( int i = 0; i < SERVER_CLIENTS / 2; ++i )
+        dsmesock_close(client[i]);
+    ck_assert(server_wait_load(server, SERVER_CLIENTS - SERVER_CLIENTS / 2));
+
+    /* The rest are closed when the server stops */
+    dsmesock_server_stop(server);
+    for( int i = SERVER_CLIENTS / 2; i < SERVER_CLIENTS; ++i ) {
+        msg = dsmesock_receive_timeout(client[i], deadline);
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg) != NULL);
+        free(msg);
+        dsmesock_close(client[i]);
+    }
+    close(listen_fd);
+    unlink(path);
+
+    /* Totals include what the workers received */
+    dsmesock_get_total_stats(&after);
+    ck_assert_uint_ge(after.msgs_in - before.msgs_in,
+                      2 * SERVER_CLIENTS * SERVER_FRAMES + SERVER_CLIENTS);
 }
+END_TEST
 
 /* ------------------------------------------------------------------------- *
- * Test Cases
+ * Connection slots
  * ------------------------------------------------------------------------- */
 
-START_TEST(test_message)
+#define SLOT_PAIRS 60
+
+START_TEST(test_connection_slots)
 {
-    const uint32_t id = 42;
-    const int extra = 0;
+    dsmesock_connection_t *a[SLOT_PAIRS], *b[SLOT_PAIRS];
+    dsmesock_stats_t stats;
+    dsmemsg_generic_t *msg;
+
+    /* Enough connections to need several slabs */
+    for( int i = 0; i < SLOT_PAIRS; ++i )
+        ck_assert(dsmesock_loopback_pair(&a[i], &b[i]));
+
+    /* Broadcasts reach each of them once */
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    dsmesock_broadcast(&query);
+    int64_t deadline = now_ns() + INT64_C(1000000000);
+    for( int i = 0; i < SLOT_PAIRS; ++i ) {
+        msg = dsmesock_receive_timeout(a[i], deadline);
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+        free(msg);
+        msg = dsmesock_receive_timeout(b[i], deadline);
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+        free(msg);
+        ck_assert(dsmesock_get_stats(a[i], &stats));
+        ck_assert_uint_eq(stats.msgs_in, 1);
+    }
 
-    dsmemsg_generic_t *msg = dsmemsg_new(id, sizeof *msg, sizeof extra);
+    /* Closed handles are rejected until their slots are reused */
+    dsmesock_connection_t *stale = a[0];
+    dsmesock_close(a[0]);
+    ck_assert(!dsmesock_get_stats(stale, &stats));
+    ck_assert(dsmesock_getucred(stale) == NULL);
+    ck_assert_int_eq(dsmesock_send(stale, &query), -1);
+    ck_assert_int_eq(errno, ENOTCONN);
+    dsmesock_close(stale);
+
+    dsmesock_close(b[0]);
+    ck_assert(dsmesock_loopback_pair(&a[0], &b[0]));
+    ck_assert(a[0] == stale || b[0] == stale);
+    ck_assert_int_eq(dsmesock_send(a[0], &query), sizeof query);
+    msg = dsmesock_receive_timeout(b[0], deadline);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+    free(msg);
 
-    ck_assert(msg != NULL);
-    ck_assert_int_eq(id, dsmemsg_id(msg));
-    ck_assert_int_eq(dsmemsg_size(msg), sizeof *msg);
-    ck_assert_int_eq(dsmemsg_extra_size(msg), sizeof extra);
-    ck_assert_int_eq(dsmemsg_line_size(msg), sizeof *msg + sizeof extra);
+    for( int i = 0; i < SLOT_PAIRS; ++i ) {
+        dsmesock_close(a[i]);
+        dsmesock_close(b[i]);
+    }
+}
+END_TEST
 
-    free(msg);
+/* ------------------------------------------------------------------------- *
+ * Receive buffer sizing
+ * ------------------------------------------------------------------------- */
+
+#define RXSIZE_FRAMES 20
+#define RXSIZE_EXTRA  20000
+
+static bool rxsize_handler(dsmesock_connection_t *conn,
+                           const dsmemsg_generic_t *msg, void *user_data)
+{
+    (void)conn;
+
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) )
+        ++*(int *)user_data;
+    return true;
+}
+
+START_TEST(test_receive_buffer_sizing)
+{
+    static char payload[RXSIZE_EXTRA];
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    GMainContext *context = g_main_context_new();
+    dsmesock_stats_t stats;
+    dsmemsg_generic_t *msg;
+    int received = 0;
+    int fd[2];
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *tx = dsmesock_init(fd[0]);
+    dsmesock_connection_t *rx = dsmesock_init(fd[1]);
+
+    /* Once large frames have been seen, buffers start out large
+     * enough and need no resizing */
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    for( int i = 0; i < RXSIZE_FRAMES; ++i ) {
+        ck_assert(dsmesock_send_with_extra(tx, &query, sizeof payload,
+                                           payload) > 0);
+        msg = dsmesock_receive_timeout(rx, deadline);
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+        ck_assert_uint_eq(dsmemsg_extra_size(msg), sizeof payload);
+        free(msg);
+    }
+    ck_assert(dsmesock_get_stats(rx, &stats));
+    ck_assert_uint_eq(stats.buffer_allocs, RXSIZE_FRAMES + 1);
+
+    /* Attached connections keep a large buffer while large frames
+     * keep coming ... */
+    ck_assert(dsmesock_attach(rx, context, rxsize_handler, &received));
+    for( int i = 0; i < RXSIZE_FRAMES; ++i ) {
+        ck_assert(dsmesock_send_with_extra(tx, &query, sizeof payload,
+                                           payload) > 0);
+        while( received <= i && now_ns() < deadline )
+            g_main_context_iteration(context, FALSE);
+    }
+    ck_assert_int_eq(received, RXSIZE_FRAMES);
+    ck_assert(rx->bufsize >= RXSIZE_EXTRA);
+
+    /* ... and give it back once they stop */
+    for( int i = 0; i < 4 * RXSIZE_FRAMES; ++i ) {
+        ck_assert_int_eq(dsmesock_send(tx, &query), sizeof query);
+        while( received <= RXSIZE_FRAMES + i && now_ns() < deadline )
+            g_main_context_iteration(context, FALSE);
+    }
+    ck_assert_int_eq(received, 5 * RXSIZE_FRAMES);
+    ck_assert(rx->bufsize < 4096);
+
+    dsmesock_close(tx);
+    dsmesock_close(rx);
+    g_main_context_unref(context);
 }
 END_TEST
 
-START_TEST(test_send_receive)
+/* ------------------------------------------------------------------------- *
+ * Message arena
+ * ------------------------------------------------------------------------- */
+
+#define ARENA_FRAMES 100
+#define ARENA_EXTRA  1001
+
+START_TEST(test_message_arena)
 {
-    dsmesock_connection_t *connection = dsmesock_connect();
+    unsigned char space[64] __attribute__((aligned(8)));
+    dsmemsg_arena_t arena;
+    const dsmemsg_generic_t *msg;
+    dsmemsg_generic_t *recvd;
+    dsmesock_stats_t stats;
+
+    /* Frames are laid out in order in the given buffer, each starting
+     * at a multiple of eight */
+    dsmemsg_arena_init(&arena, space, sizeof space);
+    DSM_MSGTYPE_SET_BATTERY_LEVEL *level =
+        DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_SET_BATTERY_LEVEL, 3);
+    ck_assert((void *)level == (void *)space);
+    level->level = 42;
+    char *text = DSMEMSG_EXTRA(level);
+    ck_assert(text == (char *)(level + 1));
+    memcpy(text, "ab", 3);
+    DSM_MSGTYPE_STATE_QUERY *query =
+        DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_STATE_QUERY, 0);
+    ck_assert((unsigned char *)query ==
+              space + ((sizeof *level + 3 + 7) & ~(size_t)7));
+    ck_assert_uint_eq(arena.used, (unsigned char *)(query + 1) - space);
+
+    msg = dsmemsg_arena_next(&arena, 0);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, msg) == level);
+    ck_assert_uint_eq(dsmemsg_extra_size(msg), 3);
+    ck_assert_str_eq(dsmemsg_extra_data(msg), "ab");
+    msg = dsmemsg_arena_next(&arena, msg);
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) == query);
+    ck_assert(dsmemsg_arena_next(&arena, msg) == NULL);
+
+    /* A caller supplied buffer does not grow */
+    ck_assert(DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_STATE_QUERY,
+                               sizeof space) == NULL);
+    ck_assert_int_eq(errno, ENOBUFS);
+    dsmemsg_arena_reset(&arena);
+    ck_assert(dsmemsg_arena_next(&arena, 0) == NULL);
+
+    /* An allocated buffer grows as needed and is kept over resets */
+    dsmemsg_arena_init(&arena, 0, 0);
+    for( int i = 0; i < ARENA_FRAMES; ++i ) {
+        level = DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_SET_BATTERY_LEVEL,
+                                 ARENA_EXTRA);
+        ck_assert(level != NULL);
+        level->level = i;
+        unsigned char *fill = DSMEMSG_EXTRA(level);
+        ck_assert(fill != NULL);
+        memset(fill, i, ARENA_EXTRA);
+    }
+
+    /* All frames go out together; what the socket does not take is
+     * queued and written out by the main loop */
+    int fd[2];
+    int sndbuf = 4096;
+    GMainContext *context = g_main_context_new();
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    ck_assert_int_eq(setsockopt(fd[0], SOL_SOCKET, SO_SNDBUF,
+                                &sndbuf, sizeof sndbuf), 0);
+    dsmesock_connection_t *tx = dsmesock_init(fd[0]);
+    dsmesock_connection_t *rx = dsmesock_init(fd[1]);
+    int ignored = 0;
+    ck_assert(dsmesock_attach(tx, context, rxsize_handler, &ignored));
+
+    /* Nothing goes out if a header no longer matches the layout */
+    dsmemsg_generic_t *first = (dsmemsg_generic_t *)arena.buf;
+    first->line_size_ += 8;
+    errno = 0;
+    ck_assert_int_eq(dsmesock_send_arena(tx, &arena), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    first->line_size_ = 4;
+    ck_assert(dsmemsg_arena_next(&arena, 0) == NULL);
+    errno = 0;
+    ck_assert_int_eq(dsmesock_send_arena(tx, &arena), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    first->line_size_ = sizeof *level + ARENA_EXTRA;
+    ck_assert(dsmesock_get_stats(tx, &stats));
+    ck_assert_uint_eq(stats.bytes_out, 0);
+
+    /* Padding between the frames is not sent */
+    ck_assert_int_eq(dsmesock_send_arena(tx, &arena),
+                     ARENA_FRAMES * (sizeof *level + ARENA_EXTRA));
+    ck_assert_uint_lt(ARENA_FRAMES * (sizeof *level + ARENA_EXTRA),
+                      arena.used);
+
+    int received = 0;
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( received < ARENA_FRAMES && now_ns() < deadline ) {
+        g_main_context_iteration(context, FALSE);
+        while( received < ARENA_FRAMES &&
+               (recvd = dsmesock_receive(rx)) != NULL ) {
+            const DSM_MSGTYPE_SET_BATTERY_LEVEL *got =
+                DSMEMSG_CAST(DSM_MSGTYPE_SET_BATTERY_LEVEL, recvd);
+            ck_assert(got != NULL);
+            ck_assert_int_eq(got->level, received);
+            ck_assert_uint_eq(dsmemsg_extra_size(recvd), ARENA_EXTRA);
+            const unsigned char *extra = dsmemsg_extra_data(recvd);
+            ck_assert_int_eq(extra[0], received & 0xff);
+            ck_assert_int_eq(extra[ARENA_EXTRA - 1], received & 0xff);
+            ++received;
+            free(recvd);
+        }
+    }
+    ck_assert_int_eq(received, ARENA_FRAMES);
+    ck_assert(dsmesock_get_stats(tx, &stats));
+    ck_assert_uint_eq(stats.msgs_out, ARENA_FRAMES);
+    ck_assert(stats.short_writes > 0);
+
+    unsigned char *buf = arena.buf;
+    dsmemsg_arena_reset(&arena);
+    ck_assert(DSME_MSG_RESERVE(&arena, DSM_MSGTYPE_STATE_QUERY, 0) ==
+              (void *)buf);
+    dsmemsg_arena_release(&arena);
+
+    dsmesock_close(tx);
+    dsmesock_close(rx);
+    g_main_context_unref(context);
+}
+END_TEST
+
+START_TEST(test_unattached_flush)
+{
+    static char payload[1024];
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    const size_t frame = sizeof query + sizeof payload;
+    int sndbuf = 4096;
+    int fd[2];
+    int sent = 0;
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    ck_assert_int_eq(setsockopt(fd[0], SOL_SOCKET, SO_SNDBUF,
+                                &sndbuf, sizeof sndbuf), 0);
+    dsmesock_connection_t *connection = dsmesock_init(fd[0]);
     ck_assert(connection != NULL);
 
-    DSM_MSGTYPE_STATE_QUERY msg = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
-    log_notice("TEST: send(%s)", dsmemsg_name((dsmemsg_generic_t *)&msg));
-    dsmesock_broadcast(&msg);
+    /* Peer that does not read leaves output queued */
+    ck_assert(!dsmesock_has_pending_output(connection));
+    ck_assert_int_eq(dsmesock_flush(connection), 0);
+    while( !dsmesock_has_pending_output(connection) ) {
+        ck_assert_int_eq(dsmesock_send_with_extra(connection, &query,
+                                                  sizeof payload, payload),
+                         frame);
+        ck_assert_int_lt(++sent, 1000);
+    }
 
-    ck_assert(wait_input(connection->fd) == 1);
+    /* Without a main loop, flushing is what gets the rest out */
+    size_t total = sent * frame;
+    char  *sink  = malloc(total + 1);
+    size_t got   = 0;
+    ssize_t rc;
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+
+    ck_assert(sink != NULL);
+    while( got < total && now_ns() < deadline ) {
+        while( (rc = recv(fd[1], sink + got, total + 1 - got,
+                          MSG_DONTWAIT)) > 0 )
+            got += rc;
+        ck_assert_int_eq(dsmesock_flush(connection), 0);
+    }
+    ck_assert(!dsmesock_has_pending_output(connection));
+    ck_assert_uint_eq(got, total);
+
+    /* ... with frames intact and in order */
+    for( size_t offs = 0; offs < total; offs += frame ) {
+        dsmemsg_generic_t header;
+        memcpy(&header, sink + offs, sizeof header);
+        ck_assert_uint_eq(header.line_size_, frame);
+        ck_assert_uint_eq(header.type_, DSME_MSG_ID_(DSM_MSGTYPE_STATE_QUERY));
+    }
 
-    dsmemsg_generic_t *reply = dsmesock_receive(connection);
-    ck_assert(reply != NULL);
-    log_notice("TEST: recv(%s)", dsmemsg_name(reply));
-    ck_assert_int_eq(dsmemsg_id(reply),
-                     DSME_MSG_ID_(DSM_MSGTYPE_STATE_REQ_DENIED_IND));
-    ck_assert_int_eq(dsmemsg_extra_size(reply), sizeof mock_extra);
-    DSM_MSGTYPE_STATE_REQ_DENIED_IND *state_reply =
-        DSMEMSG_CAST(DSM_MSGTYPE_STATE_REQ_DENIED_IND, reply);
-    ck_assert(state_reply != NULL);
-    ck_assert_int_eq(state_reply->state, DSME_STATE_TEST);
-    const char *extra = DSMEMSG_EXTRA(state_reply);
-    ck_assert(extra != NULL);
-    size_t length = strnlen(extra, sizeof mock_extra);
-    ck_assert(length < sizeof mock_extra);
-    ck_assert(strcmp(extra, mock_extra) == 0);
+    free(sink);
+    dsmesock_close(connection);
+    close(fd[1]);
+}
+END_TEST
 
-    free(reply);
+typedef struct
+{
+    int received;
+    int misaligned;
+} alignment_state_t;
+
+static bool alignment_handler(dsmesock_connection_t *conn,
+                              const dsmemsg_generic_t *msg, void *user_data)
+{
+    alignment_state_t *state = user_data;
+    const char *extra = DSMEMSG_EXTRA(msg);
+
+    (void)conn;
+
+    if( ((uintptr_t)msg & 7) != 0 )
+        ++state->misaligned;
+    if( DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) &&
+        dsmemsg_extra_size(msg) == 3 && extra && extra[0] == 'a' &&
+        extra[2] == 'c' )
+        ++state->received;
+    return true;
+}
+
+START_TEST(test_dispatch_alignment)
+{
+    DSM_MSGTYPE_STATE_QUERY query = DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+    GMainContext *context = g_main_context_new();
+    alignment_state_t state = { 0, 0 };
+    int fd[2];
+
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *tx = dsmesock_init(fd[0]);
+    dsmesock_connection_t *rx = dsmesock_init(fd[1]);
+    ck_assert(dsmesock_attach(rx, context, alignment_handler, &state));
+
+    /* Odd sized frames read ahead together do not start at aligned
+     * offsets of the receive buffer; handlers still get aligned ones */
+    for( int i = 0; i < 8; ++i )
+        ck_assert(dsmesock_send_with_extra(tx, &query, 3, "abc") > 0);
+
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( state.received < 8 && now_ns() < deadline )
+        g_main_context_iteration(context, FALSE);
+    ck_assert_int_eq(state.received, 8);
+    ck_assert_int_eq(state.misaligned, 0);
+
+    dsmesock_close(tx);
+    dsmesock_close(rx);
+    g_main_context_unref(context);
+}
+END_TEST
+
+static bool oos_handler(dsmesock_connection_t *connection,
+                        const dsmemsg_generic_t *msg, void *user_data)
+{
+    const DSM_MSGTYPE_CLOSE *close_msg = DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, msg);
+    int *reason = user_data;
+
+    (void)connection;
+
+    if( close_msg )
+        *reason = close_msg->reason;
+    else
+        *reason = -2;
+    return true;
+}
+
+START_TEST(test_invalid_size)
+{
+    GMainContext *context = g_main_context_new();
+    const uint32_t version = DSME_MSG_ID_(DSM_MSGTYPE_DSME_VERSION);
+    DSM_MSGTYPE_GET_VERSION get = DSME_MSG_INIT(DSM_MSGTYPE_GET_VERSION);
+    call_state_t state = { .replies = 0 };
+    int reason = -1;
+    int fd[2];
+
+    /* Reply claiming a body larger than the whole frame */
+    struct {
+        dsmemsg_generic_t header;
+        uint64_t          token;
+    } frame;
+    memset(&frame, 0, sizeof frame);
+    frame.header.line_size_ = sizeof frame;
+    frame.header.size_      = 4096;
+    frame.header.type_      = version;
+    frame.token             = 1111;
+
+    /* Attached connection closes without handing it to anyone */
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *connection = dsmesock_init(fd[0]);
+    ck_assert(dsmesock_attach(connection, context, oos_handler, &reason));
+    ck_assert(dsmesock_call_async(connection, &get, 0, NULL, version,
+                                  1111, 5000, call_reply_cb, &state));
+    ck_assert_int_eq(write(fd[1], &frame, sizeof frame), sizeof frame);
+
+    int64_t deadline = now_ns() + INT64_C(5000000000);
+    while( reason == -1 && now_ns() < deadline )
+        g_main_context_iteration(context, FALSE);
+    ck_assert_int_eq(reason, TSMSG_CLOSE_REASON_OOS);
+    ck_assert_int_eq(state.replies, 0);
+    ck_assert_int_eq(state.timeouts, 1);
+    dsmesock_close(connection);
+    close(fd[1]);
+
+    /* ... and so does one that is polled */
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    connection = dsmesock_init(fd[0]);
+    ck_assert_int_eq(write(fd[1], &frame, sizeof frame), sizeof frame);
+    DSM_MSGTYPE_CLOSE *close_msg =
+        dsmesock_receive_timeout(connection, now_ns() +
+                                 INT64_C(5000000000));
+    ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_CLOSE, close_msg) != NULL);
+    ck_assert_int_eq(close_msg->reason, TSMSG_CLOSE_REASON_OOS);
+    free(close_msg);
+    dsmesock_close(connection);
+    close(fd[1]);
+
+    g_main_context_unref(context);
+}
+END_TEST
+
+/** Detach on the first frame */
+static bool detach_handler(dsmesock_connection_t *connection,
+                           const dsmemsg_generic_t *msg, void *user_data)
+{
+    int *handled = user_data;
+
+    (void)msg;
+    ++*handled;
+    dsmesock_detach(connection);
+    return true;
+}
+
+START_TEST(test_detach_in_handler)
+{
+    GMainContext *context = g_main_context_new();
+    DSM_MSGTYPE_STATE_QUERY query[3];
+    int handled = 0;
+    int fd[2];
+
+    for( int i = 0; i < 3; ++i )
+        query[i] = (DSM_MSGTYPE_STATE_QUERY)
+                   DSME_MSG_INIT(DSM_MSGTYPE_STATE_QUERY);
+
+    /* All three frames are read ahead in one go */
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fd), 0);
+    dsmesock_connection_t *connection = dsmesock_init(fd[0]);
+    ck_assert(dsmesock_attach(connection, context, detach_handler,
+                              &handled));
+    ck_assert_int_eq(write(fd[1], query, sizeof query), sizeof query);
+
+    for( int i = 0; i < 100 && !handled; ++i )
+        g_main_context_iteration(context, FALSE);
+    for( int i = 0; i < 10; ++i )
+        g_main_context_iteration(context, FALSE);
+    ck_assert_int_eq(handled, 1);
+
+    /* The frames left over are received by the caller */
+    for( int i = 0; i < 2; ++i ) {
+        dsmemsg_generic_t *msg =
+            dsmesock_receive_timeout(connection, now_ns() +
+                                     INT64_C(1000000000));
+        ck_assert(DSMEMSG_CAST(DSM_MSGTYPE_STATE_QUERY, msg) != NULL);
+        free(msg);
+    }
 
     dsmesock_close(connection);
+    close(fd[1]);
+    g_main_context_unref(context);
 }
 END_TEST
 
@@ -361,6 +2176,32 @@ static Suite *libdsme_suite(void)
 
     tcase_add_test(testcase, test_message);
     tcase_add_test(testcase, test_send_receive);
+    tcase_add_test(testcase, test_attach);
+    tcase_add_test(testcase, test_msgstats);
+    tcase_add_test(testcase, test_capture);
+    tcase_add_test(testcase, test_flightrec);
+    tcase_add_test(testcase, test_call_async);
+    tcase_add_test(testcase, test_receive_timeout);
+    tcase_add_test(testcase, test_rate_limit);
+    tcase_add_test(testcase, test_dispatch_fairness);
+    tcase_add_test(testcase, test_backlog_limits);
+    tcase_add_test(testcase, test_broadcast_acked);
+    tcase_add_test(testcase, test_statuspage);
+    tcase_add_test(testcase, test_thermal_registry);
+    tcase_add_test(testcase, test_thermal_aggregator);
+    tcase_add_test(testcase, test_battery_filter);
+    tcase_add_test(testcase, test_wakeup_scheduler);
+    tcase_add_test(testcase, test_wakeup_coalescing);
+    tcase_add_test(testcase, test_loopback);
+    tcase_add_test(testcase, test_sendqueue);
+    tcase_add_test(testcase, test_server);
+    tcase_add_test(testcase, test_connection_slots);
+    tcase_add_test(testcase, test_receive_buffer_sizing);
+    tcase_add_test(testcase, test_message_arena);
+    tcase_add_test(testcase, test_unattached_flush);
+    tcase_add_test(testcase, test_dispatch_alignment);
+    tcase_add_test(testcase, test_invalid_size);
+    tcase_add_test(testcase, test_detach_in_handler);
 
     suite_add_tcase(suite, testcase);
 
@@ -428,11 +2269,8 @@ int main(int argc, char **argv)
         }
     }
 
-    /* Make dsmesock_connect() talk to mock daemon */
-    setenv("DSME_SOCKFILE", mock_socket, 1);
-
     /* Start mock daemon child process */
-    if( !daemon_start() )
+    if( !mock_daemon_start(mock_socket, daemon_handle_message) )
         goto bailout;
 
     /* Run the tests */
@@ -445,7 +2283,7 @@ int main(int argc, char **argv)
 
 bailout:
     /* Terminate mock daemon child process */
-    daemon_stop();
+    mock_daemon_stop();
 
     return exit_code;
 }
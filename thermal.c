@@ -0,0 +1,443 @@
+/**
+   @file thermal.c
+
+   Thermal sensor registry for compact thermal status messages, and
+   per-sensor aggregation of thermal status updates.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/thermal.h"
+#include "dsme_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+
+/* ------------------------------------------------------------------------- *
+ * Registry
+ * ------------------------------------------------------------------------- */
+
+struct dsme_thermal_registry_t
+{
+    /** Sensors indexed by id */
+    dsme_thermal_sensor_t sensors[DSME_THERMAL_SENSORS_MAX];
+
+    /** Sensor name -> sensor, for announcing and legacy messages */
+    GHashTable           *by_name;
+
+    /** Number of ids in use; ids are allocated from zero upwards */
+    uint32_t              count;
+};
+
+/** Copy sensor name, which need not be nul terminated in messages */
+static void
+thermal_copy_name(char *dst, const char *src)
+{
+    size_t len = strnlen(src, DSM_TEMP_SENSOR_MAX_NAME_LEN - 1);
+
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+/** Bind a name to an id, replacing whatever the id was used for */
+static dsme_thermal_sensor_t *
+thermal_bind(dsme_thermal_registry_t *reg, uint32_t id, const char *name)
+{
+    dsme_thermal_sensor_t *sensor = &reg->sensors[id];
+
+    if( id < reg->count && sensor->name[0] )
+        g_hash_table_remove(reg->by_name, sensor->name);
+
+    memset(sensor, 0, sizeof *sensor);
+    sensor->id = id;
+    thermal_copy_name(sensor->name, name);
+    g_hash_table_replace(reg->by_name, sensor->name, sensor);
+
+    if( reg->count <= id )
+        reg->count = id + 1;
+    return sensor;
+}
+
+/** Find a sensor by name, or give it the next free id */
+static dsme_thermal_sensor_t *
+thermal_intern(dsme_thermal_registry_t *reg, const char *name, bool *added)
+{
+    char                   key[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+    dsme_thermal_sensor_t *sensor;
+
+    thermal_copy_name(key, name);
+    *added = false;
+
+    if( (sensor = g_hash_table_lookup(reg->by_name, key)) )
+        return sensor;
+
+    if( reg->count == DSME_THERMAL_SENSORS_MAX )
+        return 0;
+
+    *added = true;
+    return thermal_bind(reg, reg->count, key);
+}
+
+dsme_thermal_registry_t *
+dsme_thermal_registry_new(void)
+{
+    dsme_thermal_registry_t *reg = calloc(1, sizeof *reg);
+
+    if( reg )
+        reg->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    return reg;
+}
+
+void
+dsme_thermal_registry_free(dsme_thermal_registry_t *reg)
+{
+    if( reg ) {
+        g_hash_table_unref(reg->by_name);
+        free(reg);
+    }
+}
+
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_sensor(const dsme_thermal_registry_t *reg, uint32_t id)
+{
+    if( id >= reg->count || !reg->sensors[id].name[0] )
+        return 0;
+    return &reg->sensors[id];
+}
+
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_find(const dsme_thermal_registry_t *reg,
+                           const char *name)
+{
+    char key[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+
+    thermal_copy_name(key, name);
+    return g_hash_table_lookup(reg->by_name, key);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Sending
+ * ------------------------------------------------------------------------- */
+
+int
+dsme_thermal_send_status(dsmesock_connection_t *conn,
+                         dsme_thermal_registry_t *reg,
+                         const char *sensor_name,
+                         dsme_thermal_status_t status,
+                         int temperature)
+{
+    DSM_MSGTYPE_THERMAL_SENSOR_STATUS msg =
+        DSME_MSG_INIT(DSM_MSGTYPE_THERMAL_SENSOR_STATUS);
+    dsme_thermal_sensor_t *sensor;
+    bool                   added;
+
+    if( !(sensor = thermal_intern(reg, sensor_name, &added)) ) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if( added ) {
+        DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE announce =
+            DSME_MSG_INIT(DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE);
+
+        announce.sensor_id = sensor->id;
+        memcpy(announce.sensor_name, sensor->name,
+               sizeof announce.sensor_name);
+        if( dsmesock_send(conn, &announce) == -1 ) {
+            /* Forget the name, so that it gets announced next time */
+            g_hash_table_remove(reg->by_name, sensor->name);
+            memset(sensor, 0, sizeof *sensor);
+            --reg->count;
+            return -1;
+        }
+    }
+
+    msg.sensor_id   = sensor->id;
+    msg.status      = status;
+    msg.temperature = temperature;
+    if( dsmesock_send(conn, &msg) == -1 )
+        return -1;
+
+    sensor->status      = status;
+    sensor->temperature = temperature;
+    sensor->valid       = true;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Receiving
+ * ------------------------------------------------------------------------- */
+
+const dsme_thermal_sensor_t *
+dsme_thermal_registry_handle(dsme_thermal_registry_t *reg,
+                             const dsmemsg_generic_t *msg)
+{
+    const DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE *announce;
+    const DSM_MSGTYPE_THERMAL_SENSOR_STATUS   *compact;
+    const DSM_MSGTYPE_SET_THERMAL_STATUS      *legacy;
+    dsme_thermal_sensor_t                     *sensor = 0;
+    bool                                       added;
+
+    if( (compact = DSMEMSG_CAST(DSM_MSGTYPE_THERMAL_SENSOR_STATUS, msg)) ) {
+        if( compact->sensor_id >= reg->count ||
+            !reg->sensors[compact->sensor_id].name[0] )
+            return 0;
+        sensor              = &reg->sensors[compact->sensor_id];
+        sensor->status      = compact->status;
+        sensor->temperature = compact->temperature;
+    }
+    else if( (legacy = DSMEMSG_CAST(DSM_MSGTYPE_SET_THERMAL_STATUS, msg)) ) {
+        if( !(sensor = thermal_intern(reg, legacy->sensor_name, &added)) )
+            return 0;
+        sensor->status      = legacy->status;
+        sensor->temperature = legacy->temperature;
+    }
+    else if( (announce = DSMEMSG_CAST(DSM_MSGTYPE_THERMAL_SENSOR_ANNOUNCE,
+                                      msg)) ) {
+        char key[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+
+        thermal_copy_name(key, announce->sensor_name);
+        if( announce->sensor_id < DSME_THERMAL_SENSORS_MAX && key[0] ) {
+            /* A name can be bound to one id only */
+            if( (sensor = g_hash_table_lookup(reg->by_name, key)) &&
+                sensor->id != announce->sensor_id ) {
+                g_hash_table_remove(reg->by_name, sensor->name);
+                memset(sensor->name, 0, sizeof sensor->name);
+            }
+            thermal_bind(reg, announce->sensor_id, key);
+        }
+        return 0;
+    }
+
+    if( sensor )
+        sensor->valid = true;
+    return sensor;
+}
+
+/* ------------------------------------------------------------------------- *
+ * Aggregation
+ * ------------------------------------------------------------------------- */
+
+typedef struct
+{
+    int64_t timestamp_ns;
+    int     temperature;
+} thermal_sample_t;
+
+typedef struct
+{
+    char                  name[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+    dsme_thermal_status_t status;
+
+    /** Sample ring; head is the next slot to write */
+    thermal_sample_t      ring[DSME_THERMAL_WINDOW_SAMPLES];
+    unsigned              head;
+    unsigned              used;
+
+    /** Last update passed on */
+    bool                  published;
+    dsme_thermal_status_t published_status;
+    int                   published_temperature;
+    int64_t               published_ns;
+} thermal_series_t;
+
+struct dsme_thermal_aggregator_t
+{
+    dsme_thermal_aggregator_config_t config;
+    dsme_thermal_publish_cb_t        callback;
+    void                            *user_data;
+
+    /** Sensor name -> thermal_series_t */
+    GHashTable                      *series;
+};
+
+/** Compute statistics over samples no older than the window */
+static void
+thermal_series_stats(const thermal_series_t *ser, int64_t window_ns,
+                     int64_t now_ns, dsme_thermal_stats_t *stats)
+{
+    const thermal_sample_t *latest =
+        &ser->ring[(ser->head + DSME_THERMAL_WINDOW_SAMPLES - 1) %
+                   DSME_THERMAL_WINDOW_SAMPLES];
+    double   sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+    unsigned n     = 0;
+
+    memset(stats, 0, sizeof *stats);
+    stats->status      = ser->status;
+    stats->temperature = latest->temperature;
+    stats->min         = latest->temperature;
+    stats->max         = latest->temperature;
+
+    /* Newest first, until the window or the ring runs out */
+    for( unsigned i = 1; i <= ser->used; ++i ) {
+        const thermal_sample_t *smp =
+            &ser->ring[(ser->head + DSME_THERMAL_WINDOW_SAMPLES - i) %
+                       DSME_THERMAL_WINDOW_SAMPLES];
+        double x, y;
+
+        if( window_ns && now_ns - smp->timestamp_ns > window_ns )
+            break;
+
+        /* Seconds relative to the latest sample keep values small */
+        x = (smp->timestamp_ns - latest->timestamp_ns) / 1e9;
+        y = smp->temperature;
+
+        if( stats->min > smp->temperature )
+            stats->min = smp->temperature;
+        if( stats->max < smp->temperature )
+            stats->max = smp->temperature;
+
+        sum_x  += x;
+        sum_y  += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+        ++n;
+    }
+
+    stats->samples = n;
+    if( n > 0 )
+        stats->mean = sum_y / n;
+    if( n > 1 ) {
+        double den = n * sum_xx - sum_x * sum_x;
+        if( den > 0 )
+            stats->slope = (n * sum_xy - sum_x * sum_y) / den;
+    }
+}
+
+dsme_thermal_aggregator_t *
+dsme_thermal_aggregator_new(const dsme_thermal_aggregator_config_t *config,
+                            dsme_thermal_publish_cb_t callback,
+                            void *user_data)
+{
+    dsme_thermal_aggregator_t *agg = calloc(1, sizeof *agg);
+
+    if( !agg )
+        return 0;
+
+    if( config )
+        agg->config = *config;
+    agg->callback  = callback;
+    agg->user_data = user_data;
+    agg->series    = g_hash_table_new_full(g_str_hash, g_str_equal, 0, free);
+    return agg;
+}
+
+void
+dsme_thermal_aggregator_free(dsme_thermal_aggregator_t *agg)
+{
+    if( agg ) {
+        g_hash_table_unref(agg->series);
+        free(agg);
+    }
+}
+
+bool
+dsme_thermal_aggregator_feed(dsme_thermal_aggregator_t *agg,
+                             const char *sensor,
+                             dsme_thermal_status_t status,
+                             int temperature,
+                             int64_t timestamp_ns)
+{
+    const dsme_thermal_aggregator_config_t *cfg = &agg->config;
+    char                                    key[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+    thermal_series_t                       *ser;
+    thermal_sample_t                       *smp;
+    bool                                    publish;
+
+    thermal_copy_name(key, sensor);
+    if( !(ser = g_hash_table_lookup(agg->series, key)) ) {
+        if( !(ser = calloc(1, sizeof *ser)) )
+            return false;
+        memcpy(ser->name, key, sizeof ser->name);
+        g_hash_table_insert(agg->series, ser->name, ser);
+    }
+
+    smp = &ser->ring[ser->head];
+    smp->timestamp_ns = timestamp_ns;
+    smp->temperature  = temperature;
+    ser->head = (ser->head + 1) % DSME_THERMAL_WINDOW_SAMPLES;
+    if( ser->used < DSME_THERMAL_WINDOW_SAMPLES )
+        ++ser->used;
+    ser->status = status;
+
+    if( !ser->published || ser->published_status != status )
+        publish = true;
+    else if( cfg->delta == 0 ||
+             (unsigned)abs(temperature - ser->published_temperature) <
+             cfg->delta )
+        publish = false;
+    else
+        publish = (timestamp_ns - ser->published_ns >=
+                   cfg->min_interval_ms * INT64_C(1000000));
+
+    if( !publish )
+        return false;
+
+    ser->published             = true;
+    ser->published_status      = status;
+    ser->published_temperature = temperature;
+    ser->published_ns          = timestamp_ns;
+
+    if( agg->callback ) {
+        dsme_thermal_stats_t stats;
+        thermal_series_stats(ser, cfg->window_ms * INT64_C(1000000),
+                             timestamp_ns, &stats);
+        agg->callback(ser->name, &stats, agg->user_data);
+    }
+    return true;
+}
+
+bool
+dsme_thermal_aggregator_handle(dsme_thermal_aggregator_t *agg,
+                               dsme_thermal_registry_t *reg,
+                               const dsmemsg_generic_t *msg)
+{
+    const dsme_thermal_sensor_t *sensor =
+        dsme_thermal_registry_handle(reg, msg);
+
+    if( !sensor )
+        return false;
+
+    return dsme_thermal_aggregator_feed(agg, sensor->name, sensor->status,
+                                        sensor->temperature,
+                                        dsme_monotonic_ns());
+}
+
+bool
+dsme_thermal_aggregator_stats(dsme_thermal_aggregator_t *agg,
+                              const char *sensor,
+                              int64_t now_ns,
+                              dsme_thermal_stats_t *stats)
+{
+    char              key[DSM_TEMP_SENSOR_MAX_NAME_LEN];
+    thermal_series_t *ser;
+
+    thermal_copy_name(key, sensor);
+    if( !(ser = g_hash_table_lookup(agg->series, key)) )
+        return false;
+
+    thermal_series_stats(ser, agg->config.window_ms * INT64_C(1000000),
+                         now_ns, stats);
+    return true;
+}
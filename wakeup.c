@@ -0,0 +1,384 @@
+/**
+   @file wakeup.c
+
+   Client side scheduler that aligns periodic work to dsme wakeups.
+   <p>
+   Copyright (C) 2026 Jolla Ltd.
+
+   This file is part of Dsme.
+
+   Dsme is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License
+   version 2.1 as published by the Free Software Foundation.
+
+   Dsme is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with Dsme.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "include/dsme/wakeup.h"
+#include "dsme_internal.h"
+
+#include <sys/timerfd.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <glib.h>
+
+/* ------------------------------------------------------------------------- *
+ * Types
+ * ------------------------------------------------------------------------- */
+
+typedef struct
+{
+    unsigned         id;
+    unsigned         min_ms;
+    unsigned         max_ms;
+
+    /** Current window, CLOCK_BOOTTIME */
+    int64_t          earliest_ns;
+    int64_t          latest_ns;
+
+    dsme_wakeup_cb_t callback;
+    void            *user_data;
+    bool             removed;
+} wakeup_task_t;
+
+typedef struct
+{
+    GSource                  base;
+    dsme_wakeup_scheduler_t *sched;
+    gpointer                 tag;
+} wakeup_source_t;
+
+struct dsme_wakeup_scheduler_t
+{
+    dsmesock_connection_t *conn;
+
+    GSList                *tasks;
+    unsigned               next_id;
+
+    /** Local timer and the main loop source watching it */
+    int                    timerfd;
+    wakeup_source_t       *source;
+
+    /** Tasks are being run; removed tasks are freed afterwards */
+    bool                   running;
+
+    /** Window last requested, or zeroes if none is pending */
+    int64_t                requested_min_ns;
+    int64_t                requested_max_ns;
+};
+
+/* ------------------------------------------------------------------------- *
+ * Utility
+ * ------------------------------------------------------------------------- */
+
+/** Wakeups are about wall time passing, including suspend */
+static int64_t
+wakeup_now_ns(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void
+wakeup_timer_arm(dsme_wakeup_scheduler_t *sched, int64_t when_ns)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    /* A zero it_value would disarm the timer */
+    if( when_ns > 0 ) {
+        its.it_value.tv_sec  = when_ns / 1000000000;
+        its.it_value.tv_nsec = when_ns % 1000000000;
+        if( !its.it_value.tv_sec && !its.it_value.tv_nsec )
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(sched->timerfd, TFD_TIMER_ABSTIME, &its, 0);
+}
+
+/** Arrange the wakeup to be requested again from the main loop, so that
+ *  changes made in one go result in one request */
+static void
+wakeup_reschedule(dsme_wakeup_scheduler_t *sched)
+{
+    g_source_set_ready_time(&sched->source->base, 0);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Scheduling
+ * ------------------------------------------------------------------------- */
+
+static void
+wakeup_schedule(dsme_wakeup_scheduler_t *sched)
+{
+    int64_t  earliest = 0;
+    int64_t  latest   = 0;
+    int64_t  now;
+    int64_t  deadline;
+    bool     sent     = false;
+
+    /* Wake up no later than the first window closes, but otherwise as
+     * late as possible, so that one wakeup covers as many tasks as it
+     * can */
+    for( GSList *item = sched->tasks; item; item = item->next ) {
+        const wakeup_task_t *task = item->data;
+
+        if( task->removed )
+            continue;
+        if( !latest || earliest < task->earliest_ns )
+            earliest = task->earliest_ns;
+        if( !latest || latest > task->latest_ns )
+            latest = task->latest_ns;
+    }
+    if( earliest > latest )
+        earliest = latest;
+
+    if( earliest == sched->requested_min_ns &&
+        latest   == sched->requested_max_ns )
+        return;
+
+    sched->requested_min_ns = earliest;
+    sched->requested_max_ns = latest;
+
+    if( !latest ) {
+        wakeup_timer_arm(sched, 0);
+        return;
+    }
+
+    now = wakeup_now_ns();
+    if( sched->conn ) {
+        DSM_MSGTYPE_WAKEUP_REQ req = DSME_MSG_INIT(DSM_MSGTYPE_WAKEUP_REQ);
+
+        /* Round towards the inside of the window */
+        if( earliest > now )
+            req.mintime_ms = (earliest - now + 999999) / 1000000;
+        if( latest > now )
+            req.maxtime_ms = (latest - now) / 1000000;
+        if( req.maxtime_ms < req.mintime_ms )
+            req.maxtime_ms = req.mintime_ms;
+
+        sent = dsmesock_send(sched->conn, &req) != -1;
+    }
+
+    deadline = latest;
+    if( sent )
+        deadline += DSME_WAKEUP_GRACE_MS * INT64_C(1000000);
+    wakeup_timer_arm(sched, deadline);
+}
+
+/** Run tasks whose window has opened */
+static void
+wakeup_run(dsme_wakeup_scheduler_t *sched)
+{
+    int64_t  now  = wakeup_now_ns();
+    GSList  *todo = g_slist_copy(sched->tasks);
+    bool     ran  = false;
+
+    /* Callbacks may add and remove tasks */
+    sched->running = true;
+    for( GSList *item = todo; item; item = item->next ) {
+        wakeup_task_t *task = item->data;
+
+        if( task->removed || task->earliest_ns > now )
+            continue;
+
+        ran = true;
+        if( !task->callback(task->user_data) )
+            task->removed = true;
+        task->earliest_ns = now + task->min_ms * INT64_C(1000000);
+        task->latest_ns   = now + task->max_ms * INT64_C(1000000);
+    }
+    sched->running = false;
+    g_slist_free(todo);
+
+    for( GSList *item = sched->tasks, *next; item; item = next ) {
+        wakeup_task_t *task = item->data;
+
+        next = item->next;
+        if( task->removed ) {
+            sched->tasks = g_slist_delete_link(sched->tasks, item);
+            free(task);
+        }
+    }
+
+    if( ran )
+        wakeup_reschedule(sched);
+}
+
+/** The pending request has been used up */
+static void
+wakeup_woken(dsme_wakeup_scheduler_t *sched)
+{
+    sched->requested_min_ns = 0;
+    sched->requested_max_ns = 0;
+    wakeup_run(sched);
+    wakeup_reschedule(sched);
+}
+
+/* ------------------------------------------------------------------------- *
+ * Main loop source
+ * ------------------------------------------------------------------------- */
+
+static gboolean
+wakeup_source_check(GSource *base)
+{
+    wakeup_source_t *src = (wakeup_source_t *)base;
+
+    return g_source_query_unix_fd(base, src->tag) != 0;
+}
+
+static gboolean
+wakeup_source_dispatch(GSource *base, GSourceFunc callback, gpointer data)
+{
+    wakeup_source_t         *src   = (wakeup_source_t *)base;
+    dsme_wakeup_scheduler_t *sched = src->sched;
+    uint64_t                 expirations;
+
+    (void)callback;
+    (void)data;
+
+    if( g_source_query_unix_fd(base, src->tag) & G_IO_IN ) {
+        if( read(sched->timerfd, &expirations, sizeof expirations) > 0 )
+            wakeup_woken(sched);
+    }
+
+    /* Requesting the wakeup below covers whatever asked for it */
+    g_source_set_ready_time(base, -1);
+    wakeup_schedule(sched);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs wakeup_source_funcs = {
+    .check    = wakeup_source_check,
+    .dispatch = wakeup_source_dispatch,
+};
+
+/* ------------------------------------------------------------------------- *
+ * Public interface
+ * ------------------------------------------------------------------------- */
+
+dsme_wakeup_scheduler_t *
+dsme_wakeup_scheduler_new(struct _GMainContext *context)
+{
+    dsme_wakeup_scheduler_t *sched = calloc(1, sizeof *sched);
+    wakeup_source_t         *src;
+
+    if( !sched )
+        return 0;
+
+    sched->timerfd = timerfd_create(CLOCK_BOOTTIME,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+    if( sched->timerfd == -1 ) {
+        free(sched);
+        return 0;
+    }
+
+    src = (wakeup_source_t *)g_source_new(&wakeup_source_funcs, sizeof *src);
+    src->sched = sched;
+    src->tag   = g_source_add_unix_fd(&src->base, sched->timerfd, G_IO_IN);
+    g_source_set_name(&src->base, "dsme-wakeup");
+    g_source_attach(&src->base, context);
+    sched->source = src;
+
+    return sched;
+}
+
+void
+dsme_wakeup_scheduler_free(dsme_wakeup_scheduler_t *sched)
+{
+    if( !sched )
+        return;
+
+    g_source_destroy(&sched->source->base);
+    g_source_unref(&sched->source->base);
+    close(sched->timerfd);
+    g_slist_free_full(sched->tasks, free);
+    free(sched);
+}
+
+void
+dsme_wakeup_scheduler_set_connection(dsme_wakeup_scheduler_t *sched,
+                                     dsmesock_connection_t *conn)
+{
+    sched->conn             = conn;
+    sched->requested_min_ns = 0;
+    sched->requested_max_ns = 0;
+    wakeup_reschedule(sched);
+}
+
+unsigned
+dsme_wakeup_add(dsme_wakeup_scheduler_t *sched,
+                unsigned min_ms, unsigned max_ms,
+                dsme_wakeup_cb_t callback, void *user_data)
+{
+    wakeup_task_t *task;
+    int64_t        now;
+
+    if( !callback || !(task = calloc(1, sizeof *task)) )
+        return 0;
+
+    if( max_ms < min_ms )
+        max_ms = min_ms;
+
+    /* Zero is not a valid id */
+    if( ++sched->next_id == 0 )
+        ++sched->next_id;
+
+    now = wakeup_now_ns();
+    task->id          = sched->next_id;
+    task->min_ms      = min_ms;
+    task->max_ms      = max_ms;
+    task->earliest_ns = now + min_ms * INT64_C(1000000);
+    task->latest_ns   = now + max_ms * INT64_C(1000000);
+    task->callback    = callback;
+    task->user_data   = user_data;
+
+    sched->tasks = g_slist_append(sched->tasks, task);
+    wakeup_reschedule(sched);
+    return task->id;
+}
+
+void
+dsme_wakeup_remove(dsme_wakeup_scheduler_t *sched, unsigned id)
+{
+    for( GSList *item = sched->tasks; item; item = item->next ) {
+        wakeup_task_t *task = item->data;
+
+        if( task->id != id || task->removed )
+            continue;
+
+        if( sched->running ) {
+            task->removed = true;
+        }
+        else {
+            sched->tasks = g_slist_delete_link(sched->tasks, item);
+            free(task);
+        }
+        wakeup_reschedule(sched);
+        break;
+    }
+}
+
+bool
+dsme_wakeup_handle(dsme_wakeup_scheduler_t *sched,
+                   const dsmemsg_generic_t *msg)
+{
+    if( DSMEMSG_CAST(DSM_MSGTYPE_WAKEUP_IND, msg) ) {
+        wakeup_woken(sched);
+        return true;
+    }
+
+    return false;
+}